@@ -9,6 +9,8 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "cap_hash.h"
+
 /*
  * #include 'sed' generated array
  */
@@ -35,10 +37,93 @@ static void *recalloc(void *p, int was, int is) {
     return n;
 }
 
+/*
+ * Displacements are searched up to this limit before giving up.
+ */
+#define MAX_DISPLACEMENT 65535
+
+/*
+ * perfect_hash builds a minimal perfect hash ("hash and displace") of
+ * the nslots known names. Each name falls in one of nbuckets buckets
+ * according to its seed 0 hash. Each bucket is then given a
+ * displacement (seed), disp[bucket], with which the hashes of all of
+ * its names land in distinct, unused slots. The largest buckets are
+ * placed first.
+ */
+static void perfect_hash(const char **pointers, int maxcaps, int nslots,
+			 int nbuckets, unsigned *disp, int *slots)
+{
+    int *bucket_of = calloc(maxcaps, sizeof(int));
+    int *size = calloc(nbuckets, sizeof(int));
+    int *order = calloc(nbuckets, sizeof(int));
+    int i, j, k;
+
+    if (!bucket_of || !size || !order) {
+	fputs("out of memory", stderr);
+	exit(1);
+    }
+    for (i = 0; i < nslots; i++) {
+	slots[i] = -1;
+    }
+    for (i = 0; i < maxcaps; i++) {
+	if (pointers[i]) {
+	    const char *n = pointers[i];
+	    bucket_of[i] = _cap_name_hash(n, strlen(n), 0) % nbuckets;
+	    size[bucket_of[i]]++;
+	}
+    }
+    for (i = 0; i < nbuckets; i++) {
+	for (j = i; j > 0 && size[order[j-1]] < size[i]; j--) {
+	    order[j] = order[j-1];
+	}
+	order[j] = i;
+    }
+
+    for (k = 0; k < nbuckets && size[order[k]]; k++) {
+	int b = order[k];
+	unsigned d;
+	for (d = 1; d <= MAX_DISPLACEMENT; d++) {
+	    int placed = 0;
+	    for (i = 0; i < maxcaps; i++) {
+		if (!pointers[i] || bucket_of[i] != b) {
+		    continue;
+		}
+		int s = _cap_name_hash(pointers[i], strlen(pointers[i]), d)
+		    % nslots;
+		if (slots[s] != -1) {
+		    break;
+		}
+		slots[s] = i;
+		placed++;
+	    }
+	    if (placed == size[b]) {
+		disp[b] = d;
+		break;
+	    }
+	    /* undo this partial placement */
+	    for (i = 0; i < nslots; i++) {
+		if (slots[i] >= 0 && bucket_of[slots[i]] == b) {
+		    slots[i] = -1;
+		}
+	    }
+	}
+	if (d > MAX_DISPLACEMENT) {
+	    fprintf(stderr, "unable to find a perfect hash for bucket %d\n", b);
+	    exit(1);
+	}
+    }
+
+    free(order);
+    free(size);
+    free(bucket_of);
+}
+
 int main(void)
 {
-    int i, maxcaps=0, maxlength=0;
+    int i, maxcaps=0, maxlength=0, named=0, nbuckets;
     const char **pointers = NULL;
+    unsigned *disp;
+    int *slots;
     int pointers_avail = 0;
 
     for ( i=0; list[i].index >= 0 && list[i].name; ++i ) {
@@ -55,12 +140,22 @@ int main(void)
 	    }
         }
 	pointers[list[i].index] = list[i].name;
+	named++;
 	int n = strlen(list[i].name);
 	if (n > maxlength) {
 	    maxlength = n;
 	}
     }
 
+    nbuckets = (named + 1) / 2;
+    disp = calloc(nbuckets, sizeof(unsigned));
+    slots = calloc(named, sizeof(int));
+    if (disp == NULL || slots == NULL) {
+	fputs("out of memory", stderr);
+	exit(1);
+    }
+    perfect_hash(pointers, maxcaps, named, nbuckets, disp, slots);
+
     printf("/*\n"
 	   " * DO NOT EDIT: this file is generated automatically from\n"
 	   " *\n"
@@ -80,11 +175,27 @@ int main(void)
 	}
     }
 
+    printf("  }\n"
+	   "\n"
+	   "/* minimal perfect hash of the names, see cap_hash.h */\n"
+	   "#define __CAP_HASH_BUCKETS %d\n"
+	   "#define __CAP_HASH_SLOTS   %d\n"
+	   "#define LIBCAP_CAP_HASH_DISP { \\\n", nbuckets, named);
+    for (i=0; i<nbuckets; ++i) {
+	printf("      %u, \\\n", disp[i]);
+    }
+    printf("  }\n"
+	   "#define LIBCAP_CAP_HASH_SLOTS { \\\n");
+    for (i=0; i<named; ++i) {
+	printf("      %d,\t/* %s */ \\\n", slots[i], pointers[slots[i]]);
+    }
     printf("  }\n"
 	   "#endif /* LIBCAP_PLEASE_INCLUDE_ARRAY */\n"
 	   "\n"
 	   "/* END OF FILE */\n");
 
+    free(slots);
+    free(disp);
     free(pointers);
     exit(0);
 }
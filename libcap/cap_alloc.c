@@ -16,6 +16,7 @@ static __u8 __libcap_mutex;
  * These get set via the pre-main() executed constructor function below it.
  */
 static cap_value_t _cap_max_bits;
+static __u32 _cap_version;
 
 __attribute__((visibility ("hidden")))
 __attribute__((constructor (300))) void _libcap_initialize(void)
@@ -23,6 +24,11 @@ __attribute__((constructor (300))) void _libcap_initialize(void)
     int errno_saved = errno;
     _cap_mu_lock(&__libcap_mutex);
     if (!_cap_max_bits) {
+	struct __user_cap_header_struct head = {
+	    .version = _LIBCAP_CAPABILITY_VERSION
+	};
+	capget(&head, NULL);          /* load the kernel-capability version */
+	_cap_version = head.version;
 	cap_set_syscall(NULL, NULL);
 	_binary_search(_cap_max_bits, cap_get_bound, 0, __CAP_MAXBITS,
 		       __CAP_BITS);
@@ -37,7 +43,33 @@ cap_value_t cap_max_bits(void)
 }
 
 /*
- * capability allocation is all done in terms of this structure.
+ * _libcap_version returns the cached kernel-capability version.
+ */
+__attribute__((visibility ("hidden"))) __u32 _libcap_version(void)
+{
+    if (!_cap_version) {
+	_libcap_initialize();
+    }
+    return _cap_version;
+}
+
+/*
+ * Arena objects are carved out of chunks of this many slots.
+ */
+#define _CAP_ARENA_SLOTS 32
+
+struct _cap_arena_chunk_s;
+
+struct cap_arena_s {
+    __u8 mutex;
+    int used;
+    struct _cap_arena_chunk_s *chunks;
+};
+
+/*
+ * capability allocation is all done in terms of this structure. The
+ * next member is only used while a scrubbed object is cached on the
+ * free-list.
  */
 struct _cap_alloc_s {
     __u32 magic;
@@ -46,29 +78,142 @@ struct _cap_alloc_s {
 	struct _cap_struct set;
 	struct cap_iab_s iab;
 	struct cap_launch_s launcher;
+	struct cap_arena_s arena;
+	struct _cap_alloc_s *next;
     } u;
 };
 
+struct _cap_arena_chunk_s {
+    struct _cap_arena_chunk_s *next;
+    struct _cap_alloc_s slot[_CAP_ARENA_SLOTS];
+};
+
 /*
- * Obtain a blank set of capabilities
+ * Objects allocated from an arena have this bit set in their size.
+ * They are scrubbed by cap_free(), but their memory is only returned
+ * when the arena itself is freed.
  */
-cap_t cap_init(void)
+#define _CAP_ARENA_FLAG 0x80000000U
+
+/*
+ * Freed fixed size objects are (already scrubbed) cached on this
+ * bounded free-list to be recycled by the next allocation.
+ */
+#define _CAP_FREE_MAX 32
+
+static __u8 _cap_free_mu;
+static struct _cap_alloc_s *_cap_free_list;
+static int _cap_free_count;
+
+/*
+ * _cap_alloc obtains a zeroed fixed size object, tagged with magic.
+ */
+static struct _cap_alloc_s *_cap_alloc(__u32 magic)
+{
+    struct _cap_alloc_s *data;
+
+    _cap_mu_lock(&_cap_free_mu);
+    data = _cap_free_list;
+    if (data != NULL) {
+	_cap_free_list = data->u.next;
+	_cap_free_count--;
+    }
+    _cap_mu_unlock(&_cap_free_mu);
+
+    if (data != NULL) {
+	data->u.next = NULL;
+    } else {
+	data = calloc(1, sizeof(struct _cap_alloc_s));
+	if (data == NULL) {
+	    _cap_debug("out of memory");
+	    errno = ENOMEM;
+	    return NULL;
+	}
+    }
+    data->magic = magic;
+    data->size = sizeof(struct _cap_alloc_s);
+    return data;
+}
+
+/*
+ * _cap_release either caches a scrubbed fixed size object on the
+ * free-list or returns it to the heap.
+ */
+static void _cap_release(struct _cap_alloc_s *data)
+{
+    _cap_mu_lock(&_cap_free_mu);
+    if (_cap_free_count < _CAP_FREE_MAX) {
+	data->u.next = _cap_free_list;
+	_cap_free_list = data;
+	_cap_free_count++;
+	data = NULL;
+    }
+    _cap_mu_unlock(&_cap_free_mu);
+    free(data);
+}
+
+/*
+ * _libcap_alloc_forked is called in a fork()ed child of a possibly
+ * threaded parent. Another parent thread may have held _cap_free_mu,
+ * or been part way through updating the free-list, when the fork
+ * occurred. The child cannot wait for that thread, so it forgets the
+ * inherited free-list (leaking its cached objects) and starts afresh.
+ */
+__attribute__((visibility ("hidden"))) void _libcap_alloc_forked(void)
+{
+    _cap_free_list = NULL;
+    _cap_free_count = 0;
+    _cap_mu_unlock(&_cap_free_mu);
+}
+
+/*
+ * _cap_arena_alloc obtains a zeroed object from an arena.
+ */
+static struct _cap_alloc_s *_cap_arena_alloc(cap_arena_t arena, __u32 magic)
+{
+    struct _cap_alloc_s *data;
+
+    if (!good_cap_arena_t(arena)) {
+	_cap_debug("bad argument");
+	errno = EINVAL;
+	return NULL;
+    }
+
+    _cap_mu_lock(&arena->mutex);
+    if (arena->chunks == NULL || arena->used == _CAP_ARENA_SLOTS) {
+	struct _cap_arena_chunk_s *chunk = calloc(1, sizeof(*chunk));
+	if (chunk == NULL) {
+	    _cap_debug("out of memory");
+	    errno = ENOMEM;
+	    _cap_mu_unlock_return(&arena->mutex, NULL);
+	}
+	chunk->next = arena->chunks;
+	arena->chunks = chunk;
+	arena->used = 0;
+    }
+    data = &arena->chunks->slot[arena->used++];
+    _cap_mu_unlock(&arena->mutex);
+
+    data->magic = magic;
+    data->size = _CAP_ARENA_FLAG | sizeof(struct _cap_alloc_s);
+    return data;
+}
+
+/*
+ * _cap_init_set completes the initialization of a blank cap_t. The
+ * kernel-capability version is resolved once, by the constructor, so
+ * this never enters the kernel.
+ */
+static cap_t _cap_init_set(struct _cap_alloc_s *raw_data)
 {
-    struct _cap_alloc_s *raw_data;
     cap_t result;
 
-    raw_data = calloc(1, sizeof(struct _cap_alloc_s));
     if (raw_data == NULL) {
-	_cap_debug("out of memory");
-	errno = ENOMEM;
 	return NULL;
     }
-    raw_data->magic = CAP_T_MAGIC;
-    raw_data->size = sizeof(struct _cap_alloc_s);
 
     result = &raw_data->u.set;
-    result->head.version = _LIBCAP_CAPABILITY_VERSION;
-    capget(&result->head, NULL);      /* load the kernel-capability version */
+    result->head.version = _libcap_version();
 
     switch (result->head.version) {
 #ifdef _LINUX_CAPABILITY_VERSION_1
@@ -92,6 +237,35 @@ cap_t cap_init(void)
     return result;
 }
 
+/*
+ * Obtain a blank set of capabilities
+ */
+cap_t cap_init(void)
+{
+    return _cap_init_set(_cap_alloc(CAP_T_MAGIC));
+}
+
+/*
+ * Obtain a blank set of capabilities from an arena.
+ */
+cap_t cap_arena_cap_init(cap_arena_t arena)
+{
+    return _cap_init_set(_cap_arena_alloc(arena, CAP_T_MAGIC));
+}
+
+/*
+ * cap_arena_init allocates an empty arena. All of the objects
+ * allocated from it are liberated by cap_free(arena).
+ */
+cap_arena_t cap_arena_init(void)
+{
+    struct _cap_alloc_s *base = _cap_alloc(CAP_ARENA_MAGIC);
+    if (base == NULL) {
+	return NULL;
+    }
+    return &base->u.arena;
+}
+
 /*
  * This is an internal library function to duplicate a string and
  * tag the result as something cap_free can handle.
@@ -118,14 +292,22 @@ __attribute__((visibility ("hidden"))) char *_libcap_strdup(const char *old)
 	len = sizeof(struct _cap_alloc_s);
     }
 
-    raw_data = calloc(1, len);
-    if (raw_data == NULL) {
-	errno = ENOMEM;
-	return NULL;
+    if (len == sizeof(struct _cap_alloc_s)) {
+	header = _cap_alloc(CAP_S_MAGIC);
+	if (header == NULL) {
+	    return NULL;
+	}
+	raw_data = (void *) header;
+    } else {
+	raw_data = calloc(1, len);
+	if (raw_data == NULL) {
+	    errno = ENOMEM;
+	    return NULL;
+	}
+	header = (void *) raw_data;
+	header->magic = CAP_S_MAGIC;
+	header->size = (__u32) len;
     }
-    header = (void *) raw_data;
-    header->magic = CAP_S_MAGIC;
-    header->size = (__u32) len;
 
     raw_data += 2*sizeof(__u32);
     strcpy(raw_data, old);
@@ -133,21 +315,10 @@ __attribute__((visibility ("hidden"))) char *_libcap_strdup(const char *old)
 }
 
 /*
- * This function duplicates an internal capability set with
- * calloc()'d memory. It is the responsibility of the user to call
- * cap_free() to liberate it.
+ * _cap_dup_into copies the content of cap_d into result.
  */
-cap_t cap_dup(cap_t cap_d)
+static cap_t _cap_dup_into(cap_t result, cap_t cap_d)
 {
-    cap_t result;
-
-    if (!good_cap_t(cap_d)) {
-	_cap_debug("bad argument");
-	errno = EINVAL;
-	return NULL;
-    }
-
-    result = cap_init();
     if (result == NULL) {
 	_cap_debug("out of memory");
 	return NULL;
@@ -161,20 +332,87 @@ cap_t cap_dup(cap_t cap_d)
     return result;
 }
 
+/*
+ * This is an internal library function to allocate size bytes of
+ * zeroed memory, tagged with magic, that cap_free can handle.
+ */
+__attribute__((visibility ("hidden"))) void *_libcap_alloc(__u32 magic,
+							   size_t size)
+{
+    struct _cap_alloc_s *header;
+
+    if ((size & 0x3fffffff) != size) {
+	_cap_debug("size is too large for libcap to manage");
+	errno = EINVAL;
+	return NULL;
+    }
+    size += 2*sizeof(__u32);
+    if (size <= sizeof(struct _cap_alloc_s)) {
+	header = _cap_alloc(magic);
+    } else {
+	header = calloc(1, size);
+	if (header == NULL) {
+	    errno = ENOMEM;
+	    return NULL;
+	}
+	header->magic = magic;
+	header->size = (__u32) size;
+    }
+    return header ? &header->u : NULL;
+}
+
+/*
+ * This function duplicates an internal capability set with
+ * allocated memory. It is the responsibility of the user to call
+ * cap_free() to liberate it.
+ */
+cap_t cap_dup(cap_t cap_d)
+{
+    if (!good_cap_t(cap_d)) {
+	_cap_debug("bad argument");
+	errno = EINVAL;
+	return NULL;
+    }
+    return _cap_dup_into(cap_init(), cap_d);
+}
+
+/*
+ * cap_arena_cap_dup duplicates an internal capability set with
+ * memory from an arena.
+ */
+cap_t cap_arena_cap_dup(cap_arena_t arena, cap_t cap_d)
+{
+    if (!good_cap_t(cap_d)) {
+	_cap_debug("bad argument");
+	errno = EINVAL;
+	return NULL;
+    }
+    return _cap_dup_into(cap_arena_cap_init(arena), cap_d);
+}
+
 cap_iab_t cap_iab_init(void)
 {
-    struct _cap_alloc_s *base = calloc(1, sizeof(struct _cap_alloc_s));
+    struct _cap_alloc_s *base = _cap_alloc(CAP_IAB_MAGIC);
+    if (base == NULL) {
+	return NULL;
+    }
+    return &base->u.iab;
+}
+
+/*
+ * Obtain a blank iab tuple from an arena.
+ */
+cap_iab_t cap_arena_iab_init(cap_arena_t arena)
+{
+    struct _cap_alloc_s *base = _cap_arena_alloc(arena, CAP_IAB_MAGIC);
     if (base == NULL) {
-	_cap_debug("out of memory");
 	return NULL;
     }
-    base->magic = CAP_IAB_MAGIC;
-    base->size = sizeof(struct _cap_alloc_s);
     return &base->u.iab;
 }
 
 /*
- * This function duplicates an internal iab tuple with calloc()'d
+ * This function duplicates an internal iab tuple with allocated
  * memory. It is the responsibility of the user to call cap_free() to
  * liberate it.
  */
@@ -212,13 +450,10 @@ cap_iab_t cap_iab_dup(cap_iab_t iab)
 cap_launch_t cap_new_launcher(const char *arg0, const char * const *argv,
 			      const char * const *envp)
 {
-    struct _cap_alloc_s *data = calloc(1, sizeof(struct _cap_alloc_s));
+    struct _cap_alloc_s *data = _cap_alloc(CAP_LAUNCH_MAGIC);
     if (data == NULL) {
-	_cap_debug("out of memory");
 	return NULL;
     }
-    data->magic = CAP_LAUNCH_MAGIC;
-    data->size = sizeof(struct _cap_alloc_s);
 
     struct cap_launch_s *attr = &data->u.launcher;
     attr->arg0 = arg0;
@@ -236,13 +471,10 @@ cap_launch_t cap_new_launcher(const char *arg0, const char * const *argv,
  */
 cap_launch_t cap_func_launcher(int (callback_fn)(void *detail))
 {
-    struct _cap_alloc_s *data = calloc(1, sizeof(struct _cap_alloc_s));
+    struct _cap_alloc_s *data = _cap_alloc(CAP_LAUNCH_MAGIC);
     if (data == NULL) {
-	_cap_debug("out of memory");
 	return NULL;
     }
-    data->magic = CAP_LAUNCH_MAGIC;
-    data->size = sizeof(struct _cap_alloc_s);
 
     struct cap_launch_s *attr = &data->u.launcher;
     attr->custom_setup_fn = callback_fn;
@@ -274,6 +506,8 @@ int cap_free(void *data_p)
 	break;
     case CAP_S_MAGIC:
     case CAP_IAB_MAGIC:
+    case CAP_PARSER_MAGIC:
+    case CAP_TEXT_CACHE_MAGIC:
 	break;
     case CAP_LAUNCH_MAGIC:
 	if (data->u.launcher.iab != NULL) {
@@ -287,6 +521,16 @@ int cap_free(void *data_p)
 	    return -1;
 	}
 	data->u.launcher.chroot = NULL;
+	_libcap_launch_forget(&data->u.launcher);
+	break;
+    case CAP_ARENA_MAGIC:
+	_cap_mu_lock(&data->u.arena.mutex);
+	while (data->u.arena.chunks != NULL) {
+	    struct _cap_arena_chunk_s *chunk = data->u.arena.chunks;
+	    data->u.arena.chunks = chunk->next;
+	    memset(chunk, 0, sizeof(*chunk));
+	    free(chunk);
+	}
 	break;
     default:
 	_cap_debug("don't recognize what we're supposed to liberate");
@@ -298,8 +542,13 @@ int cap_free(void *data_p)
      * operate here with respect to base, to avoid tangling with the
      * automated buffer overflow detection.
      */
-    memset(base, 0, data->size);
-    free(base);
+    __u32 size = data->size;
+    memset(base, 0, size & ~_CAP_ARENA_FLAG);
+    if (size == sizeof(struct _cap_alloc_s)) {
+	_cap_release(data);
+    } else if (!(size & _CAP_ARENA_FLAG)) {
+	free(base);
+    }
     data_p = NULL;
     data = NULL;
     base = NULL;
@@ -8,8 +8,14 @@
 #define _DEFAULT_SOURCE
 #endif
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <sys/types.h>
 #include <byteswap.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
@@ -20,6 +26,7 @@
  * other libraries to access them.
  */
 extern ssize_t getxattr(const char *, const char *, void *, size_t);
+extern ssize_t lgetxattr(const char *, const char *, void *, size_t);
 extern ssize_t fgetxattr(int, const char *, void *, size_t);
 extern int setxattr(const char *, const char *, const void *, size_t, int);
 extern int fsetxattr(int, const char *, const void *, size_t, int);
@@ -56,12 +63,22 @@ extern int fremovexattr(int, const char *);
 #define FIXUP_32BITS(x) (x)
 #endif
 
-static cap_t _fcaps_load(struct vfs_ns_cap_data *rawvfscap, cap_t result,
-			 int bytes)
+/*
+ * _fcaps_decode converts bytes of raw xattr data into a caller-owned
+ * capability set. It returns 0 on success and -1 on failure.
+ */
+static int _fcaps_decode(const struct vfs_ns_cap_data *rawvfscap, int bytes,
+			 cap_flat_t *flat)
 {
     __u32 magic_etc;
     unsigned tocopy, i;
 
+    if (bytes < ssizeof(rawvfscap->magic_etc)) {
+	errno = EINVAL;
+	return -1;
+    }
+
+    memset(flat, 0, sizeof(*flat));
     magic_etc = FIXUP_32BITS(rawvfscap->magic_etc);
     switch (magic_etc & VFS_CAP_REVISION_MASK) {
     case VFS_CAP_REVISION_1:
@@ -77,43 +94,45 @@ static cap_t _fcaps_load(struct vfs_ns_cap_data *rawvfscap, cap_t result,
     case VFS_CAP_REVISION_3:
 	tocopy = VFS_CAP_U32_3;
 	bytes -= XATTR_CAPS_SZ_3;
-	result->rootid = FIXUP_32BITS(rawvfscap->rootid);
+	flat->rootid = FIXUP_32BITS(rawvfscap->rootid);
 	break;
 
     default:
-	cap_free(result);
-	result = NULL;
-	return result;
+	errno = EINVAL;
+	return -1;
     }
 
     /*
      * Verify that we loaded exactly the right number of bytes
      */
     if (bytes != 0) {
-	cap_free(result);
-	result = NULL;
-	return result;
+	errno = EINVAL;
+	return -1;
     }
 
     for (i=0; i < tocopy; i++) {
-	result->u[i].flat[CAP_INHERITABLE]
+	flat->u[i].flat[CAP_INHERITABLE]
 	    = FIXUP_32BITS(rawvfscap->data[i].inheritable);
-	result->u[i].flat[CAP_PERMITTED]
+	flat->u[i].flat[CAP_PERMITTED]
 	    = FIXUP_32BITS(rawvfscap->data[i].permitted);
 	if (magic_etc & VFS_CAP_FLAGS_EFFECTIVE) {
-	    result->u[i].flat[CAP_EFFECTIVE]
-		= result->u[i].flat[CAP_INHERITABLE]
-		| result->u[i].flat[CAP_PERMITTED];
+	    flat->u[i].flat[CAP_EFFECTIVE]
+		= flat->u[i].flat[CAP_INHERITABLE]
+		| flat->u[i].flat[CAP_PERMITTED];
 	}
     }
-    while (i < __CAP_BLKS) {
-	result->u[i].flat[CAP_INHERITABLE]
-	    = result->u[i].flat[CAP_PERMITTED]
-	    = result->u[i].flat[CAP_EFFECTIVE] = 0;
-	i++;
-    }
 
-    return result;
+    return 0;
+}
+
+static cap_t _fcaps_load(const struct vfs_ns_cap_data *rawvfscap, int bytes)
+{
+    cap_flat_t flat;
+
+    if (_fcaps_decode(rawvfscap, bytes, &flat) != 0) {
+	return NULL;
+    }
+    return cap_from_flat(&flat);
 }
 
 static int _fcaps_save(struct vfs_ns_cap_data *rawvfscap, cap_t cap_d,
@@ -208,28 +227,18 @@ static int _fcaps_save(struct vfs_ns_cap_data *rawvfscap, cap_t cap_d,
 
 cap_t cap_get_fd(int fildes)
 {
-    cap_t result;
-
-    /* allocate a new capability set */
-    result = cap_init();
-    if (result) {
-	struct vfs_ns_cap_data rawvfscap;
-	int sizeofcaps;
-
-	_cap_debug("getting fildes capabilities");
-
-	/* fill the capability sets via a system call */
-	sizeofcaps = fgetxattr(fildes, XATTR_NAME_CAPS,
-			       &rawvfscap, sizeof(rawvfscap));
-	if (sizeofcaps < ssizeof(rawvfscap.magic_etc)) {
-	    cap_free(result);
-	    result = NULL;
-	} else {
-	    result = _fcaps_load(&rawvfscap, result, sizeofcaps);
-	}
-    }
+    struct vfs_ns_cap_data rawvfscap;
+    int sizeofcaps;
 
-    return result;
+    _cap_debug("getting fildes capabilities");
+
+    /* fill the capability sets via a system call */
+    sizeofcaps = fgetxattr(fildes, XATTR_NAME_CAPS,
+			   &rawvfscap, sizeof(rawvfscap));
+    if (sizeofcaps < 0) {
+	return NULL;
+    }
+    return _fcaps_load(&rawvfscap, sizeofcaps);
 }
 
 /*
@@ -238,28 +247,195 @@ cap_t cap_get_fd(int fildes)
 
 cap_t cap_get_file(const char *filename)
 {
-    cap_t result;
-
-    /* allocate a new capability set */
-    result = cap_init();
-    if (result) {
-	struct vfs_ns_cap_data rawvfscap;
-	int sizeofcaps;
-
-	_cap_debug("getting filename capabilities");
-
-	/* fill the capability sets via a system call */
-	sizeofcaps = getxattr(filename, XATTR_NAME_CAPS,
-			      &rawvfscap, sizeof(rawvfscap));
-	if (sizeofcaps < ssizeof(rawvfscap.magic_etc)) {
-	    cap_free(result);
-	    result = NULL;
-	} else {
-	    result = _fcaps_load(&rawvfscap, result, sizeofcaps);
+    struct vfs_ns_cap_data rawvfscap;
+    int sizeofcaps;
+
+    _cap_debug("getting filename capabilities");
+
+    /* fill the capability sets via a system call */
+    sizeofcaps = getxattr(filename, XATTR_NAME_CAPS,
+			  &rawvfscap, sizeof(rawvfscap));
+    if (sizeofcaps < 0) {
+	return NULL;
+    }
+    return _fcaps_load(&rawvfscap, sizeofcaps);
+}
+
+/*
+ * _fcaps_no_proc records, once it is known, whether /proc/self/fd is
+ * missing: 0 for not yet checked, 1 for missing and -1 for present.
+ */
+static int _fcaps_no_proc;
+
+static int _fcaps_proc_missing(void)
+{
+    if (_fcaps_no_proc == 0) {
+	int olderrno = errno;
+	_fcaps_no_proc = access("/proc/self/fd", F_OK) ? 1 : -1;
+	errno = olderrno;
+    }
+    return _fcaps_no_proc > 0;
+}
+
+/*
+ * _fcaps_fgetat opens name, relative to dirfd, and reads its raw
+ * capability xattr with fgetxattr(). It first opens an O_PATH
+ * descriptor, and only if the kernel does not support xattr calls on
+ * those does it open the file for reading.
+ */
+static ssize_t _fcaps_fgetat(int dirfd, const char *name, int flags,
+			     struct vfs_ns_cap_data *rawvfscap)
+{
+    int nofollow = (flags & AT_SYMLINK_NOFOLLOW) ? O_NOFOLLOW : 0;
+    ssize_t sizeofcaps;
+    int fd, olderrno;
+
+    fd = openat(dirfd, name, O_PATH | O_CLOEXEC | nofollow);
+    if (fd < 0) {
+	return -1;
+    }
+    sizeofcaps = fgetxattr(fd, XATTR_NAME_CAPS, rawvfscap, sizeof(*rawvfscap));
+    if (sizeofcaps < 0 && errno == EBADF) {
+	close(fd);
+	fd = openat(dirfd, name, O_RDONLY | O_NONBLOCK | O_CLOEXEC | nofollow);
+	if (fd < 0) {
+	    if (errno == ELOOP && nofollow) {
+		/* a symlink never carries file capabilities */
+		errno = ENODATA;
+	    }
+	    return -1;
+	}
+	sizeofcaps = fgetxattr(fd, XATTR_NAME_CAPS,
+			       rawvfscap, sizeof(*rawvfscap));
+    }
+    olderrno = errno;
+    close(fd);
+    errno = olderrno;
+    return sizeofcaps;
+}
+
+/*
+ * _fcaps_getat reads the raw capability xattr of name, relative to
+ * dirfd. Rather than open each file, it names it by way of the
+ * /proc/self/fd/<dirfd> magic link, so a single getxattr() call
+ * resolves only the final path component. If /proc is not mounted,
+ * it falls back to _fcaps_fgetat().
+ */
+static ssize_t _fcaps_getat(int dirfd, const char *name, int flags,
+			    struct vfs_ns_cap_data *rawvfscap)
+{
+    ssize_t (*get)(const char *, const char *, void *, size_t) = getxattr;
+    char path[PATH_MAX];
+    ssize_t sizeofcaps;
+
+    if (flags & AT_SYMLINK_NOFOLLOW) {
+	get = lgetxattr;
+    }
+    if (*name == '\0') {
+	if (!(flags & AT_EMPTY_PATH)) {
+	    errno = ENOENT;
+	    return -1;
+	}
+	if (dirfd == AT_FDCWD) {
+	    return getxattr(".", XATTR_NAME_CAPS,
+			    rawvfscap, sizeof(*rawvfscap));
+	}
+	sizeofcaps = fgetxattr(dirfd, XATTR_NAME_CAPS,
+			       rawvfscap, sizeof(*rawvfscap));
+	if (sizeofcaps >= 0 || errno != EBADF) {
+	    return sizeofcaps;
 	}
+	/* an O_PATH dirfd is only supported by recent kernels */
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", dirfd);
+	return getxattr(path, XATTR_NAME_CAPS, rawvfscap, sizeof(*rawvfscap));
+    }
+    if (*name == '/' || dirfd == AT_FDCWD) {
+	return get(name, XATTR_NAME_CAPS, rawvfscap, sizeof(*rawvfscap));
     }
 
-    return result;
+    if (snprintf(path, sizeof(path), "/proc/self/fd/%d/%s", dirfd, name)
+	>= ssizeof(path)) {
+	errno = ENAMETOOLONG;
+	return -1;
+    }
+    if (_fcaps_no_proc > 0) {
+	return _fcaps_fgetat(dirfd, name, flags, rawvfscap);
+    }
+    sizeofcaps = get(path, XATTR_NAME_CAPS, rawvfscap, sizeof(*rawvfscap));
+    if (sizeofcaps >= 0 || errno != ENOENT || !_fcaps_proc_missing()) {
+	return sizeofcaps;
+    }
+    return _fcaps_fgetat(dirfd, name, flags, rawvfscap);
+}
+
+/*
+ * cap_get_fileat decodes the capabilities of name, relative to
+ * dirfd, into the caller's flat. flags may include
+ * AT_SYMLINK_NOFOLLOW and AT_EMPTY_PATH.
+ */
+int cap_get_fileat(int dirfd, const char *name, int flags, cap_flat_t *flat)
+{
+    struct vfs_ns_cap_data rawvfscap;
+    ssize_t sizeofcaps;
+
+    if (name == NULL || flat == NULL
+	|| (flags & ~(AT_SYMLINK_NOFOLLOW | AT_EMPTY_PATH))) {
+	errno = EINVAL;
+	return -1;
+    }
+
+    _cap_debug("getting capabilities of [%s] at %d", name, dirfd);
+    sizeofcaps = _fcaps_getat(dirfd, name, flags, &rawvfscap);
+    if (sizeofcaps < 0) {
+	return -1;
+    }
+    return _fcaps_decode(&rawvfscap, sizeofcaps, flat);
+}
+
+/*
+ * cap_get_files reads the capabilities of n names, relative to
+ * dirfd. Names without file capabilities are skipped. Every other
+ * name is reported: out[] receives the index of the name and either
+ * its decoded capabilities, or (with caps cleared) in error the errno
+ * value that prevented them from being read. The number of entries
+ * written to out[] is returned.
+ */
+ssize_t cap_get_files(int dirfd, const char * const *names, size_t n,
+		      int flags, cap_file_info_t *out)
+{
+    struct vfs_ns_cap_data rawvfscap;
+    size_t i, found = 0;
+
+    if ((n && (names == NULL || out == NULL))
+	|| (flags & ~AT_SYMLINK_NOFOLLOW)) {
+	errno = EINVAL;
+	return -1;
+    }
+
+    for (i = 0; i < n; i++) {
+	cap_file_info_t *info = &out[found];
+	ssize_t sizeofcaps;
+
+	memset(info, 0, sizeof(*info));
+	info->index = i;
+	if (names[i] == NULL) {
+	    info->error = EINVAL;
+	    found++;
+	    continue;
+	}
+	sizeofcaps = _fcaps_getat(dirfd, names[i], flags, &rawvfscap);
+	if (sizeofcaps < 0) {
+	    if (errno == ENODATA || errno == ENOTSUP) {
+		continue;   /* not capable */
+	    }
+	    info->error = errno;
+	} else if (_fcaps_decode(&rawvfscap, sizeofcaps, &info->caps)) {
+	    memset(&info->caps, 0, sizeof(info->caps));
+	    info->error = errno;
+	}
+	found++;
+    }
+    return found;
 }
 
 /*
@@ -288,7 +464,8 @@ uid_t cap_get_nsowner(cap_t cap_d)
 int cap_set_fd(int fildes, cap_t cap_d)
 {
     struct vfs_ns_cap_data rawvfscap;
-    int sizeofcaps;
+    char path[sizeof("/proc/self/fd/") + 3*sizeof(int)];
+    int sizeofcaps, ret;
     struct stat buf;
 
     if (fstat(fildes, &buf) != 0) {
@@ -303,14 +480,23 @@ int cap_set_fd(int fildes, cap_t cap_d)
 
     if (cap_d == NULL) {
 	_cap_debug("deleting fildes capabilities");
-	return fremovexattr(fildes, XATTR_NAME_CAPS);
+	ret = fremovexattr(fildes, XATTR_NAME_CAPS);
     } else if (_fcaps_save(&rawvfscap, cap_d, &sizeofcaps) != 0) {
 	return -1;
+    } else {
+	_cap_debug("setting fildes capabilities");
+	ret = fsetxattr(fildes, XATTR_NAME_CAPS, &rawvfscap, sizeofcaps, 0);
+    }
+    if (ret == 0 || errno != EBADF) {
+	return ret;
     }
 
-    _cap_debug("setting fildes capabilities");
-
-    return fsetxattr(fildes, XATTR_NAME_CAPS, &rawvfscap, sizeofcaps, 0);
+    /* an O_PATH fd can only be modified by way of its magic link */
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fildes);
+    if (cap_d == NULL) {
+	return removexattr(path, XATTR_NAME_CAPS);
+    }
+    return setxattr(path, XATTR_NAME_CAPS, &rawvfscap, sizeofcaps, 0);
 }
 
 /*
@@ -372,6 +558,19 @@ cap_t cap_get_file(const char *filename)
     return NULL;
 }
 
+int cap_get_fileat(int dirfd, const char *name, int flags, cap_flat_t *flat)
+{
+    errno = EINVAL;
+    return -1;
+}
+
+ssize_t cap_get_files(int dirfd, const char * const *names, size_t n,
+		      int flags, cap_file_info_t *out)
+{
+    errno = EINVAL;
+    return -1;
+}
+
 uid_t cap_get_nsowner(cap_t cap_d)
 {
     errno = EINVAL;
@@ -129,24 +129,91 @@ int cap_clear_flag(cap_t cap_d, cap_flag_t flag)
  */
 int cap_compare(cap_t a, cap_t b)
 {
-    unsigned i;
-    int result;
+    cap_flat_t fa, fb;
 
-    if (!(good_cap_t(a) && good_cap_t(b))) {
+    /*
+     * To avoid a deadlock corner case, we operate on unlocked private
+     * snapshots of a and b.
+     */
+    if (cap_to_flat(a, &fa) || cap_to_flat(b, &fb)) {
+	return -1;
+    }
+    return cap_flat_compare(&fa, &fb);
+}
+
+/*
+ * cap_flat_init clears a caller-owned capability set.
+ */
+int cap_flat_init(cap_flat_t *flat)
+{
+    if (flat == NULL) {
+	_cap_debug("invalid pointer");
+	errno = EINVAL;
+	return -1;
+    }
+    memset(flat, 0, sizeof(*flat));
+    return 0;
+}
+
+/*
+ * cap_flat_get_flag is the cap_flat_t equivalent of cap_get_flag().
+ */
+int cap_flat_get_flag(const cap_flat_t *flat, cap_value_t value,
+		      cap_flag_t set, cap_flag_value_t *raised)
+{
+    if (raised && flat && value >= 0 && value < __CAP_MAXBITS
+	&& set >= 0 && set < NUMBER_OF_CAP_SETS) {
+	*raised = isset_cap(flat,value,set) ? CAP_SET:CAP_CLEAR;
+	return 0;
+    }
+    _cap_debug("invalid arguments");
+    errno = EINVAL;
+    return -1;
+}
+
+/*
+ * cap_flat_set_flag is the cap_flat_t equivalent of cap_set_flag().
+ */
+int cap_flat_set_flag(cap_flat_t *flat, cap_flag_t set,
+		      int no_values, const cap_value_t *array_values,
+		      cap_flag_value_t raise)
+{
+    int i;
+
+    if (!(flat && no_values > 0 && no_values < __CAP_MAXBITS
+	  && (set >= 0) && (set < NUMBER_OF_CAP_SETS)
+	  && (raise == CAP_SET || raise == CAP_CLEAR))) {
 	_cap_debug("invalid arguments");
 	errno = EINVAL;
 	return -1;
     }
 
-    /*
-     * To avoid a deadlock corner case, we operate on an unlocked
-     * private copy of b
-     */
-    b = cap_dup(b);
-    if (b == NULL) {
+    for (i=0; i<no_values; ++i) {
+	if (array_values[i] < 0 || array_values[i] >= __CAP_MAXBITS) {
+	    _cap_debug("weird capability (%d) - skipped", array_values[i]);
+	} else if (raise == CAP_SET) {
+	    flat->raise_cap(array_values[i],set);
+	} else {
+	    flat->lower_cap(array_values[i],set);
+	}
+    }
+    return 0;
+}
+
+/*
+ * cap_flat_compare is the cap_flat_t equivalent of cap_compare().
+ */
+int cap_flat_compare(const cap_flat_t *a, const cap_flat_t *b)
+{
+    unsigned i;
+    int result;
+
+    if (a == NULL || b == NULL) {
+	_cap_debug("invalid arguments");
+	errno = EINVAL;
 	return -1;
     }
-    _cap_mu_lock(&a->mutex);
+
     for (i=0, result=0; i<_LIBCAP_CAPABILITY_U32S; i++) {
 	result |=
 	    ((a->u[i].flat[CAP_EFFECTIVE] != b->u[i].flat[CAP_EFFECTIVE])
@@ -156,11 +223,57 @@ int cap_compare(cap_t a, cap_t b)
 	    | ((a->u[i].flat[CAP_PERMITTED] != b->u[i].flat[CAP_PERMITTED])
 	       ? LIBCAP_PER : 0);
     }
-    _cap_mu_unlock(&a->mutex);
-    cap_free(b);
     return result;
 }
 
+/*
+ * cap_to_flat takes a snapshot of cap_d in caller-owned storage.
+ */
+int cap_to_flat(cap_t cap_d, cap_flat_t *flat)
+{
+    unsigned i;
+
+    if (!good_cap_t(cap_d) || flat == NULL) {
+	_cap_debug("invalid arguments");
+	errno = EINVAL;
+	return -1;
+    }
+
+    memset(flat, 0, sizeof(*flat));
+    _cap_mu_lock(&cap_d->mutex);
+    for (i=0; i<_LIBCAP_CAPABILITY_U32S; i++) {
+	memcpy(flat->u[i].flat, cap_d->u[i].flat, sizeof(flat->u[i].flat));
+    }
+    flat->rootid = cap_d->rootid;
+    _cap_mu_unlock(&cap_d->mutex);
+    return 0;
+}
+
+/*
+ * cap_from_flat allocates a cap_t holding the content of flat.
+ */
+cap_t cap_from_flat(const cap_flat_t *flat)
+{
+    unsigned i;
+    cap_t cap_d;
+
+    if (flat == NULL) {
+	_cap_debug("invalid arguments");
+	errno = EINVAL;
+	return NULL;
+    }
+
+    cap_d = cap_init();
+    if (cap_d == NULL) {
+	return NULL;
+    }
+    for (i=0; i<_LIBCAP_CAPABILITY_U32S; i++) {
+	memcpy(cap_d->u[i].flat, flat->u[i].flat, sizeof(flat->u[i].flat));
+    }
+    cap_d->rootid = flat->rootid;
+    return cap_d;
+}
+
 /*
  * cap_fill_flag copies a bit-vector of capability state in one cap_t from one
  * flag to another flag of another cap_t.
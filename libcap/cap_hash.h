@@ -0,0 +1,32 @@
+/*
+ * The hash function used for capability name lookup. It is shared
+ * by _makenames, which generates a minimal perfect hash table for
+ * the known names, and cap_text.c, which consults that table.
+ *
+ * Characters are folded with |0x20. This lower-cases letters and maps
+ * '_' to a value that no letter can fold to, which is all that is
+ * needed for the [A-Za-z_] characters of a capability name.
+ */
+
+#ifndef _CAP_HASH_H
+#define _CAP_HASH_H
+
+#include <stddef.h>
+
+static __inline__ unsigned _cap_name_hash(const char *name, size_t len,
+					  unsigned seed)
+{
+    unsigned h = 2166136261U ^ (seed * 0x9e3779b9U);
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+	h ^= (unsigned char) (name[i] | 0x20);
+	h *= 16777619U;
+    }
+    h ^= h >> 15;
+    h *= 0x2c1b3c6dU;
+    h ^= h >> 12;
+    return h;
+}
+
+#endif /* ndef _CAP_HASH_H */
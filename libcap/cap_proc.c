@@ -11,6 +11,8 @@
 #include <errno.h>
 #include <fcntl.h>              /* Obtain O_* constant definitions */
 #include <grp.h>
+#include <sched.h>
+#include <signal.h>
 #include <sys/prctl.h>
 #include <sys/securebits.h>
 #include <sys/syscall.h>
@@ -53,6 +55,7 @@ struct syscaller_s {
     long int (*six)(long int syscall_nr,
 		    long int arg1, long int arg2, long int arg3,
 		    long int arg4, long int arg5, long int arg6);
+    int (*batch)(const struct _cap_call_s *calls, int n);
 };
 
 /* use this syscaller for multi-threaded code */
@@ -85,9 +88,11 @@ void cap_set_syscall(long int (*new_syscall)(long int,
 						     long int)) {
     if (new_syscall == NULL) {
 	psx_load_syscalls(&multithread.three, &multithread.six);
+	psx_load_syscall_batch(&multithread.batch);
     } else {
 	multithread.three = new_syscall;
 	multithread.six = new_syscall6;
+	multithread.batch = NULL;
     }
 }
 
@@ -131,6 +136,130 @@ static int _libcap_wprctl6(struct syscaller_s *sc,
     return prctl(pr_cmd, arg1, arg2, arg3, arg4, arg5);
 }
 
+/*
+ * A _cap_plan_s holds a sequence of state changing capset and prctl
+ * system calls. When libpsx is linked, the whole sequence is applied
+ * with a single psx_syscall_batch() broadcast instead of one
+ * broadcast per call. Each call has a mode that determines what
+ * happens if it fails.
+ */
+#define _CAP_CALL_ABORT   0  /* report failure, skip to next final call */
+#define _CAP_CALL_FATAL   1  /* report failure, skip all remaining calls */
+#define _CAP_CALL_RECORD  2  /* report failure, but continue */
+#define _CAP_CALL_IGNORE  3  /* ignore failure */
+#define _CAP_CALL_FINAL   4  /* flag: perform even after an aborting failure */
+#define _CAP_CALL_FALLBACK 8 /* flag: only perform after an aborting failure */
+#define _CAP_CALL_FLAGS   (_CAP_CALL_FINAL | _CAP_CALL_FALLBACK)
+
+#define _CAP_PLAN_MAX     (2*__CAP_MAXBITS + 32)
+
+struct _cap_plan_s {
+    int n, overflow;
+    unsigned char mode[_CAP_PLAN_MAX];
+    struct _cap_call_s call[_CAP_PLAN_MAX];
+};
+
+static void _cap_plan_add(struct _cap_plan_s *plan, int mode, long int nr,
+			  long int arg1, long int arg2, long int arg3,
+			  long int arg4, long int arg5, long int arg6)
+{
+    if (plan->n == _CAP_PLAN_MAX) {
+	plan->overflow = 1;
+	return;
+    }
+    struct _cap_call_s *c = &plan->call[plan->n];
+    plan->mode[plan->n++] = mode;
+    c->syscall_nr = nr;
+    c->arg[0] = arg1;
+    c->arg[1] = arg2;
+    c->arg[2] = arg3;
+    c->arg[3] = arg4;
+    c->arg[4] = arg5;
+    c->arg[5] = arg6;
+}
+
+static void _cap_plan_capset(struct _cap_plan_s *plan, int mode, cap_t cap_d)
+{
+    _cap_plan_add(plan, mode, SYS_capset, (long int) &cap_d->head,
+		  (long int) &cap_d->u[0].set, 0, 0, 0, 0);
+}
+
+static void _cap_plan_prctl(struct _cap_plan_s *plan, int mode,
+			    long int pr_cmd, long int arg1, long int arg2,
+			    long int arg3, long int arg4, long int arg5)
+{
+    _cap_plan_add(plan, mode, SYS_prctl, pr_cmd, arg1, arg2, arg3, arg4, arg5);
+}
+
+/*
+ * _cap_plan_apply performs the planned system calls. It returns 0 if
+ * no reportable call failed, otherwise -1 with errno describing the
+ * first such failure. The cap_t values referenced by the plan must
+ * not be modified while it is applied. Calls flagged with
+ * _CAP_CALL_FALLBACK are skipped unless an aborting failure occurred.
+ */
+static int _cap_plan_apply(struct syscaller_s *sc,
+			   const struct _cap_plan_s *plan)
+{
+    int i = 0, ret = 0, err = 0, aborted = 0;
+
+    if (plan->overflow) {
+	errno = ERANGE;
+	return -1;
+    }
+
+    while (i < plan->n) {
+	const struct _cap_call_s *c = &plan->call[i];
+	if (!aborted && (plan->mode[i] & _CAP_CALL_FALLBACK)) {
+	    i++;
+	    continue;
+	}
+	if (sc->batch != NULL && _libcap_overrode_syscalls) {
+	    int span = 1, done;
+	    while (i + span < plan->n && (aborted ||
+		   !(plan->mode[i + span] & _CAP_CALL_FALLBACK))) {
+		span++;
+	    }
+	    done = sc->batch(c, span);
+	    i += done;
+	    if (done == span) {
+		continue;
+	    }
+	} else if (c->syscall_nr == SYS_capset) {
+	    if (_libcap_capset(sc, (cap_user_header_t) c->arg[0],
+			       (cap_user_data_t) c->arg[1]) == 0) {
+		i++;
+		continue;
+	    }
+	} else if (_libcap_wprctl6(sc, c->arg[0], c->arg[1], c->arg[2],
+				   c->arg[3], c->arg[4], c->arg[5]) >= 0) {
+	    i++;
+	    continue;
+	}
+
+	/* plan->call[i] failed */
+	int mode = plan->mode[i] & ~_CAP_CALL_FLAGS;
+	if (mode != _CAP_CALL_IGNORE && !ret) {
+	    ret = -1;
+	    err = errno;
+	}
+	if (mode == _CAP_CALL_FATAL) {
+	    break;
+	}
+	if (mode == _CAP_CALL_ABORT) {
+	    aborted = 1;
+	    while (++i < plan->n && !(plan->mode[i] & _CAP_CALL_FINAL));
+	    continue;
+	}
+	i++;
+    }
+
+    if (ret) {
+	errno = err;
+    }
+    return ret;
+}
+
 /*
  * cap_get_proc obtains the capability set for the current process.
  */
@@ -153,6 +282,22 @@ cap_t cap_get_proc(void)
     return result;
 }
 
+/*
+ * cap_flat_get_proc obtains the capability set for the current
+ * process in caller-owned storage.
+ */
+int cap_flat_get_proc(cap_flat_t *flat)
+{
+    struct __user_cap_header_struct head;
+
+    if (cap_flat_init(flat)) {
+	return -1;
+    }
+    head.version = _libcap_version();
+    head.pid = 0;
+    return capget(&head, (void *) flat->u);
+}
+
 static int _cap_set_proc(struct syscaller_s *sc, cap_t cap_d) {
     int retval;
 
@@ -219,6 +364,68 @@ cap_t cap_get_pid(pid_t pid)
     return result;
 }
 
+/*
+ * cap_get_pids reads the capability state of each of n processes
+ * into the caller's out[] array. The "/proc" directory (see
+ * cap_proc_root()) is opened once, and each /proc/<pid>/status file
+ * is parsed in a single pass, with no memory allocation. A pid of 0
+ * means the calling thread, as for cap_get_proc_state(). The number
+ * of processes successfully read is returned; out[i].error records
+ * why any other process could not be read.
+ */
+int cap_get_pids(const pid_t *pids, size_t n, cap_pid_info_t *out)
+{
+    const unsigned want = _CAP_STATUS_INH | _CAP_STATUS_PRM | _CAP_STATUS_EFF
+	| _CAP_STATUS_BND | _CAP_STATUS_UID | _CAP_STATUS_GID;
+    struct _cap_proc_status_s st;
+    int rootfd, count = 0;
+    size_t i;
+
+    if (n && (pids == NULL || out == NULL)) {
+	errno = EINVAL;
+	return -1;
+    }
+    rootfd = _libcap_proc_open();
+    if (rootfd < 0) {
+	return -1;
+    }
+
+    for (i = 0; i < n; i++) {
+	cap_pid_info_t *info = &out[i];
+	char name[32];
+	unsigned j;
+
+	memset(info, 0, sizeof(*info));
+	info->pid = pids[i];
+	if (pids[i]) {
+	    snprintf(name, sizeof(name), "%d/status", pids[i]);
+	}
+	if (pids[i] ? _libcap_proc_status_at(rootfd, name, &st)
+	    : _libcap_proc_status(0, &st)) {
+	    info->error = errno;
+	    continue;
+	}
+	if ((st.found & want) != want) {
+	    info->error = EINVAL;
+	    continue;
+	}
+	for (j = 0; j < _LIBCAP_CAPABILITY_U32S; j++) {
+	    info->caps.u[j].flat[CAP_EFFECTIVE] = st.eff[j];
+	    info->caps.u[j].flat[CAP_PERMITTED] = st.prm[j];
+	    info->caps.u[j].flat[CAP_INHERITABLE] = st.inh[j];
+	    info->amb[j] = st.amb[j];
+	    info->bound[j] = st.bnd[j];
+	}
+	info->uid = st.uid[0];
+	info->euid = st.uid[1];
+	info->gid = st.gid[0];
+	info->egid = st.gid[1];
+	count++;
+    }
+    close(rootfd);
+    return count;
+}
+
 /*
  * set the caps on a specific process/pg etc.. The kernel has long
  * since deprecated this asynchronous interface. DON'T EXPECT THIS TO
@@ -307,7 +514,11 @@ int cap_set_ambient(cap_value_t cap, cap_flag_value_t set)
     return _cap_set_ambient(&multithread, cap, set);
 }
 
-static int _cap_reset_ambient(struct syscaller_s *sc)
+/*
+ * _cap_ambient_is_clear returns 1 if no ambient capabilities are
+ * raised, or if the kernel does not support them.
+ */
+static int _cap_ambient_is_clear(void)
 {
     int olderrno = errno;
     cap_value_t c;
@@ -317,9 +528,17 @@ static int _cap_reset_ambient(struct syscaller_s *sc)
 	result = cap_get_ambient(c);
 	if (result == -1) {
 	    errno = olderrno;
-	    return 0;
+	    return 1;
 	}
     }
+    return 0;
+}
+
+static int _cap_reset_ambient(struct syscaller_s *sc)
+{
+    if (_cap_ambient_is_clear()) {
+	return 0;
+    }
 
     return _libcap_wprctl6(sc, PR_CAP_AMBIENT,
 			   pr_arg(PR_CAP_AMBIENT_CLEAR_ALL),
@@ -358,14 +577,6 @@ int cap_set_secbits(unsigned bits)
     return _cap_set_secbits(&multithread, bits);
 }
 
-/*
- * Attempt to raise the no new privs prctl value.
- */
-static void _cap_set_no_new_privs(struct syscaller_s *sc)
-{
-    (void) _libcap_wprctl6(sc, PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0, 0);
-}
-
 /*
  * cap_prctl performs a prctl() 6 argument call on the current
  * thread. Use cap_prctlw() if you want to perform a POSIX semantics
@@ -404,62 +615,92 @@ static cap_value_t raise_cap_setpcap[] = {CAP_SETPCAP};
 
 static int _cap_set_mode(struct syscaller_s *sc, cap_mode_t flavor)
 {
-    int ret;
+    int ret, invalid = 0;
     unsigned secbits = CAP_SECURED_BITS_AMBIENT;
-    cap_t working = cap_get_proc();
+    struct _cap_plan_s plan;
+    cap_t working = cap_get_proc(), final = NULL, lowered = NULL;
+    cap_value_t c;
 
     if (working == NULL) {
 	_cap_debug("getting current process' capabilities failed");
 	return -1;
     }
 
-    ret = cap_set_flag(working, CAP_EFFECTIVE, 1, raise_cap_setpcap, CAP_SET) |
-	_cap_set_proc(sc, working);
-    if (ret == 0) {
-	cap_flag_t c;
+    /*
+     * The whole mode change is planned up front, so it can be applied
+     * with a single broadcast. working is used to raise CAP_SETPCAP,
+     * and final is the capability state we end up with. If raising
+     * CAP_SETPCAP or clearing the ambient set fails, only the
+     * effective flags are lowered, leaving the rest of the process
+     * state as it was.
+     */
+    plan.n = plan.overflow = 0;
+    final = cap_dup(working);
+    lowered = cap_dup(working);
+    ret = cap_set_flag(working, CAP_EFFECTIVE, 1, raise_cap_setpcap, CAP_SET);
+    if (final == NULL || lowered == NULL || ret) {
+	ret = -1;
+	goto defer;
+    }
+    _cap_plan_capset(&plan, _CAP_CALL_ABORT, working);
+
+    switch (flavor) {
+    case CAP_MODE_NOPRIV:
+	/* fall through */
+    case CAP_MODE_PURE1E_INIT:
+	(void) cap_clear_flag(final, CAP_INHERITABLE);
+	/* fall through */
+    case CAP_MODE_PURE1E:
+	if (!CAP_AMBIENT_SUPPORTED()) {
+	    secbits = CAP_SECURED_BITS_BASIC;
+	} else if (!_cap_ambient_is_clear()) {
+	    _cap_plan_prctl(&plan, _CAP_CALL_ABORT, PR_CAP_AMBIENT,
+			    pr_arg(PR_CAP_AMBIENT_CLEAR_ALL),
+			    pr_arg(0), pr_arg(0), pr_arg(0), pr_arg(0));
+	}
+	_cap_plan_prctl(&plan, _CAP_CALL_RECORD, PR_SET_SECUREBITS,
+			secbits, 0, 0, 0, 0);
+	if (flavor != CAP_MODE_NOPRIV) {
+	    break;
+	}
 
-	switch (flavor) {
-	case CAP_MODE_NOPRIV:
-	    /* fall through */
-	case CAP_MODE_PURE1E_INIT:
-	    (void) cap_clear_flag(working, CAP_INHERITABLE);
-	    /* fall through */
-	case CAP_MODE_PURE1E:
-	    if (!CAP_AMBIENT_SUPPORTED()) {
-		secbits = CAP_SECURED_BITS_BASIC;
-	    } else {
-		ret = _cap_reset_ambient(sc);
-		if (ret) {
-		    break; /* ambient dropping failed */
-		}
-	    }
-	    ret = _cap_set_secbits(sc, secbits);
-	    if (flavor != CAP_MODE_NOPRIV) {
-		break;
-	    }
+	/* just for "case CAP_MODE_NOPRIV:" */
 
-	    /* just for "case CAP_MODE_NOPRIV:" */
+	for (c = 0; cap_get_bound(c) >= 0; c++) {
+	    _cap_plan_prctl(&plan, _CAP_CALL_IGNORE, PR_CAPBSET_DROP,
+			    pr_arg(c), pr_arg(0), 0, 0, 0);
+	}
+	(void) cap_clear_flag(final, CAP_PERMITTED);
 
-	    for (c = 0; cap_get_bound(c) >= 0; c++) {
-		(void) _cap_drop_bound(sc, c);
-	    }
-	    (void) cap_clear_flag(working, CAP_PERMITTED);
+	/* for good measure */
+	_cap_plan_prctl(&plan, _CAP_CALL_IGNORE, PR_SET_NO_NEW_PRIVS,
+			1, 0, 0, 0, 0);
+	break;
+    case CAP_MODE_HYBRID:
+	_cap_plan_prctl(&plan, _CAP_CALL_RECORD, PR_SET_SECUREBITS,
+			0, 0, 0, 0, 0);
+	break;
+    default:
+	invalid = 1;
+	break;
+    }
 
-	    /* for good measure */
-	    _cap_set_no_new_privs(sc);
-	    break;
-	case CAP_MODE_HYBRID:
-	    ret = _cap_set_secbits(sc, 0);
-	    break;
-	default:
-	    errno = EINVAL;
-	    ret = -1;
-	    break;
-	}
+    (void) cap_clear_flag(final, CAP_EFFECTIVE);
+    _cap_plan_capset(&plan, _CAP_CALL_RECORD, final);
+    (void) cap_clear_flag(lowered, CAP_EFFECTIVE);
+    _cap_plan_capset(&plan, _CAP_CALL_FINAL | _CAP_CALL_FALLBACK
+		     | _CAP_CALL_RECORD, lowered);
+
+    ret = _cap_plan_apply(sc, &plan);
+
+    if (invalid) {
+	errno = EINVAL;
+	ret = -1;
     }
 
-    (void) cap_clear_flag(working, CAP_EFFECTIVE);
-    ret = _cap_set_proc(sc, working) | ret;
+defer:
+    (void) cap_free(lowered);
+    (void) cap_free(final);
     (void) cap_free(working);
     return ret;
 }
@@ -484,68 +725,54 @@ int cap_set_mode(cap_mode_t flavor)
  */
 cap_mode_t cap_get_mode(void)
 {
-    unsigned secbits = cap_get_secbits();
+    cap_proc_state_t state;
+
+    if (cap_get_proc_state(&state)) {
+	return CAP_MODE_UNCERTAIN;
+    }
+    return cap_proc_state_mode(&state);
+}
+
+/*
+ * cap_proc_state_mode determines the capability mode of a snapshot of
+ * process state. If it can find no match in the libcap pre-defined
+ * modes, it returns CAP_MODE_UNCERTAIN.
+ */
+cap_mode_t cap_proc_state_mode(const cap_proc_state_t *state)
+{
+    __u32 inh = 0, ep = 0, amb = 0, bound = 0;
+    unsigned n;
 
-    if (secbits == 0) {
+    if (state == NULL) {
+	return CAP_MODE_UNCERTAIN;
+    }
+    if (state->secbits == 0) {
 	return CAP_MODE_HYBRID;
     }
-    if ((secbits & CAP_SECURED_BITS_BASIC) != CAP_SECURED_BITS_BASIC) {
+    if ((state->secbits & CAP_SECURED_BITS_BASIC) != CAP_SECURED_BITS_BASIC) {
 	return CAP_MODE_UNCERTAIN;
     }
 
-    /* validate ambient is not set */
-    int olderrno = errno;
-    int ret = 0, cf;
-    cap_value_t c;
-    for (c = 0; !ret; c++) {
-	ret = cap_get_ambient(c);
-	if (ret == -1) {
-	    errno = olderrno;
-	    if (c && secbits != CAP_SECURED_BITS_AMBIENT) {
-		return CAP_MODE_UNCERTAIN;
-	    }
-	    ret = 0;
-	    break;
-	}
-	if (ret) {
-	    return CAP_MODE_UNCERTAIN;
-	}
+    for (n = 0; n < _LIBCAP_CAPABILITY_U32S; n++) {
+	inh |= state->caps.u[n].flat[CAP_INHERITABLE];
+	ep |= state->caps.u[n].flat[CAP_PERMITTED]
+	    | state->caps.u[n].flat[CAP_EFFECTIVE];
+	amb |= state->amb[n];
+	bound |= state->bound[n];
     }
 
-    /*
-     * Explore how capabilities differ from empty.
-     */
-    cap_t working = cap_get_proc();
-    cap_t empty = cap_init();
-    if (working == NULL || empty == NULL) {
-	_cap_debug("working=%p, empty=%p - need both non-NULL", working, empty);
-	ret = -1;
-    } else {
-	cf = cap_compare(empty, working);
-    }
-    cap_free(empty);
-    cap_free(working);
-    if (ret != 0) {
+    /* validate ambient is not set */
+    if (state->ambient_supported
+	&& (amb || state->secbits != CAP_SECURED_BITS_AMBIENT)) {
 	return CAP_MODE_UNCERTAIN;
     }
 
-    if (CAP_DIFFERS(cf, CAP_INHERITABLE)) {
+    if (inh) {
 	return CAP_MODE_PURE1E;
     }
-    if (CAP_DIFFERS(cf, CAP_PERMITTED) || CAP_DIFFERS(cf, CAP_EFFECTIVE)) {
+    if (ep || bound) {
 	return CAP_MODE_PURE1E_INIT;
     }
-
-    for (c = 0; ; c++) {
-	int v = cap_get_bound(c);
-	if (v == -1) {
-	    break;
-	}
-	if (v) {
-	    return CAP_MODE_PURE1E_INIT;
-	}
-    }
-
     return CAP_MODE_NOPRIV;
 }
 
@@ -673,9 +900,28 @@ int cap_setgroups(gid_t gid, size_t ngroups, const gid_t groups[])
  * current process state related to these iab bits.
  */
 cap_iab_t cap_iab_get_proc(void)
+{
+    cap_proc_state_t state;
+
+    if (cap_get_proc_state(&state)) {
+	return NULL;
+    }
+    return cap_proc_state_iab(&state);
+}
+
+/*
+ * cap_proc_state_iab returns a cap_iab_t value initialized from a
+ * snapshot of process state.
+ */
+cap_iab_t cap_proc_state_iab(const cap_proc_state_t *state)
 {
     cap_iab_t iab;
-    cap_t current;
+    unsigned n;
+
+    if (state == NULL) {
+	errno = EINVAL;
+	return NULL;
+    }
 
     iab = cap_iab_init();
     if (iab == NULL) {
@@ -683,29 +929,87 @@ cap_iab_t cap_iab_get_proc(void)
 	return NULL;
     }
 
-    current = cap_get_proc();
-    if (current == NULL) {
-	_cap_debug("no memory for cap_t");
-	cap_free(iab);
-	return NULL;
+    for (n = 0; n < _LIBCAP_CAPABILITY_U32S; n++) {
+	unsigned base = 32*n;
+	__u32 mask = 0;
+	if (state->max_bits >= base + 32) {
+	    mask = ~0U;
+	} else if (state->max_bits > base) {
+	    mask = (__u32) ((1ULL << (state->max_bits % 32)) - 1);
+	}
+	iab->i[n] = state->caps.u[n].flat[CAP_INHERITABLE];
+	iab->a[n] = state->amb[n] & mask;
+	iab->nb[n] = ~state->bound[n] & mask;
     }
+    return iab;
+}
 
-    cap_iab_fill(iab, CAP_IAB_INH, current, CAP_INHERITABLE);
-    cap_free(current);
+/*
+ * cap_get_proc_state captures the full privilege state of the calling
+ * thread in a caller-owned snapshot. It uses one capget() call, one
+ * PR_GET_SECUREBITS prctl() and one parse of /proc/thread-self/status.
+ * If that file is not available, or cap_proc_root() names some other
+ * procfs, the bounding and ambient vectors are read one capability at
+ * a time with prctl().
+ */
+int cap_get_proc_state(cap_proc_state_t *state)
+{
+    struct _cap_proc_status_s st;
+    unsigned n;
 
-    cap_value_t c;
-    for (c = cap_max_bits(); c; ) {
-	--c;
-	int o = c >> 5;
-	__u32 mask = 1U << (c & 31);
-	if (cap_get_bound(c) == 0) {
-	    iab->nb[o] |= mask;
+    if (state == NULL) {
+	errno = EINVAL;
+	return -1;
+    }
+
+    memset(state, 0, sizeof(*state));
+    state->max_bits = cap_max_bits();
+    if (cap_flat_get_proc(&state->caps)) {
+	return -1;
+    }
+    state->secbits = cap_get_secbits();
+
+    if (_libcap_proc_status(0, &st) == 0
+	&& (st.found & (_CAP_STATUS_BND | _CAP_STATUS_UID | _CAP_STATUS_GID))
+	== (_CAP_STATUS_BND | _CAP_STATUS_UID | _CAP_STATUS_GID)) {
+	for (n = 0; n < _LIBCAP_CAPABILITY_U32S; n++) {
+	    state->bound[n] = st.bnd[n];
+	    state->amb[n] = st.amb[n];
 	}
-	if (cap_get_ambient(c) == 1) {
-	    iab->a[o] |= mask;
+	state->ambient_supported = (st.found & _CAP_STATUS_AMB) != 0;
+	state->uid = st.uid[0];
+	state->euid = st.uid[1];
+	state->suid = st.uid[2];
+	state->gid = st.gid[0];
+	state->egid = st.gid[1];
+	state->sgid = st.gid[2];
+    } else {
+	int olderrno = errno;
+	cap_value_t c;
+
+	_cap_debug("falling back to prctl() for bounding and ambient bits");
+	state->ambient_supported = (cap_get_ambient(0) >= 0);
+	for (c = 0; c < state->max_bits; c++) {
+	    __u32 mask = 1U << (c & 31);
+	    if (cap_get_bound(c) > 0) {
+		state->bound[c >> 5] |= mask;
+	    }
+	    if (state->ambient_supported && cap_get_ambient(c) > 0) {
+		state->amb[c >> 5] |= mask;
+	    }
 	}
+	getresuid(&state->uid, &state->euid, &state->suid);
+	getresgid(&state->gid, &state->egid, &state->sgid);
+	st.found = 0;
+	errno = olderrno;
     }
-    return iab;
+
+    if (st.found & _CAP_STATUS_NNP) {
+	state->no_new_privs = st.no_new_privs;
+    } else {
+	state->no_new_privs = (prctl(PR_GET_NO_NEW_PRIVS, 0, 0, 0, 0) == 1);
+    }
+    return 0;
 }
 
 /*
@@ -716,8 +1020,9 @@ cap_iab_t cap_iab_get_proc(void)
  */
 static int _cap_iab_set_proc(struct syscaller_s *sc, cap_iab_t iab)
 {
-    int ret, i, raising = 0, check_bound = 0;
+    int ret, i, a, olderrno, raising = 0, check_bound = 0;
     cap_value_t c;
+    struct _cap_plan_s plan;
     cap_t working, temp = cap_get_proc();
 
     if (temp == NULL) {
@@ -761,33 +1066,51 @@ static int _cap_iab_set_proc(struct syscaller_s *sc, cap_iab_t iab)
 	    goto defer;
 	}
     }
-    if ((ret = _cap_set_proc(sc, working))) {
-	goto defer;
-    }
-    if ((ret = _cap_reset_ambient(sc))) {
-	goto done;
+
+    /*
+     * Plan the whole change so it can be applied with a single
+     * broadcast. If the initial capset fails, nothing else is
+     * done. Otherwise, temp is always (re)applied at the end.
+     */
+    plan.n = plan.overflow = 0;
+    _cap_plan_capset(&plan, _CAP_CALL_FATAL, working);
+
+    /*
+     * The kernel drops any ambient bits that are not also in the new
+     * inheritable and permitted sets, so only clear what would
+     * otherwise remain.
+     */
+    olderrno = errno;
+    for (c = 0; c < __CAP_MAXBITS && (a = cap_get_ambient(c)) >= 0; c++) {
+	unsigned offset = c >> 5;
+	__u32 mask = 1U << (c & 31);
+	if (a && (temp->u[offset].flat[CAP_INHERITABLE] &
+		  temp->u[offset].flat[CAP_PERMITTED] & mask)) {
+	    _cap_plan_prctl(&plan, _CAP_CALL_ABORT, PR_CAP_AMBIENT,
+			    pr_arg(PR_CAP_AMBIENT_CLEAR_ALL),
+			    pr_arg(0), pr_arg(0), pr_arg(0), pr_arg(0));
+	    break;
+	}
     }
+    errno = olderrno;
 
     for (c = cap_max_bits(); c-- != 0; ) {
 	unsigned offset = c >> 5;
 	__u32 mask = 1U << (c & 31);
 	if (iab->a[offset] & mask) {
-	    ret = _cap_set_ambient(sc, c, CAP_SET);
-	    if (ret) {
-		goto done;
-	    }
+	    _cap_plan_prctl(&plan, _CAP_CALL_ABORT, PR_CAP_AMBIENT,
+			    pr_arg(PR_CAP_AMBIENT_RAISE), pr_arg(c),
+			    pr_arg(0), pr_arg(0), pr_arg(0));
 	}
 	if (check_bound && (iab->nb[offset] & mask)) {
 	    /* drop the bounding bit */
-	    ret = _cap_drop_bound(sc, c);
-	    if (ret) {
-		goto done;
-	    }
+	    _cap_plan_prctl(&plan, _CAP_CALL_ABORT, PR_CAPBSET_DROP,
+			    pr_arg(c), pr_arg(0), 0, 0, 0);
 	}
     }
 
-done:
-    (void) cap_set_proc(temp);
+    _cap_plan_capset(&plan, _CAP_CALL_FINAL | _CAP_CALL_IGNORE, temp);
+    ret = _cap_plan_apply(sc, &plan);
 
 defer:
     cap_free(working);
@@ -833,6 +1156,7 @@ int cap_launcher_callback(cap_launch_t attr, int (callback_fn)(void *detail))
     }
     _cap_mu_lock(&attr->mutex);
     attr->custom_setup_fn = callback_fn;
+    _libcap_launch_forget(attr);
     _cap_mu_unlock(&attr->mutex);
     return 0;
 }
@@ -849,6 +1173,7 @@ int cap_launcher_setuid(cap_launch_t attr, uid_t uid)
     _cap_mu_lock(&attr->mutex);
     attr->uid = uid;
     attr->change_uids = 1;
+    _libcap_launch_forget(attr);
     _cap_mu_unlock(&attr->mutex);
     return 0;
 }
@@ -869,6 +1194,7 @@ int cap_launcher_setgroups(cap_launch_t attr, gid_t gid,
     attr->ngroups = ngroups;
     attr->groups = groups;
     attr->change_gids = 1;
+    _libcap_launch_forget(attr);
     _cap_mu_unlock(&attr->mutex);
     return 0;
 }
@@ -886,6 +1212,7 @@ int cap_launcher_set_mode(cap_launch_t attr, cap_mode_t flavor)
     _cap_mu_lock(&attr->mutex);
     attr->mode = flavor;
     attr->change_mode = 1;
+    _libcap_launch_forget(attr);
     _cap_mu_unlock(&attr->mutex);
     return 0;
 }
@@ -912,6 +1239,7 @@ cap_iab_t cap_launcher_set_iab(cap_launch_t attr, cap_iab_t iab)
     if (iab != NULL) {
 	_cap_mu_lock(&iab->mutex);
     }
+    _libcap_launch_forget(attr);
     _cap_mu_unlock(&attr->mutex);
     return old;
 }
@@ -928,6 +1256,7 @@ int cap_launcher_set_chroot(cap_launch_t attr, const char *chroot)
     }
     _cap_mu_lock(&attr->mutex);
     attr->chroot = _libcap_strdup(chroot);
+    _libcap_launch_forget(attr);
     _cap_mu_unlock(&attr->mutex);
     return 0;
 }
@@ -966,6 +1295,497 @@ static int _cap_chroot(struct syscaller_s *sc, const char *root)
     return ret;
 }
 
+/*
+ * A _cap_launch_plan_s holds every state change a launcher without a
+ * custom_setup_fn makes in its child, computed in the parent from a
+ * snapshot of the caller's full privilege state, state. The child of a
+ * CLONE_VM|CLONE_VFORK clone() only replays it: it allocates no
+ * memory and reads no state. The plan owns the cap_t values
+ * referenced by its capset calls, and only uses the _CAP_CALL_FATAL
+ * and _CAP_CALL_IGNORE modes since any failure aborts the launch.
+ */
+#define _CAP_LAUNCH_SETS  10
+#define _CAP_VFORK_STACK  16384
+
+struct _cap_launch_plan_s {
+    struct _cap_plan_s plan;
+    cap_proc_state_t state;
+    int nsets;
+    cap_t sets[_CAP_LAUNCH_SETS];
+};
+
+static void _cap_launch_plan_free(struct _cap_launch_plan_s *lp)
+{
+    int i;
+
+    for (i = 0; i < lp->nsets; i++) {
+	cap_free(lp->sets[i]);
+    }
+    lp->nsets = 0;
+}
+
+static void _cap_launch_capset(struct _cap_launch_plan_s *lp, int mode,
+			       const cap_flat_t *flat)
+{
+    cap_t cap_d;
+
+    if (lp->nsets == _CAP_LAUNCH_SETS
+	|| (cap_d = cap_from_flat(flat)) == NULL) {
+	lp->plan.overflow = 1;
+	return;
+    }
+    lp->sets[lp->nsets++] = cap_d;
+    _cap_plan_capset(&lp->plan, mode, cap_d);
+}
+
+/*
+ * _cap_launch_want raises cap in the effective set of caps, along
+ * with those bits of ahead that are permitted: ahead holds the bits
+ * later steps of the launch will need, and raising them early lets
+ * them share a single capset call. It returns 0 if cap was already
+ * effective, and caps needs no capset call.
+ */
+static int _cap_launch_want(cap_flat_t *caps, const cap_flat_t *ahead,
+			    cap_value_t cap)
+{
+    unsigned n;
+
+    if (caps->u[cap >> 5].flat[CAP_EFFECTIVE] & (1U << (cap & 31))) {
+	return 0;
+    }
+    for (n = 0; n < _LIBCAP_CAPABILITY_U32S; n++) {
+	caps->u[n].flat[CAP_EFFECTIVE] |= ahead->u[n].flat[CAP_EFFECTIVE]
+	    & caps->u[n].flat[CAP_PERMITTED];
+    }
+    caps->u[cap >> 5].flat[CAP_EFFECTIVE] |= 1U << (cap & 31);
+    return 1;
+}
+
+/*
+ * _cap_launch_plan_build plans the changes that _cap_launch() makes
+ * with _cap_setuid(), _cap_setgroups(), _cap_set_mode(),
+ * _cap_iab_set_proc() and _cap_chroot(). Where those functions read
+ * the kernel state as they go, this function tracks the expected
+ * state in s instead, and that lets it leave out every call that
+ * would not change anything before the execve():
+ *
+ * - effective bits are raised once and never lowered, since execve()
+ *   recomputes the effective set. Only a setuid() away from root
+ *   clears them in between, so the bits needed after it are raised
+ *   together, after it;
+ * - PR_SET_KEEPCAPS is only set when the setuid() would otherwise
+ *   clear the permitted set, and is never reset since execve() resets
+ *   it;
+ * - capset() is only called when the capability sets change.
+ */
+static int _cap_launch_plan_build(cap_launch_t attr,
+				  struct _cap_launch_plan_s *lp)
+{
+    struct _cap_plan_s *plan = &lp->plan;
+    cap_proc_state_t s;
+    cap_flat_t ahead, none;
+    cap_value_t c;
+    unsigned n;
+
+    plan->n = plan->overflow = 0;
+    lp->nsets = 0;
+    if (cap_get_proc_state(&lp->state)) {
+	return -1;
+    }
+    s = lp->state;
+
+    (void) cap_flat_init(&none);
+    (void) cap_flat_init(&ahead);
+    if (attr->change_gids) {
+	c = CAP_SETGID;
+	(void) cap_flat_set_flag(&ahead, CAP_EFFECTIVE, 1, &c, CAP_SET);
+    }
+    if (attr->change_mode || attr->iab) {
+	c = CAP_SETPCAP;
+	(void) cap_flat_set_flag(&ahead, CAP_EFFECTIVE, 1, &c, CAP_SET);
+    }
+    if (attr->chroot != NULL) {
+	c = CAP_SYS_CHROOT;
+	(void) cap_flat_set_flag(&ahead, CAP_EFFECTIVE, 1, &c, CAP_SET);
+    }
+
+    if (attr->change_uids) {
+	int fixup = !(s.secbits & SECBIT_NO_SETUID_FIXUP);
+	int leaves_root = fixup && attr->uid != 0
+	    && (s.uid == 0 || s.euid == 0 || s.suid == 0);
+	int clears_e = fixup && attr->uid != 0 && s.euid == 0;
+
+	if (leaves_root && !(s.secbits & SECBIT_KEEP_CAPS)) {
+	    _cap_plan_prctl(plan, _CAP_CALL_IGNORE, PR_SET_KEEPCAPS, 1, 0,
+			    0, 0, 0);
+	}
+	if (_cap_launch_want(&s.caps, clears_e ? &none : &ahead,
+			     CAP_SETUID)) {
+	    _cap_launch_capset(lp, _CAP_CALL_FATAL, &s.caps);
+	}
+	_cap_plan_add(plan, _CAP_CALL_FATAL, SYS_setuid, attr->uid,
+		      0, 0, 0, 0, 0);
+
+	for (n = 0; n < _LIBCAP_CAPABILITY_U32S; n++) {
+	    if (leaves_root) {
+		s.amb[n] = 0;
+		if (!(s.secbits & SECBIT_KEEP_CAPS)
+		    && (s.secbits & SECBIT_KEEP_CAPS_LOCKED)) {
+		    s.caps.u[n].flat[CAP_PERMITTED] = 0;
+		}
+	    }
+	    if (clears_e) {
+		s.caps.u[n].flat[CAP_EFFECTIVE] = 0;
+	    } else if (fixup && attr->uid == 0 && s.euid != 0) {
+		s.caps.u[n].flat[CAP_EFFECTIVE] =
+		    s.caps.u[n].flat[CAP_PERMITTED];
+	    }
+	    s.caps.u[n].flat[CAP_EFFECTIVE] &=
+		s.caps.u[n].flat[CAP_PERMITTED];
+	}
+	s.uid = s.euid = s.suid = attr->uid;
+    }
+
+    if (attr->change_gids) {
+	if (_cap_launch_want(&s.caps, &ahead, CAP_SETGID)) {
+	    _cap_launch_capset(lp, _CAP_CALL_FATAL, &s.caps);
+	}
+	_cap_plan_add(plan, _CAP_CALL_FATAL, SYS_setgid, attr->gid,
+		      0, 0, 0, 0, 0);
+	_cap_plan_add(plan, _CAP_CALL_FATAL, sys_setgroups_variant,
+		      attr->ngroups, (long int) attr->groups, 0, 0, 0, 0);
+    }
+
+    if (attr->change_mode) {
+	unsigned secbits = CAP_SECURED_BITS_AMBIENT;
+	cap_mode_t flavor = attr->mode;
+	cap_flat_t before;
+
+	if (_cap_launch_want(&s.caps, &ahead, CAP_SETPCAP)) {
+	    _cap_launch_capset(lp, _CAP_CALL_FATAL, &s.caps);
+	}
+	before = s.caps;
+	switch (flavor) {
+	case CAP_MODE_NOPRIV:
+	    /* fall through */
+	case CAP_MODE_PURE1E_INIT:
+	    for (n = 0; n < _LIBCAP_CAPABILITY_U32S; n++) {
+		s.caps.u[n].flat[CAP_INHERITABLE] = 0;
+	    }
+	    /* fall through */
+	case CAP_MODE_PURE1E:
+	    if (!s.ambient_supported) {
+		secbits = CAP_SECURED_BITS_BASIC;
+	    } else {
+		/*
+		 * The mode requires an empty ambient set, so it is
+		 * always cleared rather than trusting s.amb.
+		 */
+		_cap_plan_prctl(plan, _CAP_CALL_FATAL, PR_CAP_AMBIENT,
+				pr_arg(PR_CAP_AMBIENT_CLEAR_ALL),
+				pr_arg(0), pr_arg(0), pr_arg(0), pr_arg(0));
+		memset(s.amb, 0, sizeof(s.amb));
+	    }
+	    _cap_plan_prctl(plan, _CAP_CALL_FATAL, PR_SET_SECUREBITS,
+			    secbits, 0, 0, 0, 0);
+	    s.secbits = secbits;
+	    if (flavor != CAP_MODE_NOPRIV) {
+		break;
+	    }
+
+	    /* just for "case CAP_MODE_NOPRIV:" */
+
+	    for (c = 0; c < s.max_bits; c++) {
+		if (s.bound[c >> 5] & (1U << (c & 31))) {
+		    _cap_plan_prctl(plan, _CAP_CALL_IGNORE, PR_CAPBSET_DROP,
+				    pr_arg(c), pr_arg(0), 0, 0, 0);
+		}
+	    }
+	    memset(s.bound, 0, sizeof(s.bound));
+	    for (n = 0; n < _LIBCAP_CAPABILITY_U32S; n++) {
+		s.caps.u[n].flat[CAP_PERMITTED] = 0;
+		s.caps.u[n].flat[CAP_EFFECTIVE] = 0;
+	    }
+	    _cap_plan_prctl(plan, _CAP_CALL_IGNORE, PR_SET_NO_NEW_PRIVS,
+			    1, 0, 0, 0, 0);
+	    break;
+	case CAP_MODE_HYBRID:
+	    _cap_plan_prctl(plan, _CAP_CALL_FATAL, PR_SET_SECUREBITS,
+			    0, 0, 0, 0, 0);
+	    s.secbits = 0;
+	    break;
+	default:
+	    _cap_launch_plan_free(lp);
+	    errno = EINVAL;
+	    return -1;
+	}
+	if (cap_flat_compare(&before, &s.caps)) {
+	    _cap_launch_capset(lp, _CAP_CALL_FATAL, &s.caps);
+	}
+    }
+
+    if (attr->iab) {
+	cap_iab_t iab = attr->iab;
+	cap_flat_t temp = s.caps;
+	int raising = 0, check_bound = 0, clear = 0;
+
+	for (n = 0; n < _LIBCAP_CAPABILITY_U32S; n++) {
+	    raising |= iab->i[n] & ~(temp.u[n].flat[CAP_INHERITABLE]
+				     | temp.u[n].flat[CAP_PERMITTED]);
+	    check_bound |= (iab->nb[n] & s.bound[n]) != 0;
+	    temp.u[n].flat[CAP_INHERITABLE] = iab->i[n];
+	    clear |= (s.amb[n] & iab->i[n]
+		      & temp.u[n].flat[CAP_PERMITTED]) != 0;
+	}
+	if (raising || check_bound) {
+	    (void) _cap_launch_want(&temp, &ahead, CAP_SETPCAP);
+	}
+	if (cap_flat_compare(&temp, &s.caps)) {
+	    _cap_launch_capset(lp, _CAP_CALL_FATAL, &temp);
+	}
+	if (clear) {
+	    _cap_plan_prctl(plan, _CAP_CALL_FATAL, PR_CAP_AMBIENT,
+			    pr_arg(PR_CAP_AMBIENT_CLEAR_ALL),
+			    pr_arg(0), pr_arg(0), pr_arg(0), pr_arg(0));
+	}
+	for (c = s.max_bits; c-- != 0; ) {
+	    unsigned offset = c >> 5;
+	    __u32 mask = 1U << (c & 31);
+	    if (iab->a[offset] & mask) {
+		_cap_plan_prctl(plan, _CAP_CALL_FATAL, PR_CAP_AMBIENT,
+				pr_arg(PR_CAP_AMBIENT_RAISE), pr_arg(c),
+				pr_arg(0), pr_arg(0), pr_arg(0));
+	    }
+	    if (check_bound && (iab->nb[offset] & s.bound[offset] & mask)) {
+		_cap_plan_prctl(plan, _CAP_CALL_FATAL, PR_CAPBSET_DROP,
+				pr_arg(c), pr_arg(0), 0, 0, 0);
+	    }
+	}
+	for (n = 0; n < _LIBCAP_CAPABILITY_U32S; n++) {
+	    s.amb[n] = ((clear ? 0 : s.amb[n]) | iab->a[n])
+		& temp.u[n].flat[CAP_INHERITABLE]
+		& temp.u[n].flat[CAP_PERMITTED];
+	    s.bound[n] &= ~iab->nb[n];
+	}
+	s.caps = temp;
+    }
+
+    if (attr->chroot != NULL) {
+	if (_cap_launch_want(&s.caps, &ahead, CAP_SYS_CHROOT)) {
+	    _cap_launch_capset(lp, _CAP_CALL_FATAL, &s.caps);
+	}
+	_cap_plan_add(plan, _CAP_CALL_FATAL, SYS_chroot,
+		      (long int) attr->chroot, 0, 0, 0, 0, 0);
+	_cap_plan_add(plan, _CAP_CALL_FATAL, SYS_chdir, (long int) "/",
+		      0, 0, 0, 0, 0);
+    }
+
+    if (plan->overflow) {
+	_cap_launch_plan_free(lp);
+	errno = ERANGE;
+	return -1;
+    }
+    return 0;
+}
+
+/*
+ * _cap_launch_plan_new allocates and builds a launch plan for attr.
+ */
+static struct _cap_launch_plan_s *_cap_launch_plan_new(cap_launch_t attr)
+{
+    struct _cap_launch_plan_s *lp;
+
+    lp = malloc(sizeof(*lp));
+    if (lp == NULL) {
+	return NULL;
+    }
+    if (_cap_launch_plan_build(attr, lp)) {
+	free(lp);
+	return NULL;
+    }
+    return lp;
+}
+
+static void _cap_launch_plan_delete(struct _cap_launch_plan_s *lp)
+{
+    if (lp != NULL) {
+	_cap_launch_plan_free(lp);
+	free(lp);
+    }
+}
+
+/*
+ * _libcap_launch_forget discards any plan compiled for attr. The caller
+ * either holds the attr lock, or is freeing attr.
+ */
+void _libcap_launch_forget(cap_launch_t attr)
+{
+    _cap_launch_plan_delete(attr->plan);
+    attr->plan = NULL;
+}
+
+/*
+ * cap_launcher_compile plans, in the caller, every system call a
+ * launch of attr will make in its child before execve(), and keeps
+ * the plan with attr so subsequent cap_launch() calls only replay
+ * it. The return value is the number of planned system calls, or -1
+ * on error. The plan is based on the state of the caller at the time
+ * of this call: cap_launch() compiles it again if it finds any part
+ * of that state, as captured by cap_get_proc_state(), has changed.
+ * Changing the configuration of attr discards the plan.
+ */
+int cap_launcher_compile(cap_launch_t attr)
+{
+    if (!good_cap_launch_t(attr)) {
+	errno = EINVAL;
+	return -1;
+    }
+    _cap_mu_lock(&attr->mutex);
+    _libcap_launch_forget(attr);
+    if (attr->custom_setup_fn != NULL ||
+	attr->arg0 == NULL || attr->argv == NULL) {
+	errno = EINVAL;
+	_cap_mu_unlock_return(&attr->mutex, -1);
+    }
+    attr->plan = _cap_launch_plan_new(attr);
+    if (attr->plan == NULL) {
+	_cap_mu_unlock_return(&attr->mutex, -1);
+    }
+    _cap_mu_unlock_return(&attr->mutex, attr->plan->plan.n);
+}
+
+/*
+ * _cap_launch_replay performs a launch plan with direct system calls:
+ * the caller is always a single threaded child.
+ */
+static int _cap_launch_replay(const struct _cap_plan_s *plan)
+{
+    int i;
+
+    for (i = 0; i < plan->n; i++) {
+	const struct _cap_call_s *c = &plan->call[i];
+	if (syscall(c->syscall_nr, c->arg[0], c->arg[1], c->arg[2],
+		    c->arg[3], c->arg[4], c->arg[5]) >= 0) {
+	    continue;
+	}
+	if ((plan->mode[i] & ~_CAP_CALL_FLAGS) != _CAP_CALL_IGNORE) {
+	    return -1;
+	}
+    }
+    return 0;
+}
+
+struct _cap_vfork_s {
+    const struct _cap_launch_plan_s *lp;
+    cap_launch_t attr;
+    sigset_t mask;
+    int err;
+    char stack[_CAP_VFORK_STACK] __attribute__((aligned(16)));
+};
+
+/*
+ * _cap_vfork_child runs on its own stack, but in the memory of the
+ * parent, which is suspended until this function execs or exits. As
+ * with posix_spawn(), no signal handler of the parent may run here,
+ * so every caught signal is reset to its default before the signal
+ * mask is restored.
+ */
+static int _cap_vfork_child(void *arg)
+{
+    struct _cap_vfork_s *v = arg;
+    cap_launch_t attr = v->attr;
+    struct sigaction sa;
+    int sig;
+
+    for (sig = 1; sig < _NSIG; sig++) {
+	if (sigaction(sig, NULL, &sa) != 0
+	    || sa.sa_handler == SIG_DFL || sa.sa_handler == SIG_IGN) {
+	    continue;
+	}
+	sa.sa_handler = SIG_DFL;
+	sa.sa_flags = 0;
+	sigemptyset(&sa.sa_mask);
+	(void) sigaction(sig, &sa, NULL);
+    }
+    sigprocmask(SIG_SETMASK, &v->mask, NULL);
+
+    if (_cap_launch_replay(&v->lp->plan) == 0) {
+	const void *temp_args = attr->argv;
+	const void *temp_envp = attr->envp;
+	execve(attr->arg0, temp_args, temp_envp);
+    }
+    v->err = errno ? errno : ECHILD;
+    _exit(1);
+}
+
+/*
+ * _cap_vfork_launch launches attr without copying the address space
+ * of the caller. It replays the plan compiled for attr, if it is
+ * still current, or else builds one for this launch. It returns -1
+ * if this is not possible, in which case the caller should fall back
+ * to fork(). Otherwise, *child holds the result of the launch.
+ */
+static int _cap_vfork_launch(cap_launch_t attr, pid_t *child)
+{
+    struct _cap_launch_plan_s *lp = attr->plan, *owned = NULL;
+    struct _cap_vfork_s *v;
+    cap_proc_state_t state;
+    sigset_t all;
+    pid_t pid;
+    int status, olderrno = errno;
+
+    /*
+     * Both snapshots are zeroed by cap_get_proc_state() before they
+     * are filled in, so they can be compared as a whole.
+     */
+    if (lp != NULL && (cap_get_proc_state(&state)
+		       || memcmp(&state, &lp->state, sizeof(state)))) {
+	_libcap_launch_forget(attr);
+	lp = attr->plan = _cap_launch_plan_new(attr);
+    } else if (lp == NULL) {
+	lp = owned = _cap_launch_plan_new(attr);
+    }
+    if (lp == NULL) {
+	errno = olderrno;
+	return -1;
+    }
+
+    v = malloc(sizeof(*v));
+    if (v == NULL) {
+	_cap_launch_plan_delete(owned);
+	errno = olderrno;
+	return -1;
+    }
+    v->lp = lp;
+    v->attr = attr;
+    v->err = 0;
+
+    sigfillset(&all);
+    sigprocmask(SIG_BLOCK, &all, &v->mask);
+    pid = clone(_cap_vfork_child, v->stack + sizeof(v->stack),
+		CLONE_VM | CLONE_VFORK | SIGCHLD, v);
+    olderrno = errno;
+    sigprocmask(SIG_SETMASK, &v->mask, NULL);
+
+    _cap_launch_plan_delete(owned);
+    status = v->err;
+    free(v);
+    if (pid < 0) {
+	errno = olderrno;
+	return -1;
+    }
+
+    if (status) {
+	/* as for fork(), setup failures are reported as ECHILD */
+	waitpid(pid, &status, 0);
+	pid = -1;
+	olderrno = ECHILD;
+    }
+    *child = pid;
+    errno = olderrno;
+    return 0;
+}
+
 /*
  * _cap_launch is invoked in the forked child, it cannot return but is
  * required to exit, if the execve fails. It will write the errno
@@ -1062,6 +1882,14 @@ pid_t cap_launch(cap_launch_t attr, void *detail) {
 	_cap_mu_unlock_return(&attr->mutex, -1);
     }
 
+    /*
+     * Without a callback, the whole launch can be planned up front
+     * and no copy of the caller's address space is needed.
+     */
+    if (attr->custom_setup_fn == NULL && _cap_vfork_launch(attr, &child) == 0) {
+	_cap_mu_unlock_return(&attr->mutex, child);
+    }
+
     if (pipe2(ps, O_CLOEXEC) != 0) {
 	_cap_mu_unlock_return(&attr->mutex, -1);
     }
@@ -1070,6 +1898,7 @@ pid_t cap_launch(cap_launch_t attr, void *detail) {
     my_errno = errno;
 
     if (!child) {
+	_libcap_alloc_forked();
 	close(ps[0]);
 	prctl(PR_SET_NAME, "cap-launcher", 0, 0, 0);
 	_cap_launch(ps[1], attr, detail);
@@ -20,3 +20,14 @@ void psx_load_syscalls(long int (**syscall_fn)(long int,
 {
     _libcap_overrode_syscalls = 0;
 }
+
+/*
+ * Similarly, libpsx overrides this function to provide libcap with
+ * psx_syscall_batch().
+ */
+__attribute__((weak))
+void psx_load_syscall_batch(int (**batch_fn)(const struct _cap_call_s *calls,
+					     int n))
+{
+    *batch_fn = NULL;
+}
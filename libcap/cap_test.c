@@ -1,5 +1,11 @@
 #define _GNU_SOURCE
 #include <stdio.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include "libcap.h"
 
@@ -254,6 +260,689 @@ drop_c:
     return retval;
 }
 
+static int test_arena(void)
+{
+    int retval = 0, i;
+    cap_arena_t arena;
+    cap_t c, d;
+    cap_iab_t iab;
+    cap_value_t v = CAP_CHOWN;
+
+    printf("test_arena\n");
+    fflush(stdout);
+
+    /* exercise free-list recycling */
+    for (i = 0; i < 100; i++) {
+	c = cap_init();
+	d = cap_dup(c);
+	if (c == NULL || d == NULL) {
+	    perror("failed to allocate recycled cap_t");
+	    retval = -1;
+	}
+	cap_free(c);
+	if (!cap_free(c)) {
+	    printf("recycled cap_t was freed twice\n");
+	    retval = -1;
+	}
+	cap_free(d);
+	if (retval) {
+	    return retval;
+	}
+    }
+
+    arena = cap_arena_init();
+    if (arena == NULL) {
+	perror("failed to allocate an arena");
+	return -1;
+    }
+    c = cap_init();
+    if (cap_arena_cap_init((cap_arena_t) c) != NULL) {
+	printf("arena allocation from a non-arena\n");
+	retval = -1;
+    }
+    cap_free(c);
+    c = cap_arena_cap_init(arena);
+    if (c == NULL || cap_set_flag(c, CAP_PERMITTED, 1, &v, CAP_SET)) {
+	perror("failed to use an arena cap_t");
+	retval = -1;
+	goto drop_arena;
+    }
+    /* more than one chunk's worth */
+    for (i = 0; i < 100; i++) {
+	d = cap_arena_cap_dup(arena, c);
+	if (d == NULL || cap_compare(c, d)) {
+	    printf("arena duplicate %d mismatch\n", i);
+	    retval = -1;
+	    goto drop_arena;
+	}
+	if (i & 1) {
+	    continue;
+	}
+	if (cap_free(d)) {
+	    perror("unable to free arena cap_t");
+	    retval = -1;
+	    goto drop_arena;
+	}
+	if (!cap_free(d)) {
+	    printf("arena cap_t was freed twice\n");
+	    retval = -1;
+	    goto drop_arena;
+	}
+    }
+    iab = cap_arena_iab_init(arena);
+    if (iab == NULL || cap_iab_set_vector(iab, CAP_IAB_INH, v, CAP_SET)) {
+	perror("failed to use an arena cap_iab_t");
+	retval = -1;
+    }
+
+drop_arena:
+    if (cap_free(arena)) {
+	perror("failed to free arena");
+	retval = -1;
+    }
+    return retval;
+}
+
+static int test_flat(void)
+{
+    int retval = 0;
+    cap_flat_t flat, proc;
+    cap_value_t vs[] = { CAP_CHOWN, CAP_SETPCAP, CAP_SYS_ADMIN, 63 };
+    cap_flag_value_t v;
+    cap_t c, d;
+    char buf[256], *text;
+
+    printf("test_flat\n");
+    fflush(stdout);
+
+    cap_flat_init(&flat);
+    cap_flat_set_flag(&flat, CAP_PERMITTED, 4, vs, CAP_SET);
+    cap_flat_set_flag(&flat, CAP_EFFECTIVE, 2, vs, CAP_SET);
+    if (cap_flat_get_flag(&flat, CAP_SYS_ADMIN, CAP_PERMITTED, &v)
+	|| v != CAP_SET
+	|| cap_flat_get_flag(&flat, CAP_SYS_ADMIN, CAP_EFFECTIVE, &v)
+	|| v != CAP_CLEAR) {
+	printf("cap_flat_get_flag mismatch\n");
+	return -1;
+    }
+
+    c = cap_from_text("cap_chown,cap_setpcap=ep cap_sys_admin,63+p");
+    d = cap_from_flat(&flat);
+    if (c == NULL || d == NULL || cap_compare(c, d)) {
+	printf("cap_from_flat mismatch\n");
+	retval = -1;
+	goto drop;
+    }
+
+    text = cap_to_text(c, NULL);
+    if (cap_flat_to_text(&flat, buf, sizeof(buf)) != (ssize_t) strlen(text)
+	|| strcmp(buf, text)) {
+	printf("cap_flat_to_text [%s] != [%s]\n", buf, text);
+	retval = -1;
+    }
+    if (cap_flat_to_text(&flat, buf, strlen(text)) != -1 || errno != ERANGE) {
+	printf("cap_flat_to_text did not detect short buffer\n");
+	retval = -1;
+    }
+    cap_free(text);
+
+    cap_free(d);
+    d = cap_get_proc();
+    if (cap_flat_get_proc(&proc) || cap_to_flat(d, &flat)
+	|| cap_flat_compare(&proc, &flat)) {
+	printf("cap_flat_get_proc mismatch\n");
+	retval = -1;
+    }
+
+drop:
+    cap_free(c);
+    cap_free(d);
+    return retval;
+}
+
+static int test_text_r(void)
+{
+    int retval = 0;
+    const char *texts[] = { "=", "=ep", "cap_chown=eip cap_setuid+i 40+p",
+			    "= cap_sys_admin+ep 63+i", NULL };
+    const char *iabs[] = { "", "!cap_sys_boot,^cap_chown,%cap_setuid",
+			   "cap_net_raw,!63", NULL };
+    char small[8], big[4096], *text;
+    ssize_t n;
+    int i;
+
+    printf("test_text_r\n");
+    fflush(stdout);
+
+    for (i = 0; texts[i]; i++) {
+	cap_t c = cap_from_text(texts[i]);
+	text = cap_to_text(c, NULL);
+	n = cap_to_text_r(c, big, sizeof(big));
+	if (n != (ssize_t) strlen(text) || strcmp(big, text)) {
+	    printf("cap_to_text_r [%s] != [%s]\n", big, text);
+	    retval = -1;
+	}
+	n = cap_to_text_r(c, small, sizeof(small));
+	if (strlen(text) < sizeof(small) ? strcmp(small, text)
+	    : (n != -1 || errno != ERANGE)) {
+	    printf("cap_to_text_r short buffer mishandled for [%s]\n", text);
+	    retval = -1;
+	}
+	cap_free(text);
+	cap_free(c);
+    }
+
+    for (i = 0; iabs[i]; i++) {
+	cap_iab_t iab = cap_iab_from_text(iabs[i]);
+	text = cap_iab_to_text(iab);
+	n = cap_iab_to_text_r(iab, big, sizeof(big));
+	if (n != (ssize_t) strlen(text) || strcmp(big, text)) {
+	    printf("cap_iab_to_text_r [%s] != [%s]\n", big, text);
+	    retval = -1;
+	}
+	n = cap_iab_to_text_r(iab, small, sizeof(small));
+	if (strlen(text) < sizeof(small) ? strcmp(small, text)
+	    : (n != -1 || errno != ERANGE)) {
+	    printf("cap_iab_to_text_r short buffer mishandled [%s]\n", text);
+	    retval = -1;
+	}
+	cap_free(text);
+	cap_free(iab);
+    }
+
+    return retval;
+}
+
+static int test_text_roundtrip(void)
+{
+    int retval = 0, k;
+    unsigned seed = 1;
+
+    printf("test_text_roundtrip\n");
+    fflush(stdout);
+
+    for (k = 0; k < 1000 && !retval; k++) {
+	cap_t c = cap_init(), d;
+	cap_value_t v;
+	ssize_t n;
+	char *text;
+	int f;
+
+	for (v = 0; v < __CAP_MAXBITS; v++) {
+	    for (f = 0; f < 3; f++) {
+		seed = seed * 1103515245 + 12345;
+		/* vary the density of raised bits from set to set */
+		if (((seed >> 16) & 7) < (unsigned) (k & 7)) {
+		    cap_set_flag(c, f, 1, &v, CAP_SET);
+		}
+	    }
+	}
+	text = cap_to_text(c, &n);
+	d = cap_from_text(text);
+	if (text == NULL || n != (ssize_t) strlen(text) || cap_compare(c, d)) {
+	    printf("failed to round trip [%s]\n", text);
+	    retval = -1;
+	}
+	cap_free(text);
+	cap_free(d);
+	cap_free(c);
+    }
+    return retval;
+}
+
+static int test_names(void)
+{
+    int retval = 0;
+    cap_value_t v, got;
+
+    printf("test_names\n");
+    fflush(stdout);
+
+    for (v = 0; v < cap_max_bits() && v < __CAP_BITS; v++) {
+	char upper[__CAP_NAME_SIZE+2], *name = cap_to_name(v);
+	size_t i;
+	for (i = 0; name[i]; i++) {
+	    upper[i] = toupper(name[i]);
+	}
+	upper[i] = '\0';
+	if (cap_from_name(name, &got) || got != v
+	    || cap_from_name(upper, &got) || got != v) {
+	    printf("failed to look up %s\n", name);
+	    retval = -1;
+	}
+	upper[i] = '1';
+	upper[i+1] = '\0';
+	if (!cap_from_name(upper, &got)) {
+	    printf("accepted %s\n", upper);
+	    retval = -1;
+	}
+	upper[i-1] = '\0';
+	if (!cap_from_name(upper, &got)) {
+	    printf("accepted %s\n", upper);
+	    retval = -1;
+	}
+	cap_free(name);
+    }
+    return retval;
+}
+
+static int test_parser(void)
+{
+    int retval = 0, i;
+    size_t step;
+    const char *good = "  cap_chown,cap_setuid=ep cap_sys_admin+i\n"
+	"cap_setuid-e\tall=ep cap_kill-p 40+i  ";
+    const struct {
+	const char *text;
+	ssize_t at;
+    } bad[] = {
+	{ "cap_chown=ep cap_bogus+i", 13 },
+	{ "cap_chown=ep cap_setuid+x", 24 },
+	{ "=ep +i", 4 },
+	{ "cap_chown=ep\n\ncap_kill", 22 },
+	{ NULL, 0 }
+    };
+    cap_text_parser_t parser;
+    cap_t want, got;
+
+    printf("test_parser\n");
+    fflush(stdout);
+
+    parser = cap_text_parser_init();
+    got = cap_init();
+    want = cap_from_text(good);
+    if (parser == NULL || got == NULL || want == NULL) {
+	perror("failed to allocate parser test objects");
+	retval = -1;
+	goto drop;
+    }
+
+    for (step = 1; step <= strlen(good); step++) {
+	size_t off;
+	cap_text_parser_reset(parser);
+	for (off = 0; off < strlen(good); off += step) {
+	    size_t n = strlen(good) - off;
+	    if (cap_text_parser_feed(parser, good+off, n < step ? n : step)) {
+		printf("failed to feed chunk at %zu\n", off);
+		retval = -1;
+		goto drop;
+	    }
+	}
+	if (cap_text_parser_finish(parser, got) || cap_compare(want, got)
+	    || cap_text_parser_error(parser) != -1) {
+	    printf("parser mismatch with chunk size %zu\n", step);
+	    retval = -1;
+	    goto drop;
+	}
+    }
+
+    for (i = 0; bad[i].text; i++) {
+	cap_text_parser_reset(parser);
+	cap_text_parser_feed(parser, bad[i].text, strlen(bad[i].text));
+	if (!cap_text_parser_finish(parser, got)
+	    || cap_text_parser_error(parser) != bad[i].at) {
+	    printf("[%s] error at %zd, want %zd\n", bad[i].text,
+		   cap_text_parser_error(parser), bad[i].at);
+	    retval = -1;
+	}
+	if (cap_from_text(bad[i].text) != NULL) {
+	    printf("cap_from_text accepted [%s]\n", bad[i].text);
+	    retval = -1;
+	}
+    }
+
+drop:
+    cap_free(want);
+    cap_free(got);
+    cap_free(parser);
+    return retval;
+}
+
+static int test_text_cache(void)
+{
+    int retval = 0;
+    const char *texts[] = {
+	"cap_net_bind_service=ep", "cap_chown,cap_kill=p cap_kill+i", NULL
+    };
+    const char *iab_text = "!%cap_sys_admin";
+    cap_text_cache_t cache;
+    unsigned long hits, misses;
+    int i, round;
+
+    printf("test_text_cache\n");
+    fflush(stdout);
+
+    cache = cap_text_cache_init(8);
+    if (cache == NULL) {
+	perror("failed to allocate text cache");
+	return -1;
+    }
+
+    for (round = 0; round < 3; round++) {
+	for (i = 0; texts[i]; i++) {
+	    cap_t want = cap_from_text(texts[i]);
+	    cap_t got = cap_text_cache_from_text(cache, texts[i]);
+	    if (want == NULL || got == NULL || cap_compare(want, got)) {
+		printf("cached [%s] mismatch in round %d\n", texts[i], round);
+		retval = -1;
+	    }
+	    cap_free(want);
+	    cap_free(got);
+	}
+	cap_iab_t iab_want = cap_iab_from_text(iab_text);
+	cap_iab_t iab_got = cap_text_cache_iab_from_text(cache, iab_text);
+	if (iab_want == NULL || iab_got == NULL
+	    || cap_iab_compare(iab_want, iab_got)) {
+	    printf("cached [%s] mismatch in round %d\n", iab_text, round);
+	    retval = -1;
+	}
+	cap_free(iab_want);
+	cap_free(iab_got);
+    }
+    if (cap_text_cache_from_text(cache, "cap_bogus=ep") != NULL) {
+	printf("cache accepted bad text\n");
+	retval = -1;
+    }
+
+    cap_text_cache_stats(cache, &hits, &misses);
+    if (hits != 6 || misses != 4) {
+	printf("cache hits=%lu misses=%lu, want 6 and 4\n", hits, misses);
+	retval = -1;
+    }
+    cap_text_cache_clear(cache);
+    cap_text_cache_stats(cache, &hits, &misses);
+    if (hits || misses) {
+	printf("cache stats not cleared\n");
+	retval = -1;
+    }
+
+    cap_free(cache);
+    return retval;
+}
+
+static int test_proc_state(void)
+{
+    int retval = 0;
+    cap_proc_state_t state;
+    cap_value_t c;
+    cap_iab_t iab;
+
+    printf("test_proc_state\n");
+    fflush(stdout);
+
+    if (cap_get_proc_state(&state)) {
+	perror("cap_get_proc_state failed");
+	return -1;
+    }
+    if (state.max_bits != cap_max_bits() || state.uid != getuid()
+	|| state.euid != geteuid() || state.gid != getgid()
+	|| state.egid != getegid() || state.secbits != cap_get_secbits()) {
+	printf("proc state ids or bits mismatch\n");
+	retval = -1;
+    }
+    for (c = 0; c < cap_max_bits(); c++) {
+	if (!!(state.bound[c >> 5] & (1U << (c & 31))) != cap_get_bound(c)) {
+	    printf("proc state bound bit %d mismatch\n", c);
+	    retval = -1;
+	}
+	if (state.ambient_supported &&
+	    !!(state.amb[c >> 5] & (1U << (c & 31))) != cap_get_ambient(c)) {
+	    printf("proc state ambient bit %d mismatch\n", c);
+	    retval = -1;
+	}
+    }
+    if (cap_proc_state_mode(&state) != cap_get_mode()) {
+	printf("proc state mode mismatch\n");
+	retval = -1;
+    }
+
+    /* without a /proc filesystem, prctl() supplies the same state */
+    {
+	cap_proc_state_t fallback;
+	char *old_root = cap_proc_root("/nonexistent");
+	int ret = cap_get_proc_state(&fallback);
+	cap_free(cap_proc_root(old_root ? old_root : "/proc"));
+	cap_free(old_root);
+	if (ret || memcmp(&state, &fallback, sizeof(state))) {
+	    printf("prctl fallback proc state mismatch\n");
+	    retval = -1;
+	}
+    }
+
+    iab = cap_proc_state_iab(&state);
+    if (iab == NULL) {
+	perror("cap_proc_state_iab failed");
+	return -1;
+    }
+    for (c = 0; c < cap_max_bits(); c++) {
+	if (cap_iab_get_vector(iab, CAP_IAB_BOUND, c) == !cap_get_bound(c)) {
+	    continue;
+	}
+	printf("proc state iab bound bit %d mismatch\n", c);
+	retval = -1;
+    }
+    cap_free(iab);
+    return retval;
+}
+
+/*
+ * proc_state_worker drops a bounding bit in this thread alone, and
+ * checks that the snapshot, the IAB and the pid 0 entry of
+ * cap_get_pids() all describe this thread.
+ */
+static void *proc_state_worker(void *arg)
+{
+    int *retval = arg;
+    cap_proc_state_t state;
+    cap_pid_info_t info;
+    const pid_t self = 0;
+    cap_iab_t iab;
+
+    if (prctl(PR_CAPBSET_DROP, CAP_SYS_ADMIN, 0, 0, 0)) {
+	return NULL;   /* not privileged enough to arrange the test */
+    }
+    if (cap_get_proc_state(&state)
+	|| (state.bound[CAP_SYS_ADMIN >> 5] & (1U << (CAP_SYS_ADMIN & 31)))) {
+	printf("thread proc state has the leader's bounding set\n");
+	*retval = -1;
+    }
+    iab = cap_iab_get_proc();
+    if (iab == NULL
+	|| cap_iab_get_vector(iab, CAP_IAB_BOUND, CAP_SYS_ADMIN) != CAP_SET) {
+	printf("thread iab does not show its dropped bounding bit\n");
+	*retval = -1;
+    }
+    cap_free(iab);
+    if (cap_get_pids(&self, 1, &info) != 1
+	|| (info.bound[CAP_SYS_ADMIN >> 5] & (1U << (CAP_SYS_ADMIN & 31)))) {
+	printf("thread cap_get_pids(0) has the leader's bounding set\n");
+	*retval = -1;
+    }
+    return NULL;
+}
+
+/*
+ * test_proc_state_thread confirms cap_get_proc_state() describes the
+ * calling thread, and not the thread group leader.
+ */
+static int test_proc_state_thread(void)
+{
+    int retval = 0;
+    pthread_t worker;
+
+    if (pthread_create(&worker, NULL, proc_state_worker, &retval)) {
+	perror("pthread_create failed");
+	return -1;
+    }
+    pthread_join(worker, NULL);
+    return retval;
+}
+
+static int test_procfd(void)
+{
+    int retval = 0, dirfd;
+    cap_iab_t iab_pid, iab_fd, iab_proc;
+    cap_t caps_fd, caps_proc;
+
+    printf("test_procfd\n");
+    fflush(stdout);
+
+    dirfd = open("/proc/self", O_RDONLY | O_DIRECTORY);
+    if (dirfd < 0) {
+	perror("no /proc/self, skipping");
+	return 0;
+    }
+    iab_pid = cap_iab_get_pid(getpid());
+    iab_fd = cap_iab_get_procfd(dirfd);
+    iab_proc = cap_iab_get_proc();
+    if (iab_pid == NULL || iab_fd == NULL || iab_proc == NULL
+	|| cap_iab_compare(iab_pid, iab_proc)
+	|| cap_iab_compare(iab_fd, iab_proc)) {
+	printf("/proc status IAB mismatch\n");
+	retval = -1;
+    }
+    caps_fd = cap_get_procfd(dirfd);
+    caps_proc = cap_get_proc();
+    if (caps_fd == NULL || caps_proc == NULL
+	|| cap_compare(caps_fd, caps_proc)) {
+	printf("/proc status capabilities mismatch\n");
+	retval = -1;
+    }
+    close(dirfd);
+    cap_free(iab_pid);
+    cap_free(iab_fd);
+    cap_free(iab_proc);
+    cap_free(caps_fd);
+    cap_free(caps_proc);
+    return retval;
+}
+
+static int test_get_pids(void)
+{
+    int retval = 0, i;
+    pid_t pids[3];
+    cap_pid_info_t info[3];
+    cap_proc_state_t state;
+
+    printf("test_get_pids\n");
+    fflush(stdout);
+
+    pids[0] = getpid();
+    pids[1] = 0;
+    pids[2] = -1;
+    if (cap_get_proc_state(&state)) {
+	perror("cap_get_proc_state failed");
+	return -1;
+    }
+    if (cap_get_pids(pids, 3, info) != 2) {
+	printf("cap_get_pids did not read 2 processes\n");
+	return -1;
+    }
+    for (i = 0; i < 2; i++) {
+	if (info[i].pid != pids[i] || info[i].error
+	    || cap_flat_compare(&info[i].caps, &state.caps)
+	    || memcmp(info[i].amb, state.amb, sizeof(state.amb))
+	    || memcmp(info[i].bound, state.bound, sizeof(state.bound))
+	    || info[i].uid != state.uid || info[i].egid != state.egid) {
+	    printf("cap_get_pids entry %d mismatch\n", i);
+	    retval = -1;
+	}
+    }
+    if (info[2].error != ENOENT) {
+	printf("cap_get_pids bad pid error=%d, want ENOENT\n", info[2].error);
+	retval = -1;
+    }
+    return retval;
+}
+
+static int test_fileat(void)
+{
+    int retval = 0, dirfd = -1, fd;
+    char dir[] = "/tmp/cap_test.XXXXXX";
+    char path[sizeof(dir) + 16];
+    const char *names[] = { "plain", "capable", "missing" };
+    cap_file_info_t found[3];
+    cap_flat_t flat, want;
+    cap_t caps = NULL;
+
+    printf("test_fileat\n");
+    fflush(stdout);
+
+    if (mkdtemp(dir) == NULL) {
+	perror("unable to create a temporary directory");
+	return -1;
+    }
+    snprintf(path, sizeof(path), "%s/plain", dir);
+    fd = open(path, O_CREAT | O_WRONLY, 0644);
+    close(fd);
+    snprintf(path, sizeof(path), "%s/capable", dir);
+    fd = open(path, O_CREAT | O_WRONLY, 0755);
+    close(fd);
+
+    caps = cap_from_text("cap_net_raw,cap_kill=ep");
+    if (caps == NULL || fd < 0) {
+	perror("failed to prepare test files");
+	retval = -1;
+	goto drop;
+    }
+    if (cap_set_file(path, caps)) {
+	printf("unable to set file capabilities, skipping\n");
+	goto drop;
+    }
+    dirfd = open(dir, O_RDONLY | O_DIRECTORY);
+    cap_to_flat(caps, &want);
+    if (cap_get_fileat(dirfd, "capable", 0, &flat)
+	|| cap_flat_compare(&flat, &want)) {
+	printf("cap_get_fileat mismatch\n");
+	retval = -1;
+    }
+    fd = openat(dirfd, "capable", O_PATH);
+    if (cap_get_fileat(fd, "", AT_EMPTY_PATH, &flat)
+	|| cap_flat_compare(&flat, &want)) {
+	printf("cap_get_fileat AT_EMPTY_PATH mismatch\n");
+	retval = -1;
+    }
+    close(fd);
+    errno = 0;
+    if (cap_get_fileat(AT_FDCWD, "", AT_EMPTY_PATH, &flat) == 0
+	|| (errno != ENODATA && errno != ENOTSUP)) {
+	printf("cap_get_fileat AT_FDCWD AT_EMPTY_PATH errno=%d\n", errno);
+	retval = -1;
+    }
+    if (cap_get_fileat(dirfd, "plain", 0, &flat) == 0) {
+	printf("cap_get_fileat found capabilities on a plain file\n");
+	retval = -1;
+    }
+    if (cap_get_files(dirfd, names, 3, 0, found) != 2 || found[0].index != 1
+	|| found[0].error || cap_flat_compare(&found[0].caps, &want)
+	|| found[1].index != 2 || found[1].error != ENOENT) {
+	printf("cap_get_files mismatch\n");
+	retval = -1;
+    }
+    fd = openat(dirfd, "plain", O_PATH | O_NOFOLLOW);
+    if (cap_set_fd(fd, caps) || cap_get_fileat(dirfd, "plain", 0, &flat)
+	|| cap_flat_compare(&flat, &want)) {
+	printf("cap_set_fd via O_PATH failed\n");
+	retval = -1;
+    }
+    if (cap_set_fd(fd, NULL) || cap_get_fileat(dirfd, "plain", 0, &flat) == 0) {
+	printf("cap_set_fd via O_PATH did not remove capabilities\n");
+	retval = -1;
+    }
+    close(fd);
+
+drop:
+    if (dirfd >= 0) {
+	close(dirfd);
+    }
+    cap_free(caps);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/plain", dir);
+    unlink(path);
+    rmdir(dir);
+    return retval;
+}
+
 static int test_prctl(void)
 {
     int ret, retval=0;
@@ -269,6 +958,52 @@ static int test_prctl(void)
     return retval;
 }
 
+/*
+ * test_mode_failure confirms that a cap_set_mode() that cannot raise
+ * CAP_SETPCAP only lowers the effective flags of the process.
+ */
+static int test_mode_failure(void)
+{
+    const cap_value_t setpcap = CAP_SETPCAP;
+    int status;
+    pid_t pid;
+
+    pid = fork();
+    if (pid < 0) {
+	perror("fork failed");
+	return -1;
+    }
+    if (pid == 0) {
+	cap_t working = cap_get_proc(), after;
+	cap_flat_t want, got;
+
+	(void) cap_fill(working, CAP_INHERITABLE, CAP_PERMITTED);
+	(void) cap_set_flag(working, CAP_PERMITTED, 1, &setpcap, CAP_CLEAR);
+	(void) cap_set_flag(working, CAP_EFFECTIVE, 1, &setpcap, CAP_CLEAR);
+	(void) cap_set_flag(working, CAP_INHERITABLE, 1, &setpcap, CAP_CLEAR);
+	if (cap_set_proc(working)) {
+	    _exit(0);   /* not privileged enough to arrange the test */
+	}
+	if (cap_set_mode(CAP_MODE_PURE1E_INIT) == 0) {
+	    printf("cap_set_mode succeeded without CAP_SETPCAP\n");
+	    _exit(1);
+	}
+	(void) cap_clear_flag(working, CAP_EFFECTIVE);
+	(void) cap_to_flat(working, &want);
+	after = cap_get_proc();
+	if (after == NULL || cap_to_flat(after, &got)
+	    || cap_flat_compare(&want, &got)) {
+	    printf("failed cap_set_mode changed more than effective flags\n");
+	    _exit(1);
+	}
+	_exit(0);
+    }
+    if (waitpid(pid, &status, 0) != pid || status != 0) {
+	return -1;
+    }
+    return 0;
+}
+
 int main(int argc, char **argv) {
     int result = 0;
 
@@ -284,9 +1019,48 @@ int main(int argc, char **argv) {
     printf("test_alloc: being called\n");
     fflush(stdout);
     result = test_alloc() | result;
+    printf("test_arena: being called\n");
+    fflush(stdout);
+    result = test_arena() | result;
+    printf("test_flat: being called\n");
+    fflush(stdout);
+    result = test_flat() | result;
+    printf("test_text_r: being called\n");
+    fflush(stdout);
+    result = test_text_r() | result;
+    printf("test_text_roundtrip: being called\n");
+    fflush(stdout);
+    result = test_text_roundtrip() | result;
+    printf("test_names: being called\n");
+    fflush(stdout);
+    result = test_names() | result;
+    printf("test_parser: being called\n");
+    fflush(stdout);
+    result = test_parser() | result;
+    printf("test_text_cache: being called\n");
+    fflush(stdout);
+    result = test_text_cache() | result;
+    printf("test_proc_state: being called\n");
+    fflush(stdout);
+    result = test_proc_state() | result;
+    printf("test_proc_state_thread: being called\n");
+    fflush(stdout);
+    result = test_proc_state_thread() | result;
+    printf("test_procfd: being called\n");
+    fflush(stdout);
+    result = test_procfd() | result;
+    printf("test_get_pids: being called\n");
+    fflush(stdout);
+    result = test_get_pids() | result;
+    printf("test_fileat: being called\n");
+    fflush(stdout);
+    result = test_fileat() | result;
     printf("test_prctl: being called\n");
     fflush(stdout);
     result = test_prctl() | result;
+    printf("test_mode_failure: being called\n");
+    fflush(stdout);
+    result = test_mode_failure() | result;
     printf("tested\n");
     fflush(stdout);
 
@@ -16,18 +16,30 @@
 #include "libcap.h"
 
 static char const *_cap_names[__CAP_BITS] = LIBCAP_CAP_NAMES;
+static const unsigned _cap_hash_disp[__CAP_HASH_BUCKETS] =
+    LIBCAP_CAP_HASH_DISP;
+static const unsigned char _cap_hash_slots[__CAP_HASH_SLOTS] =
+    LIBCAP_CAP_HASH_SLOTS;
 
 #include <ctype.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
-#ifdef INCLUDE_GPERF_OUTPUT
-/* we need to include it after #define _GNU_SOURCE is set */
-#include INCLUDE_GPERF_OUTPUT
-#endif
+#include "cap_hash.h"
 
 /* Maximum output text length */
 #define CAP_TEXT_SIZE    (__CAP_NAME_SIZE * __CAP_MAXBITS)
 
+/*
+ * This code assumes that the longest named capability is longer than
+ * the decimal text representation of __CAP_MAXBITS. This is very true
+ * at the time of writing and likely to remain so. However, we have
+ * a test in cap_text to validate it at build time.
+ */
+#define CAP_TEXT_BUFFER_ZONE 100
+
 /*
  * Parse a textual representation of capabilities, returning an internal
  * representation.
@@ -35,7 +47,8 @@ static char const *_cap_names[__CAP_BITS] = LIBCAP_CAP_NAMES;
 
 #define raise_cap_mask(flat, c)  (flat)[CAP_TO_INDEX(c)] |= CAP_TO_MASK(c)
 
-static void setbits(cap_t a, const __u32 *b, cap_flag_t set, unsigned blks)
+static void setbits(cap_flat_t *a, const __u32 *b, cap_flag_t set,
+		    unsigned blks)
 {
     int n;
     for (n = blks; n--; ) {
@@ -43,7 +56,8 @@ static void setbits(cap_t a, const __u32 *b, cap_flag_t set, unsigned blks)
     }
 }
 
-static void clrbits(cap_t a, const __u32 *b, cap_flag_t set, unsigned blks)
+static void clrbits(cap_flat_t *a, const __u32 *b, cap_flag_t set,
+		    unsigned blks)
 {
     int n;
     for (n = blks; n--; )
@@ -84,6 +98,54 @@ static void forceall(__u32 *flat, __u32 value, unsigned blks)
     return;
 }
 
+/*
+ * _cap_name_eq compares a len byte token with a known name, case
+ * insensitively, eight bytes at a time. The fold (|0x20) is only
+ * valid for the [A-Za-z_] characters of a token.
+ */
+static int _cap_name_eq(const char *token, const char *name, size_t len)
+{
+    const uint64_t fold = 0x2020202020202020ULL;
+
+    if (strlen(name) != len) {
+	return 0;
+    }
+    for (; len >= sizeof(uint64_t); len -= sizeof(uint64_t)) {
+	uint64_t a, b;
+	memcpy(&a, token, sizeof(a));
+	memcpy(&b, name, sizeof(b));
+	if ((a | fold) != (b | fold)) {
+	    return 0;
+	}
+	token += sizeof(uint64_t);
+	name += sizeof(uint64_t);
+    }
+    while (len--) {
+	if ((*token++ | 0x20) != (*name++ | 0x20)) {
+	    return 0;
+	}
+    }
+    return 1;
+}
+
+/*
+ * _cap_hash_lookup uses the build time generated minimal perfect hash
+ * of the known capability names to find the index of a len byte
+ * token, or returns -1.
+ */
+static int _cap_hash_lookup(const char *token, size_t len)
+{
+    unsigned b = _cap_name_hash(token, len, 0) % __CAP_HASH_BUCKETS;
+    unsigned slot = _cap_name_hash(token, len, _cap_hash_disp[b])
+	% __CAP_HASH_SLOTS;
+    int n = _cap_hash_slots[slot];
+
+    if (!_cap_name_eq(token, _cap_names[n], len)) {
+	return -1;
+    }
+    return n;
+}
+
 static int lookupname(char const **strp)
 {
     union {
@@ -99,7 +161,7 @@ static int lookupname(char const **strp)
 	*strp = str.constp;
 	return n;
     } else {
-	int c;
+	int c, n;
 	size_t len;
 
 	for (len=0; (c = str.constp[len]); ++len) {
@@ -108,72 +170,181 @@ static int lookupname(char const **strp)
 	    }
 	}
 
-#ifdef GPERF_DOWNCASE
-	const struct __cap_token_s *token_info;
-
-	token_info = __cap_lookup_name(str.constp, len);
-	if (token_info != NULL) {
+	if ((n = _cap_hash_lookup(str.constp, len)) >= 0
+	    && n < cap_max_bits() && !isdigit((unsigned char) str.constp[len])) {
 	    *strp = str.constp + len;
-	    return token_info->index;
-	}
-#else /* ie., ndef GPERF_DOWNCASE */
-	char const *s;
-	unsigned n = cap_max_bits();
-	if (n > __CAP_BITS) {
-	    n = __CAP_BITS;
-	}
-	while (n--) {
-	    if (_cap_names[n] && (s = namcmp(str.constp, _cap_names[n]))) {
-		*strp = s;
-		return n;
-	    }
+	    return n;
 	}
-#endif /* def GPERF_DOWNCASE */
 
 	return -1;   	/* No definition available */
     }
 }
 
-cap_t cap_from_text(const char *str)
+/*
+ * _cap_text_blks returns the number of __u32 blocks of the kernel's
+ * preferred capability version, or 0 if it is unknown.
+ */
+static unsigned _cap_text_blks(void)
 {
-    cap_t res;
-    int n;
+    switch (_libcap_version()) {
+    case _LINUX_CAPABILITY_VERSION_1:
+	return _LINUX_CAPABILITY_U32S_1;
+    case _LINUX_CAPABILITY_VERSION_2:
+	return _LINUX_CAPABILITY_U32S_2;
+    case _LINUX_CAPABILITY_VERSION_3:
+	return _LINUX_CAPABILITY_U32S_3;
+    default:
+	return 0;
+    }
+}
+
+/*
+ * _cap_parse_clause applies the single (space terminated) clause at
+ * str to res. It returns a pointer to the character following the
+ * clause, or NULL with *errp pointing at the offending character.
+ */
+static const char *_cap_parse_clause(cap_flat_t *res, const char *str,
+				     unsigned cap_blks, const char **errp)
+{
+    __u32 list[__CAP_BLKS];
+    char op;
+    int n, flags = 0, listed=0;
+
+    memset(list, 0, sizeof(__u32)*__CAP_BLKS);
+
+    /* identify caps specified by this clause */
+    if (isalnum((unsigned char)*str) || *str == '_') {
+	for (;;) {
+	    if (namcmp(str, "all")) {
+		str += 3;
+		forceall(list, ~0, cap_blks);
+	    } else {
+		n = lookupname(&str);
+		if (n == -1)
+		    goto bad;
+		raise_cap_mask(list, n);
+	    }
+	    if (*str != ',')
+		break;
+	    if (!isalnum((unsigned char)*++str) && *str != '_')
+		goto bad;
+	}
+	listed = 1;
+    } else if (*str == '+' || *str == '-') {
+	goto bad;                    /* require a list of capabilities */
+    } else {
+	forceall(list, ~0, cap_blks);
+    }
+
+    /* identify first operation on list of capabilities */
+    op = *str++;
+    if (op == '=' && (*str == '+' || *str == '-')) {
+	if (!listed)
+	    goto bad;
+	op = (*str++ == '+' ? 'P':'M'); /* skip '=' and take next op */
+    } else if (op != '+' && op != '-' && op != '=') {
+	str--;
+	goto bad;
+    }
+
+    /* cycle through list of actions */
+    do {
+	_cap_debug("next char = '%c'", *str);
+	if (*str && !isspace(*str)) {
+	    switch (*str++) {    /* Effective, Inheritable, Permitted */
+	    case 'e':
+		flags |= LIBCAP_EFF;
+		break;
+	    case 'i':
+		flags |= LIBCAP_INH;
+		break;
+	    case 'p':
+		flags |= LIBCAP_PER;
+		break;
+	    default:
+		str--;
+		goto bad;
+	    }
+	} else if (op != '=') {
+	    _cap_debug("only '=' can be followed by space");
+	    goto bad;
+	}
+
+	_cap_debug("how to read?");
+	switch (op) {               /* how do we interpret the caps? */
+	case '=':
+	case 'P':                                              /* =+ */
+	case 'M':                                              /* =- */
+	    clrbits(res, list, CAP_EFFECTIVE, cap_blks);
+	    clrbits(res, list, CAP_PERMITTED, cap_blks);
+	    clrbits(res, list, CAP_INHERITABLE, cap_blks);
+	    if (op == 'M')
+		goto minus;
+	    /* fall through */
+	case '+':
+	    if (flags & LIBCAP_EFF)
+		setbits(res, list, CAP_EFFECTIVE, cap_blks);
+	    if (flags & LIBCAP_PER)
+		setbits(res, list, CAP_PERMITTED, cap_blks);
+	    if (flags & LIBCAP_INH)
+		setbits(res, list, CAP_INHERITABLE, cap_blks);
+	    break;
+	case '-':
+	minus:
+	    if (flags & LIBCAP_EFF)
+		clrbits(res, list, CAP_EFFECTIVE, cap_blks);
+	    if (flags & LIBCAP_PER)
+		clrbits(res, list, CAP_PERMITTED, cap_blks);
+	    if (flags & LIBCAP_INH)
+		clrbits(res, list, CAP_INHERITABLE, cap_blks);
+	    break;
+	}
+
+	/* new directive? */
+	if (*str == '+' || *str == '-') {
+	    if (!listed) {
+		_cap_debug("for + & - must list capabilities");
+		goto bad;
+	    }
+	    flags = 0;                       /* reset the flags */
+	    op = *str++;
+	    if (!isalpha(*str))
+		goto bad;
+	}
+    } while (*str && !isspace(*str));
+    _cap_debug("next clause");
+    return str;
+
+bad:
+    *errp = str;
+    return NULL;
+}
+
+/*
+ * _cap_flat_from_text parses str into res, returning 0 on success and
+ * -1 (with errno set) on failure.
+ */
+static int _cap_flat_from_text(const char *str, cap_flat_t *res)
+{
+    const char *err;
     unsigned cap_blks;
 
     if (str == NULL) {
 	_cap_debug("bad argument");
 	errno = EINVAL;
-	return NULL;
+	return -1;
     }
 
-    if (!(res = cap_init()))
-	return NULL;
-
-    switch (res->head.version) {
-    case _LINUX_CAPABILITY_VERSION_1:
-	cap_blks = _LINUX_CAPABILITY_U32S_1;
-	break;
-    case _LINUX_CAPABILITY_VERSION_2:
-	cap_blks = _LINUX_CAPABILITY_U32S_2;
-	break;
-    case _LINUX_CAPABILITY_VERSION_3:
-	cap_blks = _LINUX_CAPABILITY_U32S_3;
-	break;
-    default:
-	cap_free(res);
+    cap_blks = _cap_text_blks();
+    if (!cap_blks) {
 	errno = EINVAL;
-	return NULL;
+	return -1;
     }
 
     _cap_debug("%s", str);
 
+    memset(res, 0, sizeof(*res));
     for (;;) {
-	__u32 list[__CAP_BLKS];
-	char op;
-	int flags = 0, listed=0;
-
-	memset(list, 0, sizeof(__u32)*__CAP_BLKS);
-
 	/* skip leading spaces */
 	while (isspace((unsigned char)*str))
 	    str++;
@@ -181,115 +352,193 @@ cap_t cap_from_text(const char *str)
 	    _cap_debugcap("e = ", *res, CAP_EFFECTIVE);
 	    _cap_debugcap("i = ", *res, CAP_INHERITABLE);
 	    _cap_debugcap("p = ", *res, CAP_PERMITTED);
-
-	    return res;
-	}
-
-	/* identify caps specified by this clause */
-	if (isalnum((unsigned char)*str) || *str == '_') {
-	    for (;;) {
-		if (namcmp(str, "all")) {
-		    str += 3;
-		    forceall(list, ~0, cap_blks);
-		} else {
-		    n = lookupname(&str);
-		    if (n == -1)
-			goto bad;
-		    raise_cap_mask(list, n);
-		}
-		if (*str != ',')
-		    break;
-		if (!isalnum((unsigned char)*++str) && *str != '_')
-		    goto bad;
-	    }
-	    listed = 1;
-	} else if (*str == '+' || *str == '-') {
-	    goto bad;                    /* require a list of capabilities */
-	} else {
-	    forceall(list, ~0, cap_blks);
+	    return 0;
+	}
+	str = _cap_parse_clause(res, str, cap_blks, &err);
+	if (str == NULL) {
+	    errno = EINVAL;
+	    return -1;
 	}
+    }
+}
 
-	/* identify first operation on list of capabilities */
-	op = *str++;
-	if (op == '=' && (*str == '+' || *str == '-')) {
-	    if (!listed)
-		goto bad;
-	    op = (*str++ == '+' ? 'P':'M'); /* skip '=' and take next op */
-	} else if (op != '+' && op != '-' && op != '=')
-	    goto bad;
+cap_t cap_from_text(const char *str)
+{
+    cap_flat_t res;
 
-	/* cycle through list of actions */
-	do {
-	    _cap_debug("next char = '%c'", *str);
-	    if (*str && !isspace(*str)) {
-		switch (*str++) {    /* Effective, Inheritable, Permitted */
-		case 'e':
-		    flags |= LIBCAP_EFF;
-		    break;
-		case 'i':
-		    flags |= LIBCAP_INH;
-		    break;
-		case 'p':
-		    flags |= LIBCAP_PER;
-		    break;
-		default:
-		    goto bad;
-		}
-	    } else if (op != '=') {
-		_cap_debug("only '=' can be followed by space");
-		goto bad;
-	    }
+    if (_cap_flat_from_text(str, &res)) {
+	return NULL;
+    }
+    return cap_from_flat(&res);
+}
 
-	    _cap_debug("how to read?");
-	    switch (op) {               /* how do we interpret the caps? */
-	    case '=':
-	    case 'P':                                              /* =+ */
-	    case 'M':                                              /* =- */
-		clrbits(res, list, CAP_EFFECTIVE, cap_blks);
-		clrbits(res, list, CAP_PERMITTED, cap_blks);
-		clrbits(res, list, CAP_INHERITABLE, cap_blks);
-		if (op == 'M')
-		    goto minus;
-		/* fall through */
-	    case '+':
-		if (flags & LIBCAP_EFF)
-		    setbits(res, list, CAP_EFFECTIVE, cap_blks);
-		if (flags & LIBCAP_PER)
-		    setbits(res, list, CAP_PERMITTED, cap_blks);
-		if (flags & LIBCAP_INH)
-		    setbits(res, list, CAP_INHERITABLE, cap_blks);
-		break;
-	    case '-':
-	    minus:
-		if (flags & LIBCAP_EFF)
-		    clrbits(res, list, CAP_EFFECTIVE, cap_blks);
-		if (flags & LIBCAP_PER)
-		    clrbits(res, list, CAP_PERMITTED, cap_blks);
-		if (flags & LIBCAP_INH)
-		    clrbits(res, list, CAP_INHERITABLE, cap_blks);
-		break;
-	    }
+/*
+ * The incremental text parser buffers one clause at a time. A single
+ * clause can be no longer than the text cap_to_text() could produce.
+ */
+#define CAP_PARSER_CLAUSE_SIZE (CAP_TEXT_SIZE+CAP_TEXT_BUFFER_ZONE)
+
+struct cap_text_parser_s {
+    __u8 mutex;
+    int failed;
+    size_t offset;        /* stream offset of the next byte fed */
+    size_t error_at;      /* stream offset of the first error */
+    size_t clause_at;     /* stream offset of the buffered clause */
+    size_t used;          /* bytes of clause buffered */
+    cap_flat_t flat;
+    char clause[CAP_PARSER_CLAUSE_SIZE];
+};
 
-	    /* new directive? */
-	    if (*str == '+' || *str == '-') {
-		if (!listed) {
-		    _cap_debug("for + & - must list capabilities");
-		    goto bad;
-		}
-		flags = 0;                       /* reset the flags */
-		op = *str++;
-		if (!isalpha(*str))
-		    goto bad;
-	    }
-	} while (*str && !isspace(*str));
-	_cap_debug("next clause");
+/*
+ * _cap_parser_fail records the first error of the parse.
+ */
+static void _cap_parser_fail(cap_text_parser_t parser, size_t at)
+{
+    if (!parser->failed) {
+	parser->failed = 1;
+	parser->error_at = at;
     }
+}
 
-bad:
-    cap_free(res);
-    res = NULL;
-    errno = EINVAL;
-    return res;
+/*
+ * _cap_parser_flush parses any buffered clause.
+ */
+static void _cap_parser_flush(cap_text_parser_t parser)
+{
+    unsigned cap_blks;
+    const char *err;
+
+    if (parser->failed || !parser->used) {
+	parser->used = 0;
+	return;
+    }
+    parser->clause[parser->used] = '\0';
+    cap_blks = _cap_text_blks();
+    if (!cap_blks) {
+	_cap_parser_fail(parser, parser->clause_at);
+    } else if (!_cap_parse_clause(&parser->flat, parser->clause,
+				  cap_blks, &err)) {
+	_cap_parser_fail(parser, parser->clause_at + (err - parser->clause));
+    }
+    parser->used = 0;
+}
+
+/*
+ * cap_text_parser_init allocates a reusable incremental parser.
+ */
+cap_text_parser_t cap_text_parser_init(void)
+{
+    return _libcap_alloc(CAP_PARSER_MAGIC, sizeof(struct cap_text_parser_s));
+}
+
+/*
+ * cap_text_parser_reset prepares the parser to parse a new text.
+ */
+int cap_text_parser_reset(cap_text_parser_t parser)
+{
+    if (!good_cap_parser_t(parser)) {
+	errno = EINVAL;
+	return -1;
+    }
+    _cap_mu_lock(&parser->mutex);
+    parser->failed = 0;
+    parser->offset = 0;
+    parser->error_at = 0;
+    parser->used = 0;
+    memset(&parser->flat, 0, sizeof(parser->flat));
+    _cap_mu_unlock(&parser->mutex);
+    return 0;
+}
+
+/*
+ * cap_text_parser_feed parses the next len bytes of text. Clauses may
+ * be split across chunks. Once an error has been detected, the rest
+ * of the text is ignored.
+ */
+int cap_text_parser_feed(cap_text_parser_t parser, const char *chunk,
+			 size_t len)
+{
+    size_t i;
+
+    if (!good_cap_parser_t(parser) || (chunk == NULL && len)) {
+	errno = EINVAL;
+	return -1;
+    }
+
+    _cap_mu_lock(&parser->mutex);
+    for (i = 0; i < len && !parser->failed; i++) {
+	char c = chunk[i];
+	size_t at = parser->offset + i;
+	if (isspace((unsigned char) c)) {
+	    _cap_parser_flush(parser);
+	    continue;
+	}
+	if (c == '\0' || parser->used == CAP_PARSER_CLAUSE_SIZE-1) {
+	    _cap_parser_fail(parser, at);
+	    break;
+	}
+	if (!parser->used) {
+	    parser->clause_at = at;
+	}
+	parser->clause[parser->used++] = c;
+    }
+    parser->offset += len;
+    if (parser->failed) {
+	errno = EINVAL;
+	_cap_mu_unlock_return(&parser->mutex, -1);
+    }
+    _cap_mu_unlock(&parser->mutex);
+    return 0;
+}
+
+/*
+ * cap_text_parser_finish completes the parse and, if it succeeded,
+ * places the result in the caller's cap_d.
+ */
+int cap_text_parser_finish(cap_text_parser_t parser, cap_t cap_d)
+{
+    unsigned i;
+
+    if (!good_cap_parser_t(parser) || !good_cap_t(cap_d)) {
+	errno = EINVAL;
+	return -1;
+    }
+
+    _cap_mu_lock(&parser->mutex);
+    _cap_parser_flush(parser);
+    if (parser->failed) {
+	errno = EINVAL;
+	_cap_mu_unlock_return(&parser->mutex, -1);
+    }
+    _cap_mu_lock(&cap_d->mutex);
+    for (i = 0; i < _LIBCAP_CAPABILITY_U32S; i++) {
+	memcpy(cap_d->u[i].flat, parser->flat.u[i].flat,
+	       sizeof(cap_d->u[i].flat));
+    }
+    _cap_mu_unlock(&cap_d->mutex);
+    _cap_mu_unlock(&parser->mutex);
+    return 0;
+}
+
+/*
+ * cap_text_parser_error returns the byte offset, within the text fed
+ * since the last reset, of the first parsing error. If there has been
+ * no error, it returns -1.
+ */
+ssize_t cap_text_parser_error(cap_text_parser_t parser)
+{
+    ssize_t at = -1;
+
+    if (!good_cap_parser_t(parser)) {
+	errno = EINVAL;
+	return -1;
+    }
+    _cap_mu_lock(&parser->mutex);
+    if (parser->failed) {
+	at = (ssize_t) parser->error_at;
+    }
+    _cap_mu_unlock(&parser->mutex);
+    return at;
 }
 
 /*
@@ -326,60 +575,111 @@ char *cap_to_name(cap_value_t cap)
 }
 
 /*
- * Convert an internal representation to a textual one. The textual
- * representation is stored in static memory. It will be overwritten
- * on the next occasion that this function is called.
+ * _cap_name_at writes the name of capability cap at p, returning its
+ * length. This never allocates memory.
+ */
+static int _cap_name_at(char *p, cap_value_t cap)
+{
+    if (cap < __CAP_BITS) {
+	size_t len = strlen(_cap_names[cap]);
+	memcpy(p, _cap_names[cap], len+1);
+	return (int) len;
+    }
+    return sprintf(p, "%u", cap);
+}
+
+/*
+ * Convert an internal representation to a textual one.
+ *
+ * The encoder works on whole __u32 words: combo[n][t] holds the bits
+ * of block n whose e/i/p state is exactly the LIBCAP_* combination t,
+ * so histograms are popcounts and the names are found by iterating
+ * over set bits.
  */
+typedef __u32 _cap_combos_t[__CAP_BLKS][8];
 
-static int getstateflags(cap_t caps, int capno)
+static void _cap_combo_masks(const cap_flat_t *caps, cap_value_t cmb,
+			     _cap_combos_t named, _cap_combos_t unnamed)
 {
-    int f = 0;
+    unsigned n;
+    int t;
+
+    for (n = 0; n < __CAP_BLKS; n++) {
+	__u32 e = caps->u[n].flat[CAP_EFFECTIVE];
+	__u32 i = caps->u[n].flat[CAP_INHERITABLE];
+	__u32 p = caps->u[n].flat[CAP_PERMITTED];
+	__u32 in;
+
+	/* in holds the bits of this block that are named */
+	if (cmb >= (cap_value_t) (32*(n+1))) {
+	    in = ~0U;
+	} else if (cmb <= (cap_value_t) (32*n)) {
+	    in = 0;
+	} else {
+	    in = (1U << (cmb - 32*n)) - 1;
+	}
 
-    if (isset_cap(caps, capno, CAP_EFFECTIVE)) {
-	f |= LIBCAP_EFF;
-    }
-    if (isset_cap(caps, capno, CAP_PERMITTED)) {
-	f |= LIBCAP_PER;
-    }
-    if (isset_cap(caps, capno, CAP_INHERITABLE)) {
-	f |= LIBCAP_INH;
+	for (t = 0; t < 8; t++) {
+	    __u32 mask = ((t & LIBCAP_EFF) ? e : ~e)
+		& ((t & LIBCAP_INH) ? i : ~i)
+		& ((t & LIBCAP_PER) ? p : ~p);
+	    named[n][t] = mask & in;
+	    unnamed[n][t] = mask & ~in;
+	}
     }
-
-    return f;
 }
 
 /*
- * This code assumes that the longest named capability is longer than
- * the decimal text representation of __CAP_MAXBITS. This is very true
- * at the time of writing and likely to remain so. However, we have
- * a test in cap_text to validate it at build time.
+ * _cap_text_names appends a ',' terminated name for each of the
+ * combo[][t] bits at p. It returns the advanced p, or NULL if the
+ * text would exceed CAP_TEXT_SIZE.
  */
-#define CAP_TEXT_BUFFER_ZONE 100
+static char *_cap_text_names(char *buf, char *p, _cap_combos_t combo, int t)
+{
+    unsigned n;
 
-char *cap_to_text(cap_t caps, ssize_t *length_p)
+    for (n = 0; n < __CAP_BLKS; n++) {
+	__u32 bits;
+	for (bits = combo[n][t]; bits; bits &= bits - 1) {
+	    int len = _cap_name_at(p, 32*n + __builtin_ctz(bits));
+	    if (len + (p - buf) > CAP_TEXT_SIZE) {
+		errno = ERANGE;
+		return NULL;
+	    }
+	    p += len;
+	    *p++ = ',';
+	}
+    }
+    return p;
+}
+
+/*
+ * _cap_text_format formats caps into buf (which must hold at least
+ * CAP_TEXT_SIZE+CAP_TEXT_BUFFER_ZONE bytes). It returns a pointer to
+ * the start of the '\0' terminated text, which may not be buf, and
+ * places its length in *length_p. It does not allocate any memory.
+ */
+static char *_cap_text_format(const cap_flat_t *caps, char *buf,
+			      ssize_t *length_p)
 {
-    char buf[CAP_TEXT_SIZE+CAP_TEXT_BUFFER_ZONE];
+    _cap_combos_t named, unnamed;
     char *p, *base;
     int histo[8];
     int m, t;
     unsigned n;
 
-    /* Check arguments */
-    if (!good_cap_t(caps)) {
-	errno = EINVAL;
-	return NULL;
-    }
-
     _cap_debugcap("e = ", *caps, CAP_EFFECTIVE);
     _cap_debugcap("i = ", *caps, CAP_INHERITABLE);
     _cap_debugcap("p = ", *caps, CAP_PERMITTED);
 
-    memset(histo, 0, sizeof(histo));
-
     /* default prevailing state to the named bits */
-    cap_value_t cmb = cap_max_bits();
-    for (n = 0; n < cmb; n++)
-	histo[getstateflags(caps, n)]++;
+    _cap_combo_masks(caps, cap_max_bits(), named, unnamed);
+    memset(histo, 0, sizeof(histo));
+    for (n = 0; n < __CAP_BLKS; n++) {
+	for (t = 0; t < 8; t++) {
+	    histo[t] += __builtin_popcount(named[n][t]);
+	}
+    }
 
     /* find which combination of capability sets shares the most bits
        we bias to preferring non-set (m=0) with the >= 0 test. Failing
@@ -401,20 +701,9 @@ char *cap_to_text(cap_t caps, ssize_t *length_p)
 	    continue;
 	}
 	*p++ = ' ';
-	for (n = 0; n < cmb; n++) {
-	    if (getstateflags(caps, n) == t) {
-	        char *this_cap_name = cap_to_name(n);
-		if (this_cap_name == NULL) {
-		    return NULL;
-		}
-	        if ((strlen(this_cap_name) + (p - buf)) > CAP_TEXT_SIZE) {
-		    cap_free(this_cap_name);
-		    errno = ERANGE;
-		    return NULL;
-	        }
-	        p += sprintf(p, "%s,", this_cap_name);
-	        cap_free(this_cap_name);
-	    }
+	p = _cap_text_names(buf, p, named, t);
+	if (p == NULL) {
+	    return NULL;
 	}
 	p--;
 	n = t & ~m;
@@ -447,29 +736,18 @@ char *cap_to_text(cap_t caps, ssize_t *length_p)
     }
 
     /* capture remaining unnamed bits - which must all be +. */
-    memset(histo, 0, sizeof(histo));
-    for (n = cmb; n < __CAP_MAXBITS; n++)
-	histo[getstateflags(caps, n)]++;
-
     for (t = 8; t-- > 1; ) {
-	if (!histo[t]) {
-	    continue;
-	}
+	char *start;
 	*p++ = ' ';
-	for (n = cmb; n < __CAP_MAXBITS; n++) {
-	    if (getstateflags(caps, n) == t) {
-		char *this_cap_name = cap_to_name(n);
-		if (this_cap_name == NULL) {
-		    return NULL;
-		}
-	        if ((strlen(this_cap_name) + (p - buf)) > CAP_TEXT_SIZE) {
-		    cap_free(this_cap_name);
-		    errno = ERANGE;
-		    return NULL;
-	        }
-		p += sprintf(p, "%s,", this_cap_name);
-		cap_free(this_cap_name);
-	    }
+	start = p;
+	p = _cap_text_names(buf, p, unnamed, t);
+	if (p == NULL) {
+	    return NULL;
+	}
+	if (p == start) {
+	    /* no bits have this combination */
+	    p--;
+	    continue;
 	}
 	p--;
 	p += sprintf(p, "+%s%s%s",
@@ -481,15 +759,95 @@ char *cap_to_text(cap_t caps, ssize_t *length_p)
 	    return NULL;
 	}
     }
+    *p = '\0';
 
     _cap_debug("%s", base);
+    *length_p = p - base;
+    return base;
+}
+
+char *cap_to_text(cap_t caps, ssize_t *length_p)
+{
+    char buf[CAP_TEXT_SIZE+CAP_TEXT_BUFFER_ZONE];
+    cap_flat_t flat;
+    ssize_t length;
+    char *base;
+
+    /* Check arguments */
+    if (cap_to_flat(caps, &flat)) {
+	errno = EINVAL;
+	return NULL;
+    }
+
+    base = _cap_text_format(&flat, buf, &length);
+    if (base == NULL) {
+	return NULL;
+    }
     if (length_p) {
-	*length_p = p - base;
+	*length_p = length;
     }
 
     return (_libcap_strdup(base));
 }
 
+/*
+ * _cap_text_copy places text of length into buf, which holds len
+ * bytes, or fails with ERANGE.
+ */
+static ssize_t _cap_text_copy(char *buf, size_t len,
+			      const char *text, ssize_t length)
+{
+    if ((size_t) length >= len) {
+	errno = ERANGE;
+	return -1;
+    }
+    memmove(buf, text, length+1);
+    return length;
+}
+
+/*
+ * cap_flat_to_text formats flat into the caller's buffer, buf, of
+ * size len. It returns the length of the text (excluding the
+ * terminating '\0'), or -1 with errno set to ERANGE if it does not
+ * fit. No memory is allocated.
+ */
+ssize_t cap_flat_to_text(const cap_flat_t *flat, char *buf, size_t len)
+{
+    char tmp[CAP_TEXT_SIZE+CAP_TEXT_BUFFER_ZONE];
+    char *work = tmp;
+    ssize_t length;
+    char *base;
+
+    if (flat == NULL || buf == NULL) {
+	errno = EINVAL;
+	return -1;
+    }
+
+    /* skip the intermediate copy when the caller's buffer is roomy */
+    if (len >= sizeof(tmp)) {
+	work = buf;
+    }
+    base = _cap_text_format(flat, work, &length);
+    if (base == NULL) {
+	return -1;
+    }
+    return _cap_text_copy(buf, len, base, length);
+}
+
+/*
+ * cap_to_text_r is the re-entrant, allocation free, equivalent of
+ * cap_to_text(). It formats into the caller's buffer.
+ */
+ssize_t cap_to_text_r(cap_t caps, char *buf, size_t len)
+{
+    cap_flat_t flat;
+
+    if (cap_to_flat(caps, &flat)) {
+	return -1;
+    }
+    return cap_flat_to_text(&flat, buf, len);
+}
+
 /*
  * cap_mode_name returns a text token naming the specified mode.
  */
@@ -511,57 +869,85 @@ const char *cap_mode_name(cap_mode_t flavor) {
 }
 
 /*
- * cap_iab_to_text serializes an iab into a canonical text
- * representation.
+ * _cap_iab_text_format serializes an iab into a canonical text
+ * representation in buf, returning its length. It does not allocate
+ * any memory.
  */
-char *cap_iab_to_text(cap_iab_t iab)
+static ssize_t _cap_iab_text_format(cap_iab_t iab, char *buf)
 {
-    char buf[CAP_TEXT_SIZE+CAP_TEXT_BUFFER_ZONE];
     char *p = buf;
     cap_value_t c, cmb = cap_max_bits();
     int first = 1;
 
-    if (good_cap_iab_t(iab)) {
-	_cap_mu_lock(&iab->mutex);
-	for (c = 0; c < cmb; c++) {
-	    int keep = 0;
-	    int o = c >> 5;
-	    __u32 bit = 1U << (c & 31);
-	    __u32 ib = iab->i[o] & bit;
-	    __u32 ab = iab->a[o] & bit;
-	    __u32 nbb = iab->nb[o] & bit;
-	    if (!(nbb | ab | ib)) {
-		continue;
-	    }
-	    if (!first) {
-		*p++ = ',';
-	    }
-	    if (nbb) {
-		*p++ = '!';
-		keep = 1;
-	    }
-	    if (ab) {
-		*p++ = '^';
-		keep = 1;
-	    } else if (nbb && ib) {
-		*p++ = '%';
-	    }
-	    if (keep || ib) {
-		if (c < __CAP_BITS) {
-		    strcpy(p, _cap_names[c]);
-		} else {
-		    sprintf(p, "%u", c);
-		}
-		p += strlen(p);
-		first = 0;
-	    }
+    _cap_mu_lock(&iab->mutex);
+    for (c = 0; c < cmb; c++) {
+	int keep = 0;
+	int o = c >> 5;
+	__u32 bit = 1U << (c & 31);
+	__u32 ib = iab->i[o] & bit;
+	__u32 ab = iab->a[o] & bit;
+	__u32 nbb = iab->nb[o] & bit;
+	if (!(nbb | ab | ib)) {
+	    continue;
+	}
+	if (!first) {
+	    *p++ = ',';
+	}
+	if (nbb) {
+	    *p++ = '!';
+	    keep = 1;
+	}
+	if (ab) {
+	    *p++ = '^';
+	    keep = 1;
+	} else if (nbb && ib) {
+	    *p++ = '%';
+	}
+	if (keep || ib) {
+	    p += _cap_name_at(p, c);
+	    first = 0;
 	}
-	_cap_mu_unlock(&iab->mutex);
     }
+    _cap_mu_unlock(&iab->mutex);
     *p = '\0';
+    return p - buf;
+}
+
+/*
+ * cap_iab_to_text serializes an iab into a canonical text
+ * representation.
+ */
+char *cap_iab_to_text(cap_iab_t iab)
+{
+    char buf[CAP_TEXT_SIZE+CAP_TEXT_BUFFER_ZONE];
+
+    buf[0] = '\0';
+    if (good_cap_iab_t(iab)) {
+	_cap_iab_text_format(iab, buf);
+    }
     return _libcap_strdup(buf);
 }
 
+/*
+ * cap_iab_to_text_r is the re-entrant, allocation free, equivalent
+ * of cap_iab_to_text(). It formats into the caller's buffer.
+ */
+ssize_t cap_iab_to_text_r(cap_iab_t iab, char *buf, size_t len)
+{
+    char tmp[CAP_TEXT_SIZE+CAP_TEXT_BUFFER_ZONE];
+    ssize_t length;
+
+    if (!good_cap_iab_t(iab) || buf == NULL) {
+	errno = EINVAL;
+	return -1;
+    }
+    if (len >= sizeof(tmp)) {
+	return _cap_iab_text_format(iab, buf);
+    }
+    length = _cap_iab_text_format(iab, tmp);
+    return _cap_text_copy(buf, len, tmp, length);
+}
+
 cap_iab_t cap_iab_from_text(const char *text)
 {
     cap_iab_t iab = cap_iab_init();
@@ -624,36 +1010,352 @@ cleanup:
     return NULL;
 }
 
-static __u32 _parse_hex32(const char *c)
+/*
+ * A cap_text_cache_t memoizes the parsing of cap_from_text() and
+ * cap_iab_from_text() input. It is a set associative table of
+ * pre-parsed values, keyed by a hash of the text. Only texts shorter
+ * than CAP_TEXT_CACHE_KEY_SIZE are cached.
+ */
+#define CAP_TEXT_CACHE_KEY_SIZE 64
+#define CAP_TEXT_CACHE_WAYS     4
+#define CAP_TEXT_CACHE_DEFAULT  64
+#define CAP_TEXT_CACHE_MAX      4096
+
+#define _CAP_CACHE_EMPTY 0
+#define _CAP_CACHE_CAP   1
+#define _CAP_CACHE_IAB   2
+
+struct _cap_cache_entry_s {
+    int kind;
+    unsigned hash;
+    char key[CAP_TEXT_CACHE_KEY_SIZE];
+    union {
+	cap_flat_t flat;
+	struct {
+	    __u32 i[_LIBCAP_CAPABILITY_U32S];
+	    __u32 a[_LIBCAP_CAPABILITY_U32S];
+	    __u32 nb[_LIBCAP_CAPABILITY_U32S];
+	} iab;
+    } u;
+};
+
+struct cap_text_cache_s {
+    __u8 mutex;
+    cap_value_t max_bits;   /* cap_max_bits() when the entries were parsed */
+    unsigned mask;          /* number of sets - 1 */
+    unsigned victim;        /* round robin replacement within a set */
+    unsigned long hits;
+    unsigned long misses;
+    struct _cap_cache_entry_s *entry;
+};
+
+/*
+ * _cap_text_hash is the FNV-1a hash of a text, mixed with its kind.
+ */
+static unsigned _cap_text_hash(const char *text, size_t len, int kind)
 {
-    int i;
-    __u32 v = 0;
-    for (i=0; i < 8; i++, c++) {
-	v <<= 4;
-	if (*c == 0 || *c < '0') {
-	    return 0;
-	} else if (*c <= '9') {
-	    v += *c - '0';
-	} else if (*c > 'f') {
-	    return 0;
-	} else if (*c >= 'a') {
-	    v += *c + 10 - 'a';
-	} else if (*c < 'A') {
-	    return 0;
-	} else if (*c <= 'F') {
-	    v += *c + 10 - 'A';
-	} else {
-	    return 0;
+    unsigned h = 2166136261U ^ (unsigned) kind;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+	h ^= (unsigned char) text[i];
+	h *= 16777619U;
+    }
+    h ^= h >> 16;
+    return h;
+}
+
+/*
+ * cap_text_cache_init allocates a cache with room for (at least)
+ * entries pre-parsed texts. A value of 0 selects a default size.
+ */
+cap_text_cache_t cap_text_cache_init(unsigned entries)
+{
+    cap_text_cache_t cache;
+    unsigned n;
+
+    if (entries > CAP_TEXT_CACHE_MAX) {
+	_cap_debug("cache too large");
+	errno = EINVAL;
+	return NULL;
+    }
+    if (!entries) {
+	entries = CAP_TEXT_CACHE_DEFAULT;
+    }
+    for (n = 1; n*CAP_TEXT_CACHE_WAYS < entries; n <<= 1);
+
+    cache = _libcap_alloc(CAP_TEXT_CACHE_MAGIC, sizeof(*cache)
+	+ n*CAP_TEXT_CACHE_WAYS*sizeof(struct _cap_cache_entry_s));
+    if (cache == NULL) {
+	return NULL;
+    }
+    cache->mask = n - 1;
+    cache->entry = (void *) (cache + 1);
+    return cache;
+}
+
+/*
+ * _cap_cache_set returns the first entry of the set that may hold a
+ * text with this hash. The cache must be locked.
+ */
+static struct _cap_cache_entry_s *_cap_cache_set(cap_text_cache_t cache,
+						 unsigned hash)
+{
+    return &cache->entry[(hash & cache->mask) * CAP_TEXT_CACHE_WAYS];
+}
+
+/*
+ * _cap_cache_match returns the entry holding text, or NULL. The cache
+ * must be locked.
+ */
+static struct _cap_cache_entry_s *_cap_cache_match(cap_text_cache_t cache,
+						   const char *text,
+						   int kind, unsigned hash)
+{
+    struct _cap_cache_entry_s *e = _cap_cache_set(cache, hash);
+    int w;
+
+    for (w = 0; w < CAP_TEXT_CACHE_WAYS; w++, e++) {
+	if (e->kind == kind && e->hash == hash && !strcmp(e->key, text)) {
+	    return e;
+	}
+    }
+    return NULL;
+}
+
+/*
+ * _cap_cache_find looks up text in the cache and, on a hit, copies the
+ * pre-parsed value (of size bytes) into value and returns 0. It
+ * returns -1 on a miss. *hash_p is set to the hash of a cacheable
+ * text, or left unchanged.
+ */
+static int _cap_cache_find(cap_text_cache_t cache, const char *text,
+			   int kind, void *value, size_t size,
+			   unsigned *hash_p)
+{
+    size_t len = strlen(text);
+    struct _cap_cache_entry_s *e = NULL;
+    unsigned hash;
+
+    hash = _cap_text_hash(text, len, kind);
+
+    _cap_mu_lock(&cache->mutex);
+    if (len < CAP_TEXT_CACHE_KEY_SIZE) {
+	*hash_p = hash;
+	if (cache->max_bits != cap_max_bits()) {
+	    memset(cache->entry, 0, (cache->mask+1) * CAP_TEXT_CACHE_WAYS
+		   * sizeof(struct _cap_cache_entry_s));
+	    cache->max_bits = cap_max_bits();
+	}
+	e = _cap_cache_match(cache, text, kind, hash);
+    }
+    if (e == NULL) {
+	cache->misses++;
+	_cap_mu_unlock_return(&cache->mutex, -1);
+    }
+    memcpy(value, &e->u, size);
+    cache->hits++;
+    _cap_mu_unlock(&cache->mutex);
+    return 0;
+}
+
+/*
+ * _cap_cache_store records a freshly parsed value in the cache,
+ * preferring an empty way of its set.
+ */
+static void _cap_cache_store(cap_text_cache_t cache, const char *text,
+			     int kind, const void *value, size_t size,
+			     unsigned hash)
+{
+    struct _cap_cache_entry_s *e;
+    int w;
+
+    if (strlen(text) >= CAP_TEXT_CACHE_KEY_SIZE) {
+	return;
+    }
+    _cap_mu_lock(&cache->mutex);
+    if (cache->max_bits == cap_max_bits()
+	&& _cap_cache_match(cache, text, kind, hash) == NULL) {
+	e = _cap_cache_set(cache, hash);
+	for (w = 0; w < CAP_TEXT_CACHE_WAYS
+		 && e[w].kind != _CAP_CACHE_EMPTY; w++);
+	if (w == CAP_TEXT_CACHE_WAYS) {
+	    w = cache->victim++ % CAP_TEXT_CACHE_WAYS;
+	}
+	e += w;
+	e->kind = kind;
+	e->hash = hash;
+	strcpy(e->key, text);
+	memcpy(&e->u, value, size);
+    }
+    _cap_mu_unlock(&cache->mutex);
+}
+
+/*
+ * cap_text_cache_flat parses text, as cap_from_text() does, into the
+ * caller's flat. Repeated texts are served from the cache.
+ */
+int cap_text_cache_flat(cap_text_cache_t cache, const char *text,
+			cap_flat_t *flat)
+{
+    unsigned hash = 0;
+
+    if (!good_cap_text_cache_t(cache) || text == NULL || flat == NULL) {
+	_cap_debug("bad argument");
+	errno = EINVAL;
+	return -1;
+    }
+    if (_cap_cache_find(cache, text, _CAP_CACHE_CAP, flat, sizeof(*flat),
+			&hash) == 0) {
+	return 0;
+    }
+    if (_cap_flat_from_text(text, flat)) {
+	return -1;
+    }
+    _cap_cache_store(cache, text, _CAP_CACHE_CAP, flat, sizeof(*flat), hash);
+    return 0;
+}
+
+/*
+ * cap_text_cache_from_text is a memoized equivalent of cap_from_text().
+ */
+cap_t cap_text_cache_from_text(cap_text_cache_t cache, const char *text)
+{
+    cap_flat_t flat;
+
+    if (cap_text_cache_flat(cache, text, &flat)) {
+	return NULL;
+    }
+    return cap_from_flat(&flat);
+}
+
+/*
+ * cap_text_cache_iab_from_text is a memoized equivalent of
+ * cap_iab_from_text().
+ */
+cap_iab_t cap_text_cache_iab_from_text(cap_text_cache_t cache,
+				       const char *text)
+{
+    struct _cap_cache_entry_s e;
+    unsigned hash = 0;
+    cap_iab_t iab;
+
+    if (!good_cap_text_cache_t(cache) || text == NULL) {
+	_cap_debug("bad argument");
+	errno = EINVAL;
+	return NULL;
+    }
+    if (_cap_cache_find(cache, text, _CAP_CACHE_IAB, &e.u.iab,
+			sizeof(e.u.iab), &hash) == 0) {
+	iab = cap_iab_init();
+	if (iab != NULL) {
+	    memcpy(iab->i, e.u.iab.i, sizeof(iab->i));
+	    memcpy(iab->a, e.u.iab.a, sizeof(iab->a));
+	    memcpy(iab->nb, e.u.iab.nb, sizeof(iab->nb));
 	}
+	return iab;
+    }
+    iab = cap_iab_from_text(text);
+    if (iab != NULL) {
+	memcpy(e.u.iab.i, iab->i, sizeof(iab->i));
+	memcpy(e.u.iab.a, iab->a, sizeof(iab->a));
+	memcpy(e.u.iab.nb, iab->nb, sizeof(iab->nb));
+	_cap_cache_store(cache, text, _CAP_CACHE_IAB, &e.u.iab,
+			 sizeof(e.u.iab), hash);
     }
-    return v;
+    return iab;
+}
+
+/*
+ * cap_text_cache_stats reports the number of cache hits and misses
+ * since the cache was allocated, or last reset with
+ * cap_text_cache_clear().
+ */
+int cap_text_cache_stats(cap_text_cache_t cache, unsigned long *hits_p,
+			 unsigned long *misses_p)
+{
+    if (!good_cap_text_cache_t(cache)) {
+	_cap_debug("bad argument");
+	errno = EINVAL;
+	return -1;
+    }
+    _cap_mu_lock(&cache->mutex);
+    if (hits_p != NULL) {
+	*hits_p = cache->hits;
+    }
+    if (misses_p != NULL) {
+	*misses_p = cache->misses;
+    }
+    _cap_mu_unlock(&cache->mutex);
+    return 0;
+}
+
+/*
+ * cap_text_cache_clear discards all of the cached entries and zeros
+ * the hit and miss counters.
+ */
+int cap_text_cache_clear(cap_text_cache_t cache)
+{
+    if (!good_cap_text_cache_t(cache)) {
+	_cap_debug("bad argument");
+	errno = EINVAL;
+	return -1;
+    }
+    _cap_mu_lock(&cache->mutex);
+    memset(cache->entry, 0, (cache->mask+1) * CAP_TEXT_CACHE_WAYS
+	   * sizeof(struct _cap_cache_entry_s));
+    cache->hits = 0;
+    cache->misses = 0;
+    _cap_mu_unlock(&cache->mutex);
+    return 0;
+}
+
+#define _CAP_SWAR_ONES  0x0101010101010101ULL
+#define _CAP_SWAR_HIGH  0x8080808080808080ULL
+
+/*
+ * _cap_swar_ge sets the high bit of each byte of x (all of which
+ * must be below 0x80) that is greater than or equal to k.
+ */
+#define _cap_swar_ge(x, k)  (((x) + (0x80 - (k)) * _CAP_SWAR_ONES) \
+			     & _CAP_SWAR_HIGH)
+
+/*
+ * _parse_hex32 decodes 8 hex digits at once. All 8 bytes are loaded
+ * as one big-endian word, validated in parallel, converted to
+ * nibbles and then packed together. Any non-hex digit yields 0.
+ */
+static __u32 _parse_hex32(const char *c)
+{
+    uint64_t x, low, nib;
+
+    memcpy(&x, c, sizeof(x));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    x = __builtin_bswap64(x);
+#endif
+    if (x & _CAP_SWAR_HIGH) {
+	return 0;
+    }
+    low = x | (0x20 * _CAP_SWAR_ONES);
+    if (((_cap_swar_ge(x, '0') & ~_cap_swar_ge(x, '9'+1))
+	 | (_cap_swar_ge(low, 'a') & ~_cap_swar_ge(low, 'f'+1)))
+	!= _CAP_SWAR_HIGH) {
+	return 0;
+    }
+
+    /* '0'-'9' have bit 6 clear, letters have it set and need +9 */
+    nib = (x & (0x0f * _CAP_SWAR_ONES)) + ((x >> 6) & _CAP_SWAR_ONES) * 9;
+    nib = (nib | (nib >> 4)) & 0x00ff00ff00ff00ffULL;
+    nib = (nib | (nib >> 8)) & 0x0000ffff0000ffffULL;
+    nib = (nib | (nib >> 16)) & 0x00000000ffffffffULL;
+    return (__u32) nib;
 }
 
 /*
  * _parse_vec_string converts the hex dumps in /proc/<pid>/current into
  * an array of u32s - masked as per the forceall() mask.
  */
-static __u32 _parse_vec_string(__u32 *vals, const char *c, int invert)
+static __u32 _parse_vec_string(__u32 *vals, const char *c)
 {
     int i;
     int words = strlen(c)/8;
@@ -662,11 +1364,7 @@ static __u32 _parse_vec_string(__u32 *vals, const char *c, int invert)
     }
     forceall(vals, ~0, words);
     for (i = 0; i < words; i++) {
-	__u32 val = _parse_hex32(c+8*(words-1-i));
-	if (invert) {
-	    val = ~val;
-	}
-	vals[i] &= val;
+	vals[i] &= _parse_hex32(c+8*(words-1-i));
     }
     return ~0;
 }
@@ -711,60 +1409,292 @@ char *cap_proc_root(const char *root)
     return old;
 }
 
-#define PROC_LINE_MAX (8 + 8*_LIBCAP_CAPABILITY_U32S + 100)
+#define PROC_STATUS_CHUNK 1024
 /*
- * cap_iab_get_pid fills an IAB tuple from the content of
- * /proc/<pid>/status. Linux doesn't support syscall access to the
- * needed information, so we parse it out of that file.
+ * _cap_status_ids parses the first three (real, effective and saved)
+ * of the ids on a "Uid:" or "Gid:" line.
  */
-cap_iab_t cap_iab_get_pid(pid_t pid)
+static int _cap_status_ids(const char *c, unsigned long *ids)
 {
-    cap_iab_t iab;
-    char *path;
-    FILE *file;
-    char line[PROC_LINE_MAX];
+    int i;
+
+    for (i = 0; i < 3; i++) {
+	char *end;
+	ids[i] = strtoul(c, &end, 10);
+	if (end == c) {
+	    return 0;
+	}
+	c = end;
+    }
+    return ~0;
+}
+
+/*
+ * _cap_status_line parses a single nul terminated line of a
+ * /proc/<pid>/status file into st. Only the first character of most
+ * lines needs to be examined.
+ */
+static void _cap_status_line(struct _cap_proc_status_s *st, const char *line)
+{
+    unsigned long ids[3];
+    __u32 *vec;
+    unsigned bit;
+
+    switch (line[0]) {
+    case 'C':
+	if (line[1] != 'a' || line[2] != 'p' || strnlen(line+3, 5) != 5
+	    || line[6] != ':' || line[7] != '\t') {
+	    return;
+	}
+	switch (line[3]) {
+	case 'I':
+	    vec = st->inh;
+	    bit = _CAP_STATUS_INH;
+	    break;
+	case 'P':
+	    vec = st->prm;
+	    bit = _CAP_STATUS_PRM;
+	    break;
+	case 'E':
+	    vec = st->eff;
+	    bit = _CAP_STATUS_EFF;
+	    break;
+	case 'B':
+	    vec = st->bnd;
+	    bit = _CAP_STATUS_BND;
+	    break;
+	case 'A':
+	    vec = st->amb;
+	    bit = _CAP_STATUS_AMB;
+	    break;
+	default:
+	    return;
+	}
+	if (_parse_vec_string(vec, line+8)) {
+	    st->found |= bit;
+	}
+	break;
+    case 'N':
+	if (strncmp("NoNewPrivs:\t", line, 12) == 0) {
+	    st->no_new_privs = atoi(line+12);
+	    st->found |= _CAP_STATUS_NNP;
+	}
+	break;
+    case 'U':
+	if (strncmp("Uid:\t", line, 5) == 0 && _cap_status_ids(line+5, ids)) {
+	    st->uid[0] = ids[0];
+	    st->uid[1] = ids[1];
+	    st->uid[2] = ids[2];
+	    st->found |= _CAP_STATUS_UID;
+	}
+	break;
+    case 'G':
+	if (strncmp("Gid:\t", line, 5) == 0 && _cap_status_ids(line+5, ids)) {
+	    st->gid[0] = ids[0];
+	    st->gid[1] = ids[1];
+	    st->gid[2] = ids[2];
+	    st->found |= _CAP_STATUS_GID;
+	}
+	break;
+    default:
+	break;
+    }
+}
+
+/*
+ * _cap_read_status parses an open /proc/<pid>/status file into st,
+ * and closes it. The file is read into a small stack buffer and
+ * memchr() finds each line. Lines too long for the buffer (for
+ * example, "Groups:") are skipped. It returns 0 on success and -1 if
+ * nothing could be parsed.
+ */
+static int _cap_read_status(int fd, struct _cap_proc_status_s *st)
+{
+    char buf[PROC_STATUS_CHUNK];
+    size_t used = 0;
+    int skipping = 0;
+
+    memset(st, 0, sizeof(*st));
+    if (fd < 0) {
+	return -1;
+    }
+    for (;;) {
+	char *start, *nl;
+	ssize_t n = read(fd, buf+used, sizeof(buf)-used);
+	if (n < 0 && errno == EINTR) {
+	    continue;
+	}
+	if (n <= 0) {
+	    break;
+	}
+	used += n;
+	start = buf;
+	while ((nl = memchr(start, '\n', buf+used-start)) != NULL) {
+	    *nl = '\0';
+	    if (!skipping) {
+		_cap_status_line(st, start);
+	    }
+	    skipping = 0;
+	    start = nl+1;
+	}
+	used = buf+used-start;
+	if (used == sizeof(buf)) {
+	    skipping = 1;
+	    used = 0;
+	} else {
+	    memmove(buf, start, used);
+	}
+    }
+    close(fd);
+    if (!st->found) {
+	errno = EINVAL;
+	return -1;
+    }
+    return 0;
+}
+
+/*
+ * _libcap_proc_status parses the /proc/<pid>/status file of a process
+ * into st. pid == 0 means the calling thread, whose credentials can
+ * differ from those of the thread group leader described by
+ * /proc/self/status. Since "self" only means this process in the
+ * procfs of our own pid namespace, that case fails with ENOENT when
+ * cap_proc_root() names some other procfs.
+ */
+__attribute__((visibility ("hidden")))
+int _libcap_proc_status(pid_t pid, struct _cap_proc_status_s *st)
+{
+    char path[PATH_MAX];
     const char *proc_root = _cap_proc_dir;
+    int fd;
 
     if (proc_root == NULL) {
 	proc_root = "/proc";
     }
-    if (asprintf(&path, "%s/%d/status", proc_root, pid) <= 0) {
-	return NULL;
+    if (pid) {
+	snprintf(path, sizeof(path), "%s/%d/status", proc_root, pid);
+	return _cap_read_status(open(path, O_RDONLY | O_CLOEXEC), st);
     }
-    file = fopen(path, "r");
-    free(path);
-    if (file == NULL) {
-	return NULL;
+
+    if (strcmp(proc_root, "/proc")) {
+	errno = ENOENT;
+	return -1;
+    }
+    fd = open("/proc/thread-self/status", O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+	/* thread-self arrived with Linux 3.17 */
+	snprintf(path, sizeof(path), "/proc/self/task/%ld/status",
+		 (long int) syscall(SYS_gettid));
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+    }
+    return _cap_read_status(fd, st);
+}
+
+/*
+ * _libcap_proc_status_at parses the status file, name, relative to
+ * dirfd into st.
+ */
+__attribute__((visibility ("hidden")))
+int _libcap_proc_status_at(int dirfd, const char *name,
+			   struct _cap_proc_status_s *st)
+{
+    return _cap_read_status(openat(dirfd, name, O_RDONLY | O_CLOEXEC), st);
+}
+
+/*
+ * _libcap_proc_open opens libcap's notion of the "/proc" directory.
+ */
+__attribute__((visibility ("hidden"))) int _libcap_proc_open(void)
+{
+    const char *proc_root = _cap_proc_dir;
+
+    if (proc_root == NULL) {
+	proc_root = "/proc";
     }
+    return open(proc_root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+/*
+ * _cap_iab_from_status builds an IAB tuple from a parsed status file.
+ */
+static cap_iab_t _cap_iab_from_status(const struct _cap_proc_status_s *st)
+{
+    const unsigned want = _CAP_STATUS_INH | _CAP_STATUS_BND | _CAP_STATUS_AMB;
+    cap_iab_t iab;
+    unsigned n;
 
+    if ((st->found & want) != want) {
+	errno = EINVAL;
+	return NULL;
+    }
     iab = cap_iab_init();
-    uint ok = 0;
-    if (iab != NULL) {
-	while (fgets(line, PROC_LINE_MAX-1, file) != NULL) {
-	    if (strncmp("Cap", line, 3) != 0) {
-		continue;
-	    }
-	    if (strncmp("Inh:\t", line+3, 5) == 0) {
-		ok = (_parse_vec_string(iab->i, line+8, 0) &
-		    LIBCAP_IAB_I_FLAG) | ok;
-		continue;
-	    }
-	    if (strncmp("Bnd:\t", line+3, 5) == 0) {
-		ok = (_parse_vec_string(iab->nb, line+8, 1) &
-		      LIBCAP_IAB_NB_FLAG) | ok;
-		continue;
-	    }
-	    if (strncmp("Amb:\t", line+3, 5) == 0) {
-		ok = (_parse_vec_string(iab->a, line+8, 0) &
-		      LIBCAP_IAB_A_FLAG) | ok;
-		continue;
-	    }
-	}
+    if (iab == NULL) {
+	return NULL;
     }
-    if (ok != (LIBCAP_IAB_IA_FLAG | LIBCAP_IAB_NB_FLAG)) {
-	cap_free(iab);
-	iab = NULL;
+    forceall(iab->nb, ~0, _LIBCAP_CAPABILITY_U32S);
+    for (n = 0; n < _LIBCAP_CAPABILITY_U32S; n++) {
+	iab->i[n] = st->inh[n];
+	iab->a[n] = st->amb[n];
+	iab->nb[n] &= ~st->bnd[n];
     }
-    fclose(file);
     return iab;
 }
+
+/*
+ * cap_iab_get_pid fills an IAB tuple from the content of
+ * /proc/<pid>/status. Linux doesn't support syscall access to the
+ * needed information, so we parse it out of that file.
+ */
+cap_iab_t cap_iab_get_pid(pid_t pid)
+{
+    struct _cap_proc_status_s st;
+
+    if (_libcap_proc_status(pid, &st)) {
+	return NULL;
+    }
+    return _cap_iab_from_status(&st);
+}
+
+/*
+ * cap_iab_get_procfd is cap_iab_get_pid() for a process whose
+ * /proc/<pid> directory is already open as dirfd.
+ */
+cap_iab_t cap_iab_get_procfd(int dirfd)
+{
+    struct _cap_proc_status_s st;
+
+    if (_libcap_proc_status_at(dirfd, "status", &st)) {
+	return NULL;
+    }
+    return _cap_iab_from_status(&st);
+}
+
+/*
+ * cap_get_procfd returns the capability flags of the process whose
+ * /proc/<pid> directory is already open as dirfd.
+ */
+cap_t cap_get_procfd(int dirfd)
+{
+    const unsigned want = _CAP_STATUS_INH | _CAP_STATUS_PRM | _CAP_STATUS_EFF;
+    struct _cap_proc_status_s st;
+    cap_t cap_d;
+    unsigned n;
+
+    if (_libcap_proc_status_at(dirfd, "status", &st)) {
+	return NULL;
+    }
+    if ((st.found & want) != want) {
+	errno = EINVAL;
+	return NULL;
+    }
+    cap_d = cap_init();
+    if (cap_d == NULL) {
+	return NULL;
+    }
+    for (n = 0; n < _LIBCAP_CAPABILITY_U32S; n++) {
+	cap_d->u[n].flat[CAP_EFFECTIVE] = st.eff[n];
+	cap_d->u[n].flat[CAP_PERMITTED] = st.prm[n];
+	cap_d->u[n].flat[CAP_INHERITABLE] = st.inh[n];
+    }
+    return cap_d;
+}
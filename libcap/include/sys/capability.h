@@ -129,12 +129,78 @@ typedef unsigned cap_mode_t;
 #define CAP_MODE_PURE1E       ((cap_mode_t) 3)
 #define CAP_MODE_HYBRID       ((cap_mode_t) 4)
 
+/*
+ * An arena is an optional pool from which many cap_t and cap_iab_t
+ * objects can be allocated, and then released all at once with a
+ * single cap_free(arena).
+ */
+typedef struct cap_arena_s *cap_arena_t;
+
+/*
+ * cap_flat_t is a caller-owned capability set. Unlike a cap_t it can
+ * live on the stack, and none of the cap_flat_*() functions allocate
+ * memory. Each u[].flat[] is indexed by cap_flag_t.
+ */
+typedef struct cap_flat_s {
+    struct {
+	__u32 flat[3];
+    } u[_LINUX_CAPABILITY_U32S_3];
+    uid_t rootid;
+} cap_flat_t;
+
+/*
+ * cap_proc_state_t is a caller-owned snapshot of the privilege state
+ * of a process, as captured by cap_get_proc_state(). amb[] and
+ * bound[] hold the raised bits of the ambient and bounding vectors.
+ */
+typedef struct cap_proc_state_s {
+    cap_flat_t caps;
+    __u32 amb[_LINUX_CAPABILITY_U32S_3];
+    __u32 bound[_LINUX_CAPABILITY_U32S_3];
+    int ambient_supported;
+    unsigned secbits;
+    int no_new_privs;
+    uid_t uid, euid, suid;
+    gid_t gid, egid, sgid;
+    cap_value_t max_bits;
+} cap_proc_state_t;
+
+/*
+ * cap_pid_info_t holds the capability state of one process, as
+ * returned by cap_get_pids(). error is 0, or the errno value that
+ * prevented the state of pid from being read.
+ */
+typedef struct cap_pid_info_s {
+    pid_t pid;
+    int error;
+    cap_flat_t caps;
+    __u32 amb[_LINUX_CAPABILITY_U32S_3];
+    __u32 bound[_LINUX_CAPABILITY_U32S_3];
+    uid_t uid, euid;
+    gid_t gid, egid;
+} cap_pid_info_t;
+
+/*
+ * cap_file_info_t reports the file capabilities of names[index], as
+ * found by cap_get_files(). error is 0, or the errno value that
+ * prevented the capabilities of that name from being read.
+ */
+typedef struct cap_file_info_s {
+    size_t index;
+    int error;
+    cap_flat_t caps;
+} cap_file_info_t;
+
 /* libcap/cap_alloc.c */
 extern cap_t      cap_dup(cap_t);
 extern int        cap_free(void *);
 extern cap_t      cap_init(void);
 extern cap_iab_t  cap_iab_dup(cap_iab_t);
 extern cap_iab_t  cap_iab_init(void);
+extern cap_arena_t cap_arena_init(void);
+extern cap_t      cap_arena_cap_init(cap_arena_t);
+extern cap_t      cap_arena_cap_dup(cap_arena_t, cap_t);
+extern cap_iab_t  cap_arena_iab_init(cap_arena_t);
 
 /* libcap/cap_flag.c */
 extern int     cap_get_flag(cap_t, cap_value_t, cap_flag_t, cap_flag_value_t *);
@@ -157,9 +223,22 @@ extern int     cap_iab_set_vector(cap_iab_t, cap_iab_vector_t, cap_value_t,
 				cap_flag_value_t);
 extern int     cap_iab_fill(cap_iab_t, cap_iab_vector_t, cap_t, cap_flag_t);
 
+extern int     cap_flat_init(cap_flat_t *);
+extern int     cap_flat_get_flag(const cap_flat_t *, cap_value_t, cap_flag_t,
+				 cap_flag_value_t *);
+extern int     cap_flat_set_flag(cap_flat_t *, cap_flag_t, int,
+				 const cap_value_t *, cap_flag_value_t);
+extern int     cap_flat_compare(const cap_flat_t *, const cap_flat_t *);
+extern int     cap_to_flat(cap_t, cap_flat_t *);
+extern cap_t   cap_from_flat(const cap_flat_t *);
+
 /* libcap/cap_file.c */
 extern cap_t   cap_get_fd(int);
 extern cap_t   cap_get_file(const char *);
+extern int     cap_get_fileat(int dirfd, const char *name, int flags,
+			      cap_flat_t *flat);
+extern ssize_t cap_get_files(int dirfd, const char * const *names, size_t n,
+			     int flags, cap_file_info_t *out);
 extern uid_t   cap_get_nsowner(cap_t);
 extern int     cap_set_fd(int, cap_t);
 extern int     cap_set_file(const char *, cap_t);
@@ -168,7 +247,13 @@ extern int     cap_set_nsowner(cap_t, uid_t);
 /* libcap/cap_proc.c */
 extern cap_t   cap_get_proc(void);
 extern cap_t   cap_get_pid(pid_t);
+extern cap_t   cap_get_procfd(int dirfd);
+extern int     cap_get_pids(const pid_t *pids, size_t n, cap_pid_info_t *out);
 extern int     cap_set_proc(cap_t);
+extern int     cap_flat_get_proc(cap_flat_t *);
+extern int     cap_get_proc_state(cap_proc_state_t *);
+extern cap_iab_t  cap_proc_state_iab(const cap_proc_state_t *);
+extern cap_mode_t cap_proc_state_mode(const cap_proc_state_t *);
 
 extern int     cap_get_bound(cap_value_t);
 extern int     cap_drop_bound(cap_value_t);
@@ -188,10 +273,39 @@ extern cap_t   cap_copy_int_check(const void *cap_ext, ssize_t length);
 /* libcap/cap_text.c */
 extern cap_t   cap_from_text(const char *);
 extern char *  cap_to_text(cap_t, ssize_t *);
+extern ssize_t cap_to_text_r(cap_t, char *, size_t);
+extern ssize_t cap_flat_to_text(const cap_flat_t *, char *, size_t);
+
+/*
+ * A cap_text_parser_t incrementally parses the cap_from_text() format
+ * from a sequence of chunks.
+ */
+typedef struct cap_text_parser_s *cap_text_parser_t;
+extern cap_text_parser_t cap_text_parser_init(void);
+extern int     cap_text_parser_feed(cap_text_parser_t, const char *, size_t);
+extern int     cap_text_parser_finish(cap_text_parser_t, cap_t);
+extern ssize_t cap_text_parser_error(cap_text_parser_t);
+extern int     cap_text_parser_reset(cap_text_parser_t);
+
+/*
+ * A cap_text_cache_t memoizes the parsing of frequently repeated
+ * cap_from_text() and cap_iab_from_text() input.
+ */
+typedef struct cap_text_cache_s *cap_text_cache_t;
+extern cap_text_cache_t cap_text_cache_init(unsigned entries);
+extern cap_t   cap_text_cache_from_text(cap_text_cache_t, const char *);
+extern int     cap_text_cache_flat(cap_text_cache_t, const char *,
+				   cap_flat_t *);
+extern cap_iab_t cap_text_cache_iab_from_text(cap_text_cache_t,
+					      const char *);
+extern int     cap_text_cache_stats(cap_text_cache_t, unsigned long *,
+				    unsigned long *);
+extern int     cap_text_cache_clear(cap_text_cache_t);
 extern int     cap_from_name(const char *, cap_value_t *);
 extern char *  cap_to_name(cap_value_t);
 
 extern char *     cap_iab_to_text(cap_iab_t iab);
+extern ssize_t    cap_iab_to_text_r(cap_iab_t iab, char *buf, size_t len);
 extern cap_iab_t  cap_iab_from_text(const char *text);
 
 /* libcap/cap_proc.c */
@@ -217,6 +331,7 @@ extern int cap_setgroups(gid_t gid, size_t ngroups, const gid_t groups[]);
 
 extern cap_iab_t cap_iab_get_proc(void);
 extern cap_iab_t cap_iab_get_pid(pid_t);
+extern cap_iab_t cap_iab_get_procfd(int dirfd);
 extern int cap_iab_set_proc(cap_iab_t iab);
 
 typedef struct cap_launch_s *cap_launch_t;
@@ -232,6 +347,7 @@ extern int cap_launcher_setgroups(cap_launch_t attr, gid_t gid,
 extern int cap_launcher_set_mode(cap_launch_t attr, cap_mode_t flavor);
 extern cap_iab_t cap_launcher_set_iab(cap_launch_t attr, cap_iab_t iab);
 extern int cap_launcher_set_chroot(cap_launch_t attr, const char *chroot);
+extern int cap_launcher_compile(cap_launch_t attr);
 extern pid_t cap_launch(cap_launch_t attr, void *detail);
 
 /*
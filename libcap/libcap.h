@@ -153,10 +153,22 @@ struct _cap_struct {
 /* launcher magic for cap_free */
 #define CAP_LAUNCH_MAGIC 0xCA91AC
 
+/* arena magic for cap_free */
+#define CAP_ARENA_MAGIC 0xCA91AD
+
+/* text parser magic for cap_free */
+#define CAP_PARSER_MAGIC 0xCA91AE
+
+/* text cache magic for cap_free */
+#define CAP_TEXT_CACHE_MAGIC 0xCA91AF
+
 #define magic_of(x)           ((x) ? *(-2 + (const __u32 *) x) : 0)
 #define good_cap_t(x)         (CAP_T_MAGIC   == magic_of(x))
 #define good_cap_iab_t(x)     (CAP_IAB_MAGIC == magic_of(x))
 #define good_cap_launch_t(x)  (CAP_LAUNCH_MAGIC == magic_of(x))
+#define good_cap_arena_t(x)   (CAP_ARENA_MAGIC == magic_of(x))
+#define good_cap_parser_t(x)  (CAP_PARSER_MAGIC == magic_of(x))
+#define good_cap_text_cache_t(x) (CAP_TEXT_CACHE_MAGIC == magic_of(x))
 
 /*
  * kernel API cap set abstraction
@@ -201,7 +213,40 @@ struct _cap_struct {
 
 #endif /* DEBUG */
 
+/*
+ * _cap_proc_status_s holds the values parsed out of a
+ * /proc/<pid>/status file. The found bits record which of them
+ * were present.
+ */
+#define _CAP_STATUS_INH    (1U << 0)
+#define _CAP_STATUS_PRM    (1U << 1)
+#define _CAP_STATUS_EFF    (1U << 2)
+#define _CAP_STATUS_BND    (1U << 3)
+#define _CAP_STATUS_AMB    (1U << 4)
+#define _CAP_STATUS_NNP    (1U << 5)
+#define _CAP_STATUS_UID    (1U << 6)
+#define _CAP_STATUS_GID    (1U << 7)
+
+struct _cap_proc_status_s {
+    unsigned found;
+    __u32 inh[_LIBCAP_CAPABILITY_U32S];
+    __u32 prm[_LIBCAP_CAPABILITY_U32S];
+    __u32 eff[_LIBCAP_CAPABILITY_U32S];
+    __u32 bnd[_LIBCAP_CAPABILITY_U32S];
+    __u32 amb[_LIBCAP_CAPABILITY_U32S];
+    int no_new_privs;
+    uid_t uid[3];
+    gid_t gid[3];
+};
+
+extern int _libcap_proc_status(pid_t pid, struct _cap_proc_status_s *st);
+extern int _libcap_proc_status_at(int dirfd, const char *name,
+				  struct _cap_proc_status_s *st);
+extern int _libcap_proc_open(void);
 extern char *_libcap_strdup(const char *text);
+extern void *_libcap_alloc(__u32 magic, size_t size);
+extern void _libcap_alloc_forked(void);
+extern __u32 _libcap_version(void);
 extern void _libcap_initialize(void);
 extern int _libcap_overrode_syscalls;
 
@@ -216,6 +261,17 @@ extern void psx_load_syscalls(
     long int (**syscall6_fn)(long int, long int, long int, long int,
 			     long int, long int, long int));
 
+/*
+ * struct _cap_call_s has the same layout as the psx_call_t of
+ * <sys/psx_syscall.h>, for the same reason as above.
+ */
+struct _cap_call_s {
+    long int syscall_nr;
+    long int arg[6];
+};
+extern void psx_load_syscall_batch(
+    int (**batch_fn)(const struct _cap_call_s *calls, int n));
+
 #define EXECABLE_INITIALIZE _libcap_initialize()
 
 /*
@@ -320,6 +376,9 @@ struct cap_launch_s {
     /* chroot holds a preferred chroot for the launched child. */
     char *chroot;
 
+    /* plan holds the result of cap_launcher_compile(), if any. */
+    struct _cap_launch_plan_s *plan;
+
     /*
      * execve style arguments
      */
@@ -328,4 +387,6 @@ struct cap_launch_s {
     const char *const *envp;
 };
 
+extern void _libcap_launch_forget(struct cap_launch_s *attr);
+
 #endif /* LIBCAP_H */
@@ -4,85 +4,876 @@
  * This displays the capabilities of a given file.
  */
 
-#undef _XOPEN_SOURCE
-#define _XOPEN_SOURCE 500
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 
 #include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <dirent.h>
 #include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/xattr.h>
 #include <sys/capability.h>
+#include <linux/magic.h>
 
-#include <ftw.h>
+#ifdef WITH_PTHREADS
+#include <pthread.h>
+#endif
 
 static int verbose = 0;
 static int recursive = 0;
 static int namespace = 0;
+static int one_fs = 0;
+static int prefilter = 0;
+static int exec_only = 0;
+
+enum out_format {
+    OUT_TEXT = 0,
+    OUT_NUL,
+    OUT_JSON,
+    OUT_BINARY,
+};
+static enum out_format format = OUT_TEXT;
 
 static void usage(int code)
 {
     fprintf(stderr,
-    "usage: getcap [-h] [-l] [-n] [-r] [-v] <filename> [<filename> ...]\n"
+    "usage: getcap [-h] [-l] [-n] [-r] [-v] [-x] [-p] [-e] [-j <n>]"
+    " [-o <format>] <filename> [<filename> ...]\n"
     "\n"
     "\tdisplays the capabilities on the queried file(s).\n"
+    "\n"
+    "\t-r      recursively scan directories\n"
+    "\t-x      do not descend into other filesystems\n"
+    "\t-p      skip pseudo filesystems and those without xattr support\n"
+    "\t-e      only examine executable files\n"
+    "\t-j <n>  scan with <n> threads\n"
+    "\t-o <format>  output as text (default), nul, json or binary\n"
 	);
     exit(code);
 }
 
-static int do_getcap(const char *fname, const struct stat *stbuf,
-		     int tflag, struct FTW* ftwbuf)
+/*
+ * Output is collected in per-directory blocks, which are appended to
+ * one large buffer and written with a single write() when it fills.
+ */
+#define GETCAP_OUT_SIZE (1 << 16)
+
+struct outbuf {
+    char *data;
+    size_t used, size;
+};
+
+#ifdef WITH_PTHREADS
+static pthread_mutex_t out_mu = PTHREAD_MUTEX_INITIALIZER;
+#define getcap_lock(x)    pthread_mutex_lock(x)
+#define getcap_unlock(x)  pthread_mutex_unlock(x)
+#else
+#define getcap_lock(x)
+#define getcap_unlock(x)
+#endif
+
+static char out_data[GETCAP_OUT_SIZE];
+static size_t out_used;
+
+static void out_write(const char *data, size_t len)
 {
-    cap_t cap_d;
-    char *result;
-    uid_t rootid;
+    while (len) {
+	ssize_t n = write(STDOUT_FILENO, data, len);
+	if (n < 0) {
+	    if (errno == EINTR) {
+		continue;
+	    }
+	    perror("getcap: write failed");
+	    exit(1);
+	}
+	data += n;
+	len -= n;
+    }
+}
 
-    if (tflag != FTW_F) {
-	if (verbose) {
-	    printf("%s (Not a regular file)\n", fname);
+static void out_flush(void)
+{
+    out_write(out_data, out_used);
+    out_used = 0;
+}
+
+/*
+ * emit appends a completed block of output, keeping it contiguous.
+ */
+static void emit(struct outbuf *ob)
+{
+    if (!ob->used) {
+	return;
+    }
+    getcap_lock(&out_mu);
+    if (out_used + ob->used > sizeof(out_data)) {
+	out_flush();
+    }
+    if (ob->used > sizeof(out_data)) {
+	out_write(ob->data, ob->used);
+    } else {
+	memcpy(out_data + out_used, ob->data, ob->used);
+	out_used += ob->used;
+    }
+    getcap_unlock(&out_mu);
+    ob->used = 0;
+}
+
+static void ob_reserve(struct outbuf *ob, size_t len)
+{
+    if (ob->used + len <= ob->size) {
+	return;
+    }
+    ob->size = 2*(ob->size + len);
+    ob->data = realloc(ob->data, ob->size);
+    if (ob->data == NULL) {
+	perror("getcap: out of memory");
+	exit(1);
+    }
+}
+
+static void ob_append(struct outbuf *ob, const void *data, size_t len)
+{
+    ob_reserve(ob, len);
+    memcpy(ob->data + ob->used, data, len);
+    ob->used += len;
+}
+
+#define ob_literal(ob, str)  ob_append(ob, str, sizeof(str) - 1)
+
+static void ob_printf(struct outbuf *ob, const char *fmt, ...)
+    __attribute__((format (printf, 2, 3)));
+
+static void ob_printf(struct outbuf *ob, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    for (;;) {
+	va_start(ap, fmt);
+	n = vsnprintf(ob->data + ob->used, ob->size - ob->used, fmt, ap);
+	va_end(ap);
+	if (n < 0) {
+	    return;
 	}
-	return 0;
+	if (ob->used + n < ob->size) {
+	    ob->used += n;
+	    return;
+	}
+	ob_reserve(ob, n + 1);
+    }
+}
+
+/*
+ * ob_hex appends one flag of flat as a single hex number, in the
+ * same form as the Cap* lines of /proc/<pid>/status.
+ */
+static void ob_hex(struct outbuf *ob, const cap_flat_t *flat, cap_flag_t flag)
+{
+    static const char digits[] = "0123456789abcdef";
+    char hex[8 * _LINUX_CAPABILITY_U32S_3];
+    int i, j;
+
+    for (i = 0; i < _LINUX_CAPABILITY_U32S_3; i++) {
+	__u32 word = flat->u[_LINUX_CAPABILITY_U32S_3 - 1 - i].flat[flag];
+	for (j = 7; j >= 0; j--, word >>= 4) {
+	    hex[8*i + j] = digits[word & 0xf];
+	}
+    }
+    ob_append(ob, hex, sizeof(hex));
+}
+
+/*
+ * utf8_valid returns 1 if str is well formed UTF-8: no overlong
+ * forms, surrogates or code points above U+10FFFF.
+ */
+static int utf8_valid(const char *str)
+{
+    const unsigned char *c = (const unsigned char *) str;
+
+    while (*c) {
+	unsigned cp, min;
+	int more;
+
+	if (*c < 0x80) {
+	    c++;
+	    continue;
+	} else if ((*c & 0xe0) == 0xc0) {
+	    cp = *c & 0x1f;
+	    more = 1;
+	    min = 0x80;
+	} else if ((*c & 0xf0) == 0xe0) {
+	    cp = *c & 0x0f;
+	    more = 2;
+	    min = 0x800;
+	} else if ((*c & 0xf8) == 0xf0) {
+	    cp = *c & 0x07;
+	    more = 3;
+	    min = 0x10000;
+	} else {
+	    return 0;
+	}
+	for (c++; more > 0; more--, c++) {
+	    if ((*c & 0xc0) != 0x80) {
+		return 0;
+	    }
+	    cp = (cp << 6) | (*c & 0x3f);
+	}
+	if (cp < min || cp > 0x10ffff || (cp >= 0xd800 && cp <= 0xdfff)) {
+	    return 0;
+	}
+    }
+    return 1;
+}
+
+/*
+ * ob_base64 appends str as a quoted, padded base64 string.
+ */
+static void ob_base64(struct outbuf *ob, const char *str)
+{
+    static const char digits[] =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    const unsigned char *c = (const unsigned char *) str;
+    size_t len = strlen(str), i;
+
+    ob_literal(ob, "\"");
+    for (i = 0; i < len; i += 3) {
+	unsigned word = c[i] << 16;
+	char quad[4];
+
+	if (i + 1 < len) {
+	    word |= c[i + 1] << 8;
+	}
+	if (i + 2 < len) {
+	    word |= c[i + 2];
+	}
+	quad[0] = digits[(word >> 18) & 0x3f];
+	quad[1] = digits[(word >> 12) & 0x3f];
+	quad[2] = i + 1 < len ? digits[(word >> 6) & 0x3f] : '=';
+	quad[3] = i + 2 < len ? digits[word & 0x3f] : '=';
+	ob_append(ob, quad, 4);
+    }
+    ob_literal(ob, "\"");
+}
+
+/*
+ * ob_json_string appends str, which must be valid UTF-8, as a quoted
+ * JSON string.
+ */
+static void ob_json_string(struct outbuf *ob, const char *str)
+{
+    const unsigned char *c;
+
+    ob_literal(ob, "\"");
+    for (c = (const unsigned char *) str; *c; c++) {
+	if (*c == '"' || *c == '\\') {
+	    char esc[2] = { '\\', *c };
+	    ob_append(ob, esc, 2);
+	} else if (*c < 0x20) {
+	    ob_printf(ob, "\\u%04x", *c);
+	} else {
+	    ob_append(ob, c, 1);
+	}
+    }
+    ob_literal(ob, "\"");
+}
+
+/*
+ * Each binary record is this header, in host byte order, followed by
+ * pathlen bytes of path (not NUL terminated).
+ */
+struct getcap_record {
+    uint32_t effective[_LINUX_CAPABILITY_U32S_3];
+    uint32_t permitted[_LINUX_CAPABILITY_U32S_3];
+    uint32_t inheritable[_LINUX_CAPABILITY_U32S_3];
+    uint32_t rootid;
+    uint32_t pathlen;
+};
+
+/*
+ * emit_record appends the capabilities of path in one of the machine
+ * readable formats.
+ */
+static void emit_record(struct outbuf *ob, const cap_flat_t *flat,
+			const char *path)
+{
+    struct getcap_record rec;
+    int i;
+
+    switch (format) {
+    case OUT_NUL:
+	ob_hex(ob, flat, CAP_EFFECTIVE);
+	ob_literal(ob, " ");
+	ob_hex(ob, flat, CAP_PERMITTED);
+	ob_literal(ob, " ");
+	ob_hex(ob, flat, CAP_INHERITABLE);
+	ob_printf(ob, " %u %s", (unsigned) flat->rootid, path);
+	ob_append(ob, "", 1);      /* the NUL terminator */
+	break;
+    case OUT_JSON:
+	/* A path that is not UTF-8 cannot be a JSON string. */
+	if (utf8_valid(path)) {
+	    ob_literal(ob, "{\"path\":");
+	    ob_json_string(ob, path);
+	} else {
+	    ob_literal(ob, "{\"path_b64\":");
+	    ob_base64(ob, path);
+	}
+	ob_literal(ob, ",\"e\":\"");
+	ob_hex(ob, flat, CAP_EFFECTIVE);
+	ob_literal(ob, "\",\"p\":\"");
+	ob_hex(ob, flat, CAP_PERMITTED);
+	ob_literal(ob, "\",\"i\":\"");
+	ob_hex(ob, flat, CAP_INHERITABLE);
+	ob_printf(ob, "\",\"rootid\":%u}\n", (unsigned) flat->rootid);
+	break;
+    case OUT_BINARY:
+	for (i = 0; i < _LINUX_CAPABILITY_U32S_3; i++) {
+	    rec.effective[i] = flat->u[i].flat[CAP_EFFECTIVE];
+	    rec.permitted[i] = flat->u[i].flat[CAP_PERMITTED];
+	    rec.inheritable[i] = flat->u[i].flat[CAP_INHERITABLE];
+	}
+	rec.rootid = flat->rootid;
+	rec.pathlen = strlen(path);
+	ob_append(ob, &rec, sizeof(rec));
+	ob_append(ob, path, rec.pathlen);
+	break;
+    default:
+	break;
     }
+}
+
+/*
+ * do_getcap reports the capabilities of name, relative to dirfd, as
+ * path.
+ */
+static void do_getcap(struct outbuf *ob, int dirfd, const char *name,
+		      const char *path)
+{
+    char result[4096];
+    cap_flat_t flat;
+    uid_t rootid;
 
-    cap_d = cap_get_file(fname);
-    if (cap_d == NULL) {
+    if (cap_get_fileat(dirfd, name, AT_SYMLINK_NOFOLLOW, &flat) != 0) {
 	if (errno != ENODATA && errno != ENOTSUP) {
 	    fprintf(stderr, "Failed to get capabilities of file '%s' (%s)\n",
-		    fname, strerror(errno));
+		    path, strerror(errno));
 	} else if (verbose) {
-	    printf("%s\n", fname);
+	    ob_printf(ob, "%s\n", path);
 	}
-	return 0;
+	return;
     }
 
-    result = cap_to_text(cap_d, NULL);
-    if (!result) {
+    if (format != OUT_TEXT) {
+	emit_record(ob, &flat, path);
+	return;
+    }
+    if (cap_flat_to_text(&flat, result, sizeof(result)) < 0) {
 	fprintf(stderr,
 		"Failed to get capabilities of human readable format at '%s' (%s)\n",
-		fname, strerror(errno));
-	cap_free(cap_d);
-	return 0;
+		path, strerror(errno));
+	return;
     }
-    rootid = cap_get_nsowner(cap_d);
+    rootid = flat.rootid;
     if (namespace && (rootid+1 > 1)) {
-	printf("%s %s [rootid=%d]\n", fname, result, rootid);
+	ob_printf(ob, "%s %s [rootid=%d]\n", path, result, rootid);
     } else {
-	printf("%s %s\n", fname, result);
+	ob_printf(ob, "%s %s\n", path, result);
+    }
+}
+
+/*
+ * A parent keeps a scanned directory open for as long as any of its
+ * subdirectories are waiting to be opened relative to it.
+ */
+struct parent {
+    int fd;
+    long refs;
+};
+
+/*
+ * A task is a directory waiting to be scanned. It is opened by its
+ * final component, name, relative to its parent (the top level
+ * directory, with no parent, by path), so a directory swapped for a
+ * symlink part way through the scan cannot redirect it. path is only
+ * used for output. dev is the device of the top level directory,
+ * which -x confines the scan to.
+ */
+struct task {
+    dev_t dev;
+    struct parent *parent;
+    const char *name;
+    char path[];
+};
+
+/*
+ * Each worker owns a deque of tasks. It pushes and pops its own tasks
+ * at the tail (depth first), and idle workers steal from the head.
+ */
+struct worker {
+#ifdef WITH_PTHREADS
+    pthread_mutex_t mu;
+    pthread_t thread;
+#endif
+    int id;
+    struct task **items;
+    size_t head, tail, size;
+    struct outbuf ob;
+    struct skip_counts {
+	unsigned long files;      /* regular files found */
+	unsigned long no_xattrs;  /* on a filesystem without xattrs */
+	unsigned long not_exec;   /* without any execute bit */
+	unsigned long pseudo;     /* directories on pseudo filesystems */
+    } counts;
+};
+
+static struct worker *workers;
+static int nworkers = 1;
+
+static long queued;     /* tasks sitting in deques */
+static long pending;    /* tasks queued or being scanned */
+
+#ifdef WITH_PTHREADS
+static pthread_mutex_t idle_mu = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+static long sleepers;
+#endif
+
+static void push_task(struct worker *w, struct parent *parent,
+		      const char *path, size_t name, dev_t dev)
+{
+    size_t len = strlen(path) + 1;
+    struct task *t = malloc(sizeof(*t) + len);
+
+    if (t == NULL) {
+	perror("getcap: out of memory");
+	exit(1);
+    }
+    t->dev = dev;
+    t->parent = parent;
+    memcpy(t->path, path, len);
+    t->name = t->path + name;
+
+    __atomic_add_fetch(&pending, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&queued, 1, __ATOMIC_SEQ_CST);
+
+    getcap_lock(&w->mu);
+    if (w->tail == w->size) {
+	if (w->head) {
+	    memmove(w->items, w->items + w->head,
+		    (w->tail - w->head) * sizeof(*w->items));
+	    w->tail -= w->head;
+	    w->head = 0;
+	} else {
+	    w->size = w->size ? 2*w->size : 64;
+	    w->items = realloc(w->items, w->size * sizeof(*w->items));
+	    if (w->items == NULL) {
+		perror("getcap: out of memory");
+		exit(1);
+	    }
+	}
+    }
+    w->items[w->tail++] = t;
+    getcap_unlock(&w->mu);
+
+#ifdef WITH_PTHREADS
+    if (__atomic_load_n(&sleepers, __ATOMIC_SEQ_CST)) {
+	pthread_mutex_lock(&idle_mu);
+	pthread_cond_broadcast(&idle_cond);
+	pthread_mutex_unlock(&idle_mu);
+    }
+#endif
+}
+
+/*
+ * take_task removes a task from the tail (own == 1) or the head of a
+ * worker's deque.
+ */
+static struct task *take_task(struct worker *w, int own)
+{
+    struct task *t = NULL;
+
+    getcap_lock(&w->mu);
+    if (w->head != w->tail) {
+	t = own ? w->items[--w->tail] : w->items[w->head++];
+	if (w->head == w->tail) {
+	    w->head = w->tail = 0;
+	}
+    }
+    getcap_unlock(&w->mu);
+    if (t != NULL) {
+	__atomic_sub_fetch(&queued, 1, __ATOMIC_SEQ_CST);
+    }
+    return t;
+}
+
+/*
+ * next_task returns the next task for worker w, or NULL when the
+ * whole scan is complete.
+ */
+static struct task *next_task(struct worker *w)
+{
+    for (;;) {
+	struct task *t = take_task(w, 1);
+	int i;
+
+	for (i = 1; t == NULL && i < nworkers; i++) {
+	    t = take_task(&workers[(w->id + i) % nworkers], 0);
+	}
+	if (t != NULL) {
+	    return t;
+	}
+#ifdef WITH_PTHREADS
+	if (nworkers > 1) {
+	    int done;
+	    pthread_mutex_lock(&idle_mu);
+	    __atomic_add_fetch(&sleepers, 1, __ATOMIC_SEQ_CST);
+	    while (!__atomic_load_n(&queued, __ATOMIC_SEQ_CST)
+		   && __atomic_load_n(&pending, __ATOMIC_SEQ_CST)) {
+		pthread_cond_wait(&idle_cond, &idle_mu);
+	    }
+	    __atomic_sub_fetch(&sleepers, 1, __ATOMIC_SEQ_CST);
+	    done = !__atomic_load_n(&pending, __ATOMIC_SEQ_CST);
+	    pthread_mutex_unlock(&idle_mu);
+	    if (!done) {
+		continue;
+	    }
+	}
+#endif
+	return NULL;
+    }
+}
+
+static void finish_task(struct task *t)
+{
+    struct parent *p = t->parent;
+
+    if (p != NULL && __atomic_sub_fetch(&p->refs, 1, __ATOMIC_SEQ_CST) == 0) {
+	close(p->fd);
+	free(p);
+    }
+    free(t);
+    if (__atomic_sub_fetch(&pending, 1, __ATOMIC_SEQ_CST) == 0) {
+#ifdef WITH_PTHREADS
+	pthread_mutex_lock(&idle_mu);
+	pthread_cond_broadcast(&idle_cond);
+	pthread_mutex_unlock(&idle_mu);
+#endif
+    }
+}
+
+/*
+ * pseudo_fs identifies kernel filesystems that cannot hold file
+ * capabilities. With -p, directories on them are not scanned.
+ */
+static int pseudo_fs(long f_type)
+{
+    switch (f_type) {
+    case PROC_SUPER_MAGIC:
+    case SYSFS_MAGIC:
+    case DEVPTS_SUPER_MAGIC:
+#ifdef CGROUP_SUPER_MAGIC
+    case CGROUP_SUPER_MAGIC:
+#endif
+#ifdef CGROUP2_SUPER_MAGIC
+    case CGROUP2_SUPER_MAGIC:
+#endif
+#ifdef DEBUGFS_MAGIC
+    case DEBUGFS_MAGIC:
+#endif
+#ifdef TRACEFS_MAGIC
+    case TRACEFS_MAGIC:
+#endif
+#ifdef SECURITYFS_MAGIC
+    case SECURITYFS_MAGIC:
+#endif
+#ifdef PSTOREFS_MAGIC
+    case PSTOREFS_MAGIC:
+#endif
+#ifdef BPF_FS_MAGIC
+    case BPF_FS_MAGIC:
+#endif
+#ifdef SELINUX_MAGIC
+    case SELINUX_MAGIC:
+#endif
+#ifdef SMACK_MAGIC
+    case SMACK_MAGIC:
+#endif
+	return 1;
+    default:
+	return 0;
     }
-    cap_free(cap_d);
-    cap_free(result);
+}
 
+/*
+ * skip_file applies the -p and -e filters to a regular file found
+ * while scanning. It returns non-zero if the file need not be
+ * examined further.
+ */
+static int skip_file(struct worker *w, int dirfd, const char *name,
+		     const char *path, int no_xattrs)
+{
+    struct stat st;
+
+    w->counts.files++;
+    if (no_xattrs) {
+	w->counts.no_xattrs++;
+	if (verbose) {
+	    ob_printf(&w->ob, "%s\n", path);
+	}
+	return 1;
+    }
+    if (exec_only && fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) == 0
+	&& !(st.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH))) {
+	w->counts.not_exec++;
+	return 1;
+    }
     return 0;
 }
 
+/*
+ * The entries of a directory are read with getdents64 into a
+ * reusable buffer and sorted by name, so the output of each directory
+ * is deterministic.
+ */
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+struct entry {
+    const char *name;
+    unsigned char type;
+};
+
+static int entry_cmp(const void *a, const void *b)
+{
+    return strcmp(((const struct entry *) a)->name,
+		  ((const struct entry *) b)->name);
+}
+
+#define GETCAP_DENTS_SIZE (1 << 15)
+
+static void scan_dir(struct worker *w, struct task *t)
+{
+    char *names = NULL, *path = NULL;
+    struct entry *entries = NULL;
+    struct parent *parent = NULL;
+    size_t nent = 0, nsize = 0, nused = 0, ncap = 0, ndirs = 0, plen, i;
+    char dents[GETCAP_DENTS_SIZE];
+    struct stat st;
+    struct statfs sfs;
+    int fd, no_xattrs = 0;
+
+    fd = openat(t->parent ? t->parent->fd : AT_FDCWD, t->name,
+		O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+	fprintf(stderr, "%s (%s)\n", t->path, strerror(errno));
+	return;
+    }
+    if (one_fs && (fstat(fd, &st) != 0 || st.st_dev != t->dev)) {
+	close(fd);
+	return;
+    }
+    if (prefilter) {
+	if (fstatfs(fd, &sfs) == 0 && pseudo_fs(sfs.f_type)) {
+	    w->counts.pseudo++;
+	    close(fd);
+	    return;
+	}
+	/* files here are skipped, but mounts below may differ */
+	no_xattrs = flistxattr(fd, NULL, 0) < 0 && errno == ENOTSUP;
+    }
+
+    for (;;) {
+	long n = syscall(SYS_getdents64, fd, dents, sizeof(dents));
+	long off;
+	if (n < 0) {
+	    fprintf(stderr, "%s (%s)\n", t->path, strerror(errno));
+	    break;
+	}
+	if (n == 0) {
+	    break;
+	}
+	for (off = 0; off < n; ) {
+	    struct linux_dirent64 *d = (void *) (dents + off);
+	    size_t len = strlen(d->d_name) + 1;
+	    off += d->d_reclen;
+	    if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, "..")) {
+		continue;
+	    }
+	    if (nused + len > nsize) {
+		nsize = 2*(nsize + len);
+		names = realloc(names, nsize);
+	    }
+	    if (nent == ncap) {
+		ncap = ncap ? 2*ncap : 64;
+		entries = realloc(entries, ncap * sizeof(*entries));
+	    }
+	    if (names == NULL || entries == NULL) {
+		perror("getcap: out of memory");
+		exit(1);
+	    }
+	    memcpy(names + nused, d->d_name, len);
+	    entries[nent].name = (const char *) nused;
+	    entries[nent].type = d->d_type;
+	    nent++;
+	    nused += len;
+	}
+    }
+    for (i = 0; i < nent; i++) {
+	entries[i].name = names + (size_t) entries[i].name;
+    }
+    qsort(entries, nent, sizeof(*entries), entry_cmp);
+
+    plen = strlen(t->path);
+    path = malloc(plen + 2 + NAME_MAX);
+    if (path == NULL) {
+	perror("getcap: out of memory");
+	exit(1);
+    }
+    memcpy(path, t->path, plen);
+    if (!plen || path[plen-1] != '/') {
+	path[plen++] = '/';
+    }
+
+    for (i = 0; i < nent; i++) {
+	unsigned char type = entries[i].type;
+	strcpy(path + plen, entries[i].name);
+	if (type == DT_UNKNOWN) {
+	    if (fstatat(fd, entries[i].name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+		fprintf(stderr, "%s (%s)\n", path, strerror(errno));
+		continue;
+	    }
+	    type = S_ISREG(st.st_mode) ? DT_REG :
+		(S_ISDIR(st.st_mode) ? DT_DIR : DT_UNKNOWN);
+	}
+	if (type == DT_REG) {
+	    if ((prefilter || exec_only)
+		&& skip_file(w, fd, entries[i].name, path, no_xattrs)) {
+		continue;
+	    }
+	    do_getcap(&w->ob, fd, entries[i].name, path);
+	    continue;
+	}
+	if (verbose) {
+	    ob_printf(&w->ob, "%s (Not a regular file)\n", path);
+	}
+	if (type == DT_DIR) {
+	    /* deferred until this directory's block has been output */
+	    entries[i].type = DT_DIR;
+	    ndirs++;
+	} else {
+	    entries[i].type = DT_UNKNOWN;
+	}
+    }
+    emit(&w->ob);
+
+    if (ndirs == 0) {
+	close(fd);
+    } else {
+	parent = malloc(sizeof(*parent));
+	if (parent == NULL) {
+	    perror("getcap: out of memory");
+	    exit(1);
+	}
+	parent->fd = fd;
+	parent->refs = ndirs;
+    }
+
+    /* push in reverse so the owner scans subdirectories in order */
+    for (i = nent; i-- > 0; ) {
+	if (entries[i].type == DT_DIR) {
+	    strcpy(path + plen, entries[i].name);
+	    push_task(w, parent, path, plen, t->dev);
+	}
+    }
+
+    free(path);
+    free(entries);
+    free(names);
+}
+
+static void *run_worker(void *arg)
+{
+    struct worker *w = arg;
+    struct task *t;
+
+    while ((t = next_task(w)) != NULL) {
+	scan_dir(w, t);
+	finish_task(t);
+    }
+    return NULL;
+}
+
+/*
+ * scan_tree scans the directory tree rooted at path with all of the
+ * workers.
+ */
+static void scan_tree(const char *path, const struct stat *st)
+{
+    int i;
+
+    push_task(&workers[0], NULL, path, 0, st->st_dev);
+#ifdef WITH_PTHREADS
+    for (i = 1; i < nworkers; i++) {
+	if (pthread_create(&workers[i].thread, NULL, run_worker,
+			   &workers[i]) != 0) {
+	    perror("getcap: unable to start worker");
+	    exit(1);
+	}
+    }
+#endif
+    run_worker(&workers[0]);
+#ifdef WITH_PTHREADS
+    for (i = 1; i < nworkers; i++) {
+	pthread_join(workers[i].thread, NULL);
+    }
+#endif
+    for (i = 0; i < nworkers; i++) {
+	emit(&workers[i].ob);
+    }
+}
+
+/*
+ * report_skipped summarizes, on stderr, how much of the scan the
+ * -p and -e filters avoided.
+ */
+static void report_skipped(void)
+{
+    struct skip_counts sum;
+    int i;
+
+    memset(&sum, 0, sizeof(sum));
+    for (i = 0; i < nworkers; i++) {
+	sum.files += workers[i].counts.files;
+	sum.no_xattrs += workers[i].counts.no_xattrs;
+	sum.not_exec += workers[i].counts.not_exec;
+	sum.pseudo += workers[i].counts.pseudo;
+    }
+    fprintf(stderr, "getcap: %lu files, skipped %lu without xattr support,"
+	    " %lu not executable; %lu pseudo filesystem directories skipped\n",
+	    sum.files, sum.no_xattrs, sum.not_exec, sum.pseudo);
+}
+
 int main(int argc, char **argv)
 {
     int i, c;
 
-    while ((c = getopt(argc, argv, "rvhnl")) > 0) {
+    while ((c = getopt(argc, argv, "rvhnlxpej:o:")) > 0) {
 	switch(c) {
 	case 'r':
 	    recursive = 1;
@@ -93,6 +884,37 @@ int main(int argc, char **argv)
 	case 'n':
 	    namespace = 1;
 	    break;
+	case 'x':
+	    one_fs = 1;
+	    break;
+	case 'p':
+	    prefilter = 1;
+	    break;
+	case 'e':
+	    exec_only = 1;
+	    break;
+	case 'j':
+	    nworkers = atoi(optarg);
+	    if (nworkers < 1 || nworkers > 256) {
+		usage(1);
+	    }
+#ifndef WITH_PTHREADS
+	    nworkers = 1;
+#endif
+	    break;
+	case 'o':
+	    if (!strcmp(optarg, "text")) {
+		format = OUT_TEXT;
+	    } else if (!strcmp(optarg, "nul")) {
+		format = OUT_NUL;
+	    } else if (!strcmp(optarg, "json")) {
+		format = OUT_JSON;
+	    } else if (!strcmp(optarg, "binary")) {
+		format = OUT_BINARY;
+	    } else {
+		usage(1);
+	    }
+	    break;
 	case 'h':
 	    usage(0);
 	case 'l':
@@ -107,20 +929,45 @@ int main(int argc, char **argv)
 
     if (!argv[optind])
 	usage(1);
+    if (format != OUT_TEXT) {
+	/* records are only written for files with capabilities */
+	verbose = 0;
+    }
+
+    workers = calloc(nworkers, sizeof(*workers));
+    if (workers == NULL) {
+	perror("getcap: out of memory");
+	exit(1);
+    }
+    for (i = 0; i < nworkers; i++) {
+	workers[i].id = i;
+#ifdef WITH_PTHREADS
+	pthread_mutex_init(&workers[i].mu, NULL);
+#endif
+    }
 
     for (i=optind; argv[i] != NULL; i++) {
 	struct stat stbuf;
 	char *arg = argv[i];
 	if (lstat(arg, &stbuf) != 0) {
 	    fprintf(stderr, "%s (%s)\n", arg, strerror(errno));
-	} else if (recursive) {
-	    nftw(arg, do_getcap, 20, FTW_PHYS);
+	} else if (S_ISREG(stbuf.st_mode)) {
+	    do_getcap(&workers[0].ob, AT_FDCWD, arg, arg);
+	    emit(&workers[0].ob);
 	} else {
-	    int tflag = S_ISREG(stbuf.st_mode) ? FTW_F :
-		(S_ISLNK(stbuf.st_mode) ? FTW_SL : FTW_NS);
-	    do_getcap(argv[i], &stbuf, tflag, 0);
+	    if (verbose) {
+		ob_printf(&workers[0].ob, "%s (Not a regular file)\n", arg);
+		emit(&workers[0].ob);
+	    }
+	    if (recursive && S_ISDIR(stbuf.st_mode)) {
+		scan_tree(arg, &stbuf);
+	    }
 	}
     }
+    out_flush();
+    if (recursive && (prefilter || exec_only)) {
+	report_skipped();
+    }
 
     return 0;
 }
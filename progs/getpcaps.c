@@ -5,6 +5,8 @@
  */
 
 #include <sys/types.h>
+#include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <stdio.h>
 #include <string.h>
@@ -14,7 +16,7 @@
 static void usage(int code)
 {
     fprintf(stderr,
-"usage: getpcaps [opts] <pid> [<pid> ...]\n\n"
+"usage: getpcaps [opts] (--all|<pid>) [<pid> ...]\n\n"
 "  This program displays the capabilities on the queried process(es).\n"
 	    "  The capabilities are displayed in the cap_from_text(3) format.\n"
 	    "\n"
@@ -23,20 +25,195 @@ static void usage(int code)
 	    "     --verbose             use a more verbose output format.\n"
 	    "     --ugly or --legacy    use the archaic legacy output format.\n"
 	    "     --iab                 show IAB of process too.\n"
+	    "     --all                 show every process on the system.\n"
+	    "     --filter=<caps>       only show processes holding all of\n"
+	    "                           the capabilities in <caps>.\n"
 	    "     --license             display license info\n");
     exit(code);
 }
 
+static int verbose = 0;
+static int iab = 0;
+static cap_iab_t noiab;
+static int filtered = 0;
+static cap_flat_t filter;
+
+/*
+ * holds reports whether caps has every bit of the --filter value.
+ */
+static int holds(const cap_flat_t *caps)
+{
+    unsigned n, f;
+
+    if (!filtered) {
+	return 1;
+    }
+    for (n = 0; n < _LINUX_CAPABILITY_U32S_3; n++) {
+	for (f = 0; f < 3; f++) {
+	    if (filter.u[n].flat[f] & ~caps->u[n].flat[f]) {
+		return 0;
+	    }
+	}
+    }
+    return 1;
+}
+
+/*
+ * show displays the capabilities, as text result, and the IAB tuple,
+ * iab_val (only used with --iab), of the process named by arg.
+ */
+static void show(const char *arg, const char *result, cap_iab_t iab_val)
+{
+    if (iab) {
+	printf("%s:", arg);
+	if (verbose || strcmp("=", result) != 0) {
+	    printf(" \"%s\"", result);
+	}
+	int cf = cap_iab_compare(noiab, iab_val);
+	if (verbose ||
+	    CAP_IAB_DIFFERS(cf, CAP_IAB_AMB) ||
+	    CAP_IAB_DIFFERS(cf, CAP_IAB_BOUND)) {
+	    char *iab_text = cap_iab_to_text(iab_val);
+	    if (iab_text == NULL) {
+		perror(" no text for IAB");
+		exit(1);
+	    }
+	    printf(" [%s]", iab_text);
+	    cap_free(iab_text);
+	}
+	printf("\n");
+    } else if (verbose == 1) {
+	printf("Capabilities for '%s': %s\n", arg, result);
+    } else if (verbose == 2) {
+	fprintf(stderr, "Capabilities for `%s': %s\n", arg, result);
+    } else {
+	printf("%s: %s\n", arg, result);
+    }
+}
+
+static int pid_cmp(const void *a, const void *b)
+{
+    pid_t x = *(const pid_t *) a, y = *(const pid_t *) b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * show_all displays every process listed in the same "/proc"
+ * directory (see cap_proc_root()) that cap_get_pids() reads. The
+ * status file of each process is only read once, by cap_get_pids(),
+ * and all of the capability state shown is taken from that one
+ * snapshot.
+ */
+static int show_all(void)
+{
+    pid_t *pids = NULL;
+    cap_pid_info_t *info;
+    size_t n = 0, size = 0, i;
+    const char *root = cap_proc_root(NULL);
+    struct dirent *de;
+    int retval = 0;
+    DIR *dir;
+
+    dir = opendir(root ? root : "/proc");
+    if (dir == NULL) {
+	perror("unable to list processes");
+	return 1;
+    }
+    while ((de = readdir(dir)) != NULL) {
+	if (!isdigit(de->d_name[0])) {
+	    continue;
+	}
+	if (n == size) {
+	    size = size ? 2*size : 1024;
+	    pids = realloc(pids, size * sizeof(*pids));
+	    if (pids == NULL) {
+		perror("out of memory");
+		exit(1);
+	    }
+	}
+	pids[n++] = (pid_t) atol(de->d_name);
+    }
+    closedir(dir);
+    qsort(pids, n, sizeof(*pids), pid_cmp);
+
+    info = calloc(n ? n : 1, sizeof(*info));
+    if (info == NULL) {
+	perror("out of memory");
+	exit(1);
+    }
+    if (cap_get_pids(pids, n, info) < 0) {
+	perror("unable to read process capabilities");
+	exit(1);
+    }
+
+    for (i = 0; i < n; i++) {
+	char arg[32], result[1024];
+	cap_iab_t iab_val = NULL;
+
+	if (info[i].error) {
+	    if (info[i].error != ENOENT && info[i].error != ESRCH) {
+		fprintf(stderr, "Failed to get cap's for process %d:"
+			" (%s)\n", info[i].pid, strerror(info[i].error));
+		retval = 1;
+	    }
+	    continue;
+	}
+	if (!holds(&info[i].caps)) {
+	    continue;
+	}
+	if (cap_flat_to_text(&info[i].caps, result, sizeof(result)) < 0) {
+	    perror("no text for capabilities");
+	    exit(1);
+	}
+	if (iab) {
+	    cap_proc_state_t state;
+
+	    memset(&state, 0, sizeof(state));
+	    state.caps = info[i].caps;
+	    memcpy(state.amb, info[i].amb, sizeof(state.amb));
+	    memcpy(state.bound, info[i].bound, sizeof(state.bound));
+	    state.max_bits = cap_max_bits();
+	    iab_val = cap_proc_state_iab(&state);
+	    if (iab_val == NULL) {
+		fprintf(stderr, " no IAB value for %d\n", info[i].pid);
+		exit(1);
+	    }
+	}
+	sprintf(arg, "%d", info[i].pid);
+	show(arg, result, iab_val);
+	cap_free(iab_val);
+    }
+
+    free(info);
+    free(pids);
+    return retval;
+}
+
 int main(int argc, char **argv)
 {
     int retval = 0;
-    int verbose = 0;
-    int iab = 0;
-    cap_iab_t noiab = cap_iab_init();
+    int i;
 
     if (argc < 2) {
 	usage(1);
     }
+    noiab = cap_iab_init();
+
+    /*
+     * Many lines of --all output are written to stdout in large
+     * blocks, unless the legacy format sends them to stderr.
+     */
+    int all = 0, ugly = 0;
+    for (i = 1; i < argc; i++) {
+	if (!strcmp(argv[i], "--all")) {
+	    all = 1;
+	} else if (!strcmp(argv[i], "--ugly") || !strcmp(argv[i], "--legacy")) {
+	    ugly = 1;
+	}
+    }
+    if (all && !ugly) {
+	setvbuf(stdout, NULL, _IOFBF, 1 << 16);
+    }
 
     for (++argv; --argc > 0; ++argv) {
 	long lpid;
@@ -63,6 +240,18 @@ int main(int argc, char **argv)
 	} else if (!strcmp(arg, "--iab")) {
 	    iab = 1;
 	    continue;
+	} else if (!strncmp(arg, "--filter=", 9)) {
+	    cap_t want = cap_from_text(arg + 9);
+	    if (want == NULL || cap_to_flat(want, &filter)) {
+		fprintf(stderr, "Cannot parse filter %s\n", arg + 9);
+		exit(1);
+	    }
+	    cap_free(want);
+	    filtered = 1;
+	    continue;
+	} else if (!strcmp(arg, "--all")) {
+	    retval |= show_all();
+	    continue;
 	}
 
 	errno = 0;
@@ -89,38 +278,25 @@ int main(int argc, char **argv)
 		continue;
 	}
 
+	if (filtered) {
+	    cap_flat_t caps;
+	    if (cap_to_flat(cap_d, &caps) == 0 && !holds(&caps)) {
+		cap_free(cap_d);
+		continue;
+	    }
+	}
+
 	char *result = cap_to_text(cap_d, NULL);
+	cap_iab_t iab_val = NULL;
 	if (iab) {
-	    printf("%s:", arg);
-	    if (verbose || strcmp("=", result) != 0) {
-		printf(" \"%s\"", result);
-	    }
-	    cap_iab_t iab_val = cap_iab_get_pid(pid);
+	    iab_val = cap_iab_get_pid(pid);
 	    if (iab_val == NULL) {
 		fprintf(stderr, " no IAB value for %d\n", pid);
 		exit(1);
 	    }
-	    int cf = cap_iab_compare(noiab, iab_val);
-	    if (verbose ||
-		CAP_IAB_DIFFERS(cf, CAP_IAB_AMB) ||
-		CAP_IAB_DIFFERS(cf, CAP_IAB_BOUND)) {
-		char *iab_text = cap_iab_to_text(iab_val);
-		if (iab_text == NULL) {
-		    perror(" no text for IAB");
-		    exit(1);
-		}
-		printf(" [%s]", iab_text);
-		cap_free(iab_text);
-	    }
-	    cap_free(iab_val);
-	    printf("\n");
-	} else if (verbose == 1) {
-	    printf("Capabilities for '%s': %s\n", arg, result);
-	} else if (verbose == 2) {
-	    fprintf(stderr, "Capabilities for `%s': %s\n", arg, result);
-	} else {
-	    printf("%s: %s\n", arg, result);
 	}
+	show(arg, result, iab_val);
+	cap_free(iab_val);
 
 	cap_free(result);
 	result = NULL;
@@ -4,19 +4,33 @@
  * This sets/verifies the capabilities of a given file.
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <sys/capability.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+#ifdef WITH_PTHREADS
+#include <pthread.h>
+#endif
+
 static void usage(int status)
 {
     fprintf(stderr,
-	    "usage: setcap [--license] [-f] [-h] [-n <rootid>] [-q] [-v]"
-	    " (-r|-|<caps>) <filename> [ ... (-r|-|<capsN>) <filenameN> ]\n"
+	    "usage: setcap [--license] [-f] [-h] [-n <rootid>] [-q] [-v] [-V]"
+	    " [-j <n>]\n"
+	    "              (-r|-|<caps>) <filename>"
+	    " [ ... (-r|-|<capsN>) <filenameN> ]\n"
+	    "       setcap [options] -m <manifest>\n"
 	    "\n"
 	    " Note <filename> must be a regular (non-symlink) file.\n"
 	    " -r          remove capability from file\n"
@@ -30,6 +44,10 @@ static void usage(int status)
 	    " -n <rootid> write a user namespace (!= 0) limited capability\n"
 	    " -q          quietly\n"
 	    " -v          validate supplied capability matches file\n"
+	    " -V          validate each file after setting its capability\n"
+	    " -m <file>   apply \"<filename> (-r|<caps>) [<rootid>]\" lines from\n"
+	    "             <file> (- for stdin)\n"
+	    " -j <n>      apply a manifest with <n> threads\n"
 	);
     exit(status);
 }
@@ -97,13 +115,399 @@ static int read_caps(int quiet, const char *filename, char *buffer)
     return (i < MAXCAP ? 0:-1);
 }
 
+/*
+ * Under Linux, file capabilities have a compressed representation:
+ * the effective flag is either empty or the union of permitted and
+ * inheritable. bad_effective reports a cap_d violating this.
+ */
+static int bad_effective(cap_t cap_d)
+{
+#ifdef linux
+    int somebits = 0;
+    cap_value_t cap;
+    cap_flag_value_t per_state;
+
+    for (cap = 0;
+	 cap_get_flag(cap_d, cap, CAP_PERMITTED, &per_state) != -1;
+	 cap++) {
+	cap_flag_value_t inh_state, eff_state, combined;
+
+	cap_get_flag(cap_d, cap, CAP_INHERITABLE, &inh_state);
+	cap_get_flag(cap_d, cap, CAP_EFFECTIVE, &eff_state);
+	combined = (inh_state | per_state);
+	somebits |= !!eff_state;
+	if (combined != eff_state) {
+	    return somebits;
+	}
+    }
+#endif /* def linux */
+    return 0;
+}
+
+static void raise_setfcap(cap_t mycaps)
+{
+    static int tried_to_cap_setfcap = 0;
+    cap_value_t capflag = CAP_SETFCAP;
+
+    if (tried_to_cap_setfcap) {
+	return;
+    }
+
+    /*
+     * Raise the effective CAP_SETFCAP.
+     */
+    if (cap_set_flag(mycaps, CAP_EFFECTIVE, 1, &capflag, CAP_SET) != 0) {
+	perror("unable to manipulate CAP_SETFCAP - try a newer libcap?");
+	exit(1);
+    }
+    if (cap_set_proc(mycaps) != 0) {
+	perror("unable to set CAP_SETFCAP effective capability");
+	exit(1);
+    }
+    tried_to_cap_setfcap = 1;
+}
+
+/*
+ * A manifest lists one file per line, with the capabilities to give
+ * it and an optional namespace root user ID. Each distinct pair of
+ * capability text and rootid is parsed once into a shared capset.
+ */
+struct capset {
+    char *text;
+    uid_t rootid;
+    cap_t cap;          /* NULL for -r */
+    cap_flat_t flat;
+    const char *error;  /* why the capabilities cannot be applied */
+};
+
+struct manifest_entry {
+    char *path;
+    unsigned long line;
+    struct capset *set;
+};
+
+struct manifest {
+    const char *name;
+    int quiet, verify, check, forced;
+    struct manifest_entry *entries;
+    size_t n, size;
+    struct capset **sets;       /* open addressed hash table */
+    size_t nsets, setsize;
+    size_t next;                /* next entry to apply */
+    unsigned long failed;
+};
+
+static uint32_t capset_hash(const char *text, uid_t rootid)
+{
+    uint32_t h = 2166136261u ^ rootid;
+
+    while (*text) {
+	h = (h ^ (unsigned char) *text++) * 16777619u;
+    }
+    return h;
+}
+
+/*
+ * find_capset returns the capset for text and rootid, parsing text
+ * the first time it is seen.
+ */
+static struct capset *find_capset(struct manifest *m, const char *text,
+				  uid_t rootid)
+{
+    struct capset *set;
+    size_t i;
+
+    if (2*(m->nsets + 1) > m->setsize) {
+	struct capset **old = m->sets;
+	size_t oldsize = m->setsize;
+
+	m->setsize = oldsize ? 2*oldsize : 64;
+	m->sets = calloc(m->setsize, sizeof(*m->sets));
+	if (m->sets == NULL) {
+	    perror("setcap: out of memory");
+	    exit(1);
+	}
+	for (i = 0; i < oldsize; i++) {
+	    size_t j;
+	    if (old[i] == NULL) {
+		continue;
+	    }
+	    j = capset_hash(old[i]->text, old[i]->rootid) & (m->setsize - 1);
+	    while (m->sets[j] != NULL) {
+		j = (j + 1) & (m->setsize - 1);
+	    }
+	    m->sets[j] = old[i];
+	}
+	free(old);
+    }
+
+    i = capset_hash(text, rootid) & (m->setsize - 1);
+    for (; (set = m->sets[i]) != NULL; i = (i + 1) & (m->setsize - 1)) {
+	if (set->rootid == rootid && !strcmp(set->text, text)) {
+	    return set;
+	}
+    }
+
+    set = calloc(1, sizeof(*set));
+    if (set == NULL || (set->text = strdup(text)) == NULL) {
+	perror("setcap: out of memory");
+	exit(1);
+    }
+    set->rootid = rootid;
+    if (strcmp(text, "-r")) {
+	set->cap = cap_from_text(text);
+	if (set->cap == NULL) {
+	    set->error = "invalid capabilities";
+	} else if (cap_set_nsowner(set->cap, rootid)) {
+	    set->error = "unable to set nsowner";
+	} else if (bad_effective(set->cap) && !m->forced) {
+	    set->error = "effective file capabilities must either be empty,"
+		" or exactly match the union of selected permitted and"
+		" inheritable bits";
+	} else {
+	    cap_to_flat(set->cap, &set->flat);
+	}
+    }
+    m->sets[i] = set;
+    m->nsets++;
+    return set;
+}
+
+/*
+ * read_manifest collects the entries of a manifest. Malformed lines
+ * are reported and counted as failures, but do not stop the batch.
+ */
+static void read_manifest(struct manifest *m, FILE *f, uid_t rootid)
+{
+    char *line = NULL;
+    size_t len = 0;
+    unsigned long lineno = 0;
+
+    while (getline(&line, &len, f) >= 0) {
+	char *path, *text, *end, *last;
+	uid_t id = rootid;
+
+	lineno++;
+	for (path = line; isspace(*path); path++);
+	if (*path == '\0' || *path == '#') {
+	    continue;
+	}
+	for (text = path; *text && !isspace(*text); text++);
+	if (*text) {
+	    *text++ = '\0';
+	}
+	for (; isspace(*text); text++);
+	for (end = text + strlen(text); end > text && isspace(end[-1]); end--);
+	*end = '\0';
+
+	/* a trailing number is the rootid */
+	for (last = end; last > text && !isspace(last[-1]); last--);
+	if (last > text && isdigit(*last)) {
+	    char *rest;
+	    unsigned long value = strtoul(last, &rest, 0);
+	    if (*rest == '\0') {
+		id = (uid_t) value;
+		for (end = last; end > text && isspace(end[-1]); end--);
+		*end = '\0';
+	    }
+	}
+	if (*text == '\0') {
+	    fprintf(stderr, "%s:%lu: missing capabilities for '%s'\n",
+		    m->name, lineno, path);
+	    m->failed++;
+	    continue;
+	}
+
+	if (m->n == m->size) {
+	    m->size = m->size ? 2*m->size : 1024;
+	    m->entries = realloc(m->entries, m->size * sizeof(*m->entries));
+	    if (m->entries == NULL) {
+		perror("setcap: out of memory");
+		exit(1);
+	    }
+	}
+	m->entries[m->n].path = strdup(path);
+	if (m->entries[m->n].path == NULL) {
+	    perror("setcap: out of memory");
+	    exit(1);
+	}
+	m->entries[m->n].line = lineno;
+	m->entries[m->n].set = find_capset(m, text, id);
+	m->n++;
+    }
+    free(line);
+}
+
+/*
+ * apply_entry names the file of e once, with O_PATH|O_NOFOLLOW, and
+ * both sets and verifies its capabilities through that descriptor.
+ */
+static int apply_entry(struct manifest *m, const struct manifest_entry *e)
+{
+    const struct capset *set = e->set;
+    struct stat st;
+    cap_flat_t got;
+    int fd, cmp;
+
+    if (set->error) {
+	fprintf(stderr, "%s:%lu: '%s': %s\n",
+		m->name, e->line, set->text, set->error);
+	return -1;
+    }
+    fd = open(e->path, O_PATH | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+	fprintf(stderr, "%s:%lu: %s: %s\n", m->name, e->line, e->path,
+		strerror(errno));
+	return -1;
+    }
+    /* an O_PATH|O_NOFOLLOW open succeeds on a symlink */
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+	fprintf(stderr, "%s:%lu: Invalid file '%s' for capability"
+		" operation\n", m->name, e->line, e->path);
+	close(fd);
+	return -1;
+    }
+    if (!m->verify && cap_set_fd(fd, set->cap) != 0
+	&& !(errno == ENODATA && set->cap == NULL && m->forced)) {
+	if (errno == EINVAL) {
+	    fprintf(stderr, "%s:%lu: Invalid file '%s' for capability"
+		    " operation\n", m->name, e->line, e->path);
+	} else if (errno == ENODATA) {
+	    fprintf(stderr, "%s:%lu: File '%s' has no capability to remove\n",
+		    m->name, e->line, e->path);
+	} else {
+	    fprintf(stderr, "%s:%lu: Failed to set capabilities on file"
+		    " '%s': %s\n", m->name, e->line, e->path, strerror(errno));
+	}
+	close(fd);
+	return -1;
+    }
+    if (!m->verify && !m->check) {
+	close(fd);
+	return 0;
+    }
+
+    if (cap_get_fileat(fd, "", AT_EMPTY_PATH, &got) != 0) {
+	if (errno != ENODATA && errno != ENOTSUP) {
+	    fprintf(stderr, "%s:%lu: %s: %s\n", m->name, e->line, e->path,
+		    strerror(errno));
+	    close(fd);
+	    return -1;
+	}
+	cap_flat_init(&got);
+    }
+    close(fd);
+
+    cmp = cap_flat_compare(&got, &set->flat);
+    if (cmp != 0 || got.rootid != set->flat.rootid) {
+	if (!m->quiet) {
+	    if (got.rootid != set->flat.rootid) {
+		printf("nsowner[got=%d, want=%d],", got.rootid,
+		       set->flat.rootid);
+	    }
+	    printf("%s differs in [%s%s%s]\n", e->path,
+		   CAP_DIFFERS(cmp, CAP_PERMITTED) ? "p" : "",
+		   CAP_DIFFERS(cmp, CAP_INHERITABLE) ? "i" : "",
+		   CAP_DIFFERS(cmp, CAP_EFFECTIVE) ? "e" : "");
+	}
+	return -1;
+    }
+    if (!m->quiet) {
+	printf("%s: OK\n", e->path);
+    }
+    return 0;
+}
+
+static void *apply_manifest(void *arg)
+{
+    struct manifest *m = arg;
+
+    for (;;) {
+	size_t i = __atomic_fetch_add(&m->next, 1, __ATOMIC_RELAXED);
+	if (i >= m->n) {
+	    return NULL;
+	}
+	if (apply_entry(m, &m->entries[i])) {
+	    __atomic_add_fetch(&m->failed, 1, __ATOMIC_RELAXED);
+	}
+    }
+}
+
+/*
+ * run_manifest applies every line of the named manifest, with
+ * nthreads workers, and returns the number of lines that failed.
+ */
+static unsigned long run_manifest(struct manifest *m, uid_t rootid,
+				  int nthreads)
+{
+    FILE *f = stdin;
+    size_t i;
+
+    if (strcmp(m->name, "-")) {
+	f = fopen(m->name, "r");
+	if (f == NULL) {
+	    perror(m->name);
+	    exit(1);
+	}
+    }
+    read_manifest(m, f, rootid);
+    if (f != stdin) {
+	fclose(f);
+    }
+
+#ifdef WITH_PTHREADS
+    {
+	pthread_t *threads = NULL;
+	int t;
+
+	if (nthreads > 1 && (size_t) nthreads > m->n) {
+	    nthreads = m->n ? m->n : 1;
+	}
+	if (nthreads > 1) {
+	    threads = calloc(nthreads - 1, sizeof(*threads));
+	    if (threads == NULL) {
+		perror("setcap: out of memory");
+		exit(1);
+	    }
+	}
+	for (t = 0; t < nthreads - 1; t++) {
+	    if (pthread_create(&threads[t], NULL, apply_manifest, m) != 0) {
+		perror("setcap: unable to start worker");
+		exit(1);
+	    }
+	}
+	apply_manifest(m);
+	for (t = 0; t < nthreads - 1; t++) {
+	    pthread_join(threads[t], NULL);
+	}
+	free(threads);
+    }
+#else
+    (void) nthreads;
+    apply_manifest(m);
+#endif
+
+    for (i = 0; i < m->n; i++) {
+	free(m->entries[i].path);
+    }
+    for (i = 0; i < m->setsize; i++) {
+	if (m->sets[i] != NULL) {
+	    cap_free(m->sets[i]->cap);
+	    free(m->sets[i]->text);
+	    free(m->sets[i]);
+	}
+    }
+    free(m->entries);
+    free(m->sets);
+    return m->failed;
+}
+
 int main(int argc, char **argv)
 {
-    int tried_to_cap_setfcap = 0;
     char buffer[MAXCAP+1];
-    int retval, quiet = 0, verify = 0, forced = 0;
+    int retval, quiet = 0, verify = 0, check = 0, forced = 0, nthreads = 1;
+    unsigned long failed = 0;
     cap_t mycaps;
-    cap_value_t capflag;
     uid_t rootid = 0, f_rootid;
 
     if (argc < 2) {
@@ -156,6 +560,40 @@ int main(int argc, char **argv)
 	    verify = 1;
 	    continue;
 	}
+	if (!strcmp(*arg, "-V")) {
+	    check = 1;
+	    continue;
+	}
+	if (!strcmp(*arg, "-j")) {
+	    if (argc < 2) {
+		usage(1);
+	    }
+	    --argc;
+	    nthreads = (int) pos_uint(*++arg, "bad thread count", NULL);
+	    if (nthreads > 256) {
+		usage(1);
+	    }
+	    continue;
+	}
+	if (!strcmp(*arg, "-m")) {
+	    struct manifest m;
+
+	    if (argc < 2) {
+		usage(1);
+	    }
+	    --argc;
+	    memset(&m, 0, sizeof(m));
+	    m.name = *++arg;
+	    m.quiet = quiet;
+	    m.verify = verify;
+	    m.check = check;
+	    m.forced = forced;
+	    if (!verify) {
+		raise_setfcap(mycaps);
+	    }
+	    failed += run_manifest(&m, rootid, nthreads);
+	    continue;
+	}
 
 	if (!strcmp(*arg, "-r")) {
 	    cap_free(cap_d);
@@ -248,55 +686,14 @@ int main(int argc, char **argv)
 		printf("%s: OK\n", *arg);
 	    }
 	} else {
-	    if (!tried_to_cap_setfcap) {
-		capflag = CAP_SETFCAP;
-
-		/*
-		 * Raise the effective CAP_SETFCAP.
-		 */
-		if (cap_set_flag(mycaps, CAP_EFFECTIVE, 1, &capflag, CAP_SET)
-		    != 0) {
-		    perror("unable to manipulate CAP_SETFCAP - "
-			   "try a newer libcap?");
-		    exit(1);
-		}
-		if (cap_set_proc(mycaps) != 0) {
-		    perror("unable to set CAP_SETFCAP effective capability");
+	    raise_setfcap(mycaps);
+	    if (cap_d != NULL && bad_effective(cap_d)) {
+		fprintf(stderr, "Error: under Linux, effective file capabilities must either be empty, or\n"
+			"       exactly match the union of selected permitted and inheritable bits.\n");
+		if (!forced) {
 		    exit(1);
 		}
-		tried_to_cap_setfcap = 1;
 	    }
-#ifdef linux
-	    {
-		/* Linux's file capabilities have a compressed representation. */
-		int explained = 0;
-		int somebits = 0;
-		cap_value_t cap;
-		cap_flag_value_t per_state;
-
-		for (cap = 0;
-		     cap_get_flag(cap_d, cap, CAP_PERMITTED, &per_state) != -1;
-		     cap++) {
-		    cap_flag_value_t inh_state, eff_state, combined;
-
-		    cap_get_flag(cap_d, cap, CAP_INHERITABLE, &inh_state);
-		    cap_get_flag(cap_d, cap, CAP_EFFECTIVE, &eff_state);
-		    combined = (inh_state | per_state);
-		    somebits |= !!eff_state;
-		    if (combined != eff_state) {
-			explained = 1;
-			break;
-		    }
-		}
-		if (somebits && explained) {
-		    fprintf(stderr, "Error: under Linux, effective file capabilities must either be empty, or\n"
-			    "       exactly match the union of selected permitted and inheritable bits.\n");
-		    if (!forced) {
-			exit(1);
-		    }
-		}
-	    }
-#endif /* def linux */
 	    errno = 0;
 	    retval = cap_set_file(*++arg, cap_d);
 	    if (retval != 0) {
@@ -330,5 +727,5 @@ int main(int argc, char **argv)
 	cap_free(cap_d);
     }
 
-    exit(0);
+    exit(failed ? 1 : 0);
 }
@@ -11,21 +11,18 @@
  * abstraction, we need our own mutex etc implementation.
  */
 
-typedef unsigned char psx_mutex_t;
-#define _psx_mu_blocked(x)					\
-    __atomic_test_and_set((void *)(x), __ATOMIC_SEQ_CST)
-#define _psx_mu_lock(x)             \
-    while (_psx_mu_blocked(x)) sched_yield()
-#define _psx_mu_unlock(x)           \
-    __atomic_clear((void *)(x), __ATOMIC_SEQ_CST)
+/*
+ * psx_mutex_t is a futex word: 0 = unlocked, 1 = locked, 2 = locked
+ * with (possible) sleeping waiters. Everything is done with raw
+ * system calls, so these are safe to use from the signal handler.
+ */
+typedef int psx_mutex_t;
+extern void _psx_futex_lock(psx_mutex_t *mu);
+extern void _psx_futex_unlock(psx_mutex_t *mu);
+#define _psx_mu_lock(x)             _psx_futex_lock(x)
+#define _psx_mu_unlock(x)           _psx_futex_unlock(x)
 #define _psx_mu_unlock_return(x, y) \
     do { _psx_mu_unlock(x); return (y); } while (0)
-#define _psx_mu_cond_wait(x)       \
-    do {                           \
-        _psx_mu_unlock(x);         \
-        sched_yield();             \
-        _psx_mu_lock(x);           \
-    } while (0)
 
 /* Not reliably defined by *libc so, alias the direct syscall. */
 #define _psx_gettid() syscall(SYS_gettid)
@@ -33,7 +30,9 @@ typedef unsigned char psx_mutex_t;
 extern void psx_lock(void);
 extern void psx_unlock(void);
 extern void psx_cond_wait(void);
-extern long psx_mix(long value);
+extern void psx_cond_broadcast(void);
+extern void psx_await_release(void);
+extern long int psx_run_batch(const psx_call_t *calls, int n);
 
 typedef enum {
     _PSX_IDLE = 0,
@@ -43,15 +42,45 @@ typedef enum {
 } psx_tracker_state_t;
 
 /*
- * Tracking threads is done via a hash map of these objects.
+ * Tracking threads is done via an open addressing (linear probing)
+ * hash map of these objects. An entry is only in use if its gen
+ * matches the map_gen of the current broadcast.
  */
 typedef struct psx_thread_ref_s {
+    long gen;
     long sweep;
-    long pending;
+    long pending;  /* 1 = signaled, 0 = done, _PSX_REF_GONE = exited */
     long tid;
     long retval;
+    long sent_ns;  /* when signaled, only tracked when stats are enabled */
 } psx_thread_ref_t;
 
+#define _PSX_REF_GONE (-1)
+
+extern psx_thread_ref_t *psx_find_tid(long tid);
+extern void psx_ack(psx_thread_ref_t *ref);
+
+/*
+ * The opt-in statistics are accumulated under lock in this structure.
+ * Acknowledgement latencies are kept in a log2 histogram.
+ */
+#define _PSX_ACK_BUCKETS 64
+
+typedef struct {
+    int enabled;
+    unsigned long broadcasts;
+    unsigned long sweeps;
+    unsigned long max_sweeps;
+    unsigned long threads_signaled;
+    unsigned long map_collisions;
+    unsigned long map_rehashes;
+    unsigned long broadcast_max_ns;
+    unsigned long broadcast_total_ns;
+    unsigned long ack_max_ns;
+    unsigned long ack_count;
+    unsigned long ack_hist[_PSX_ACK_BUCKETS];
+} psx_stats_tracker_t;
+
 /*
  * This global structure holds the global coordination state for
  * libcap's psx_syscall() support.
@@ -61,6 +90,10 @@ typedef struct {
     char *pid_path;
 
     psx_mutex_t state_mu;
+    int state_seq;     /* futex word bumped by psx_cond_broadcast() */
+    int cond_waiters;  /* number of threads sleeping in psx_cond_wait() */
+    int acks;          /* futex word counting handler acknowledgements */
+    int ack_target;    /* the initiator is woken when acks reaches this */
     psx_tracker_state_t state;
     int initialized;
     int incomplete;
@@ -73,14 +106,30 @@ typedef struct {
 	long arg1, arg2, arg3, arg4, arg5, arg6;
 	int six;
 	int active;
+	const psx_call_t *batch;  /* when non-NULL, replaces the above call */
+	int batch_count;
     } cmd;
 
     /* This is kept opaque here, but its details are known to psx_calls.c */
     void *actions;
 
     int map_entries;
+    int map_used;
     long map_mask;
+    long map_gen;
     psx_thread_ref_t *map;
+
+    /*
+     * The optional registry of threads known to be alive. It has its
+     * own lock so the broadcast can hold it while signaling threads
+     * that may themselves be waiting on state_mu.
+     */
+    psx_mutex_t registry_mu;
+    int registry_count;
+    int registry_size;
+    long *registry;
+
+    psx_stats_tracker_t stats;
 } psx_tracker_t;
 
 /* defined in psx_calls.c */
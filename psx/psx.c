@@ -16,6 +16,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <pthread.h>  /* pthread_atfork() */
 #include <signal.h>
 #include <stdarg.h>
@@ -24,8 +25,10 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <sys/syscall.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "psx_syscall.h"
@@ -70,27 +73,190 @@ void psx_load_syscalls(long int (**syscall_fn)(long int,
     *syscall6_fn = psx_syscall6;
 }
 
+/*
+ * Not all toolchains provide <linux/futex.h>, so we define the few
+ * values we need.
+ */
+#ifndef FUTEX_WAIT
+#define FUTEX_WAIT          0
+#endif
+#ifndef FUTEX_WAKE
+#define FUTEX_WAKE          1
+#endif
+#ifndef FUTEX_PRIVATE_FLAG
+#define FUTEX_PRIVATE_FLAG  128
+#endif
+
+/*
+ * psx_futex is a raw futex system call on a process private word.
+ */
+static long psx_futex(int *word, int op, int value,
+		      const struct timespec *timeout)
+{
+    return syscall(SYS_futex, word, op | FUTEX_PRIVATE_FLAG, value,
+		   timeout, NULL, 0);
+}
+
+/*
+ * _psx_futex_lock obtains a psx_mutex_t, sleeping while it is
+ * contended. See Drepper, "Futexes Are Tricky", mutex #2.
+ */
+__attribute__((visibility ("hidden"))) void _psx_futex_lock(psx_mutex_t *mu)
+{
+    int c = 0;
+    if (__atomic_compare_exchange_n(mu, &c, 1, 0,
+				    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+	return;
+    }
+    if (c != 2) {
+	c = __atomic_exchange_n(mu, 2, __ATOMIC_ACQUIRE);
+    }
+    while (c != 0) {
+	psx_futex(mu, FUTEX_WAIT, 2, NULL);
+	c = __atomic_exchange_n(mu, 2, __ATOMIC_ACQUIRE);
+    }
+}
+
+/*
+ * _psx_futex_unlock releases a psx_mutex_t, waking a sleeper if
+ * there might be one.
+ */
+__attribute__((visibility ("hidden"))) void _psx_futex_unlock(psx_mutex_t *mu)
+{
+    if (__atomic_exchange_n(mu, 0, __ATOMIC_RELEASE) == 2) {
+	psx_futex(mu, FUTEX_WAKE, 1, NULL);
+    }
+}
+
 /*
  * This global coordinates the PSX mechanism.
  */
 __attribute__((visibility ("hidden"))) psx_tracker_t psx_tracker;
 
-/* psx_mix is our trivial hash mixing for the thread reference map */
-__attribute__((visibility ("hidden"))) long psx_mix(long value) {
-    return value ^ (value >> 7) ^ (value >> 13) ^ (value >> 23);
+/*
+ * psx_now_ns returns the monotonic time in nanoseconds.
+ */
+static unsigned long psx_now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000UL + now.tv_nsec;
 }
 
+/*
+ * psx_hash spreads the (typically dense) thread ids over the thread
+ * reference map. This is the 64-bit finalizer of MurmurHash3.
+ */
+static unsigned long psx_hash(long tid)
+{
+    uint64_t x = (uint64_t) tid;
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    return (unsigned long) x;
+}
+
+/*
+ * psx_set_map replaces the thread reference map with an empty one of
+ * size entries, a power of 2. Only the initial map is allocated
+ * without lock.
+ */
 static void psx_set_map(int size)
 {
+    psx_thread_ref_t *map = calloc(size, sizeof(psx_thread_ref_t));
+    if (map == NULL) {
+	perror("psx map allocation failed");
+	kill(getpid(), SIGKILL);
+    }
+    free(psx_tracker.map);
+    psx_tracker.map = map;
     psx_tracker.map_entries = size;
     psx_tracker.map_mask = size - 1;
-    psx_tracker.map = calloc(psx_tracker.map_entries, sizeof(psx_thread_ref_t));
+    psx_tracker.map_used = 0;
+}
+
+/*
+ * psx_find_slot returns the entry for tid in the current generation
+ * of the map, or the unused entry where it belongs. Called under
+ * lock. The map is never more than 3/4 full, so this terminates.
+ */
+static psx_thread_ref_t *psx_find_slot(long tid)
+{
+    unsigned long i = psx_hash(tid) & psx_tracker.map_mask;
+    for (;; i = (i + 1) & psx_tracker.map_mask) {
+	psx_thread_ref_t *x = &psx_tracker.map[i];
+	if (x->gen != psx_tracker.map_gen || x->tid == tid) {
+	    return x;
+	}
+	if (psx_tracker.stats.enabled) {
+	    psx_tracker.stats.map_collisions++;
+	}
+    }
+}
+
+/*
+ * psx_find_tid returns the entry for tid, or NULL if there is none.
+ * Called under lock.
+ */
+__attribute__((visibility ("hidden"))) psx_thread_ref_t *psx_find_tid(long tid)
+{
+    psx_thread_ref_t *x = psx_find_slot(tid);
+    return x->gen == psx_tracker.map_gen ? x : NULL;
+}
+
+/*
+ * psx_grow_map doubles the size of the map, keeping the entries of
+ * the current generation. Called under lock.
+ */
+static void psx_grow_map(void)
+{
+    psx_thread_ref_t *old = psx_tracker.map;
+    int i, old_entries = psx_tracker.map_entries;
+
+    psx_tracker.map = NULL;
+    psx_set_map(2 * old_entries);
+    if (psx_tracker.stats.enabled) {
+	psx_tracker.stats.map_rehashes++;
+    }
+    for (i = 0; i < old_entries; i++) {
+	psx_thread_ref_t *y = &old[i];
+	if (y->gen == psx_tracker.map_gen) {
+	    *psx_find_slot(y->tid) = *y;
+	    psx_tracker.map_used++;
+	}
+    }
+    free(old);
+}
+
+/*
+ * psx_reset_map starts a new generation of the map, which empties it
+ * without touching its entries. The map is presized to fit at least
+ * expect threads, so it should not need to grow mid-sweep. Called
+ * under lock.
+ */
+static void psx_reset_map(int expect)
+{
+    int size = psx_tracker.map_entries;
+    while (4 * (expect + 1) > 3 * size) {
+	size <<= 1;
+    }
+    if (size != psx_tracker.map_entries) {
+	psx_set_map(size);
+    }
+    psx_tracker.map_used = 0;
+    psx_tracker.map_gen++;
 }
 
 /*
  * Forward declaration
  */
 static void _psx_cleanup(void);
+static void _psx_registry_exit(void *value);
+
+/*
+ * psx_registry_key is used to notice when a registered thread exits.
+ */
+static pthread_key_t psx_registry_key;
 
 #define taskdir_fmt "/proc/%ld/task"
 
@@ -113,9 +279,20 @@ static void _psx_proc_start(void)
 static void _psx_new_proc(void)
 {
     _psx_mu_unlock(&psx_tracker.state_mu);
+    psx_tracker.cond_waiters = 0;
     _psx_proc_start();
+
+    /* The only thread in a fork()ed child has a new tid. */
+    _psx_mu_unlock(&psx_tracker.registry_mu);
+    psx_tracker.registry_count = 0;
+    (void) pthread_setspecific(psx_registry_key, NULL);
 }
 
+/*
+ * Forward declaration
+ */
+static void psx_dump_stats(void);
+
 /*
  * psx_syscall_start initializes the psx subsystem. It is called
  * once and while locked.
@@ -145,8 +322,15 @@ static void psx_syscall_start(void)
      */
     psx_tracker.psx_sig = 33;
     psx_tracker.actions = calloc(2, psx_actions_size());
+    psx_tracker.map_gen = 1;
     psx_set_map(256);
+    (void) pthread_key_create(&psx_registry_key, _psx_registry_exit);
     atexit(_psx_cleanup);
+    const char *stats = getenv("PSX_STATS");
+    if (stats != NULL && *stats != '\0') {
+	psx_tracker.stats.enabled = 1;
+	atexit(psx_dump_stats);
+    }
     pthread_atfork(NULL, NULL, _psx_new_proc);
     psx_tracker.initialized = 1;
 }
@@ -174,13 +358,90 @@ __attribute__((visibility ("hidden"))) void psx_unlock(void)
 }
 
 /*
- * psx_cond_wait unlocks and waits to obtain the lock again, allowing
+ * psx_cond_wait unlocks and sleeps until the next
+ * psx_cond_broadcast() before obtaining the lock again, allowing
  * other code to run that may require the lock. This is the only way
- * the psx code waits like this.
+ * the psx code waits like this. Callers must recheck their condition
+ * since wakeups are not specific to it.
  */
 __attribute__((visibility ("hidden"))) void psx_cond_wait(void)
 {
-    _psx_mu_cond_wait(&psx_tracker.state_mu);
+    int seq = __atomic_load_n(&psx_tracker.state_seq, __ATOMIC_ACQUIRE);
+    psx_tracker.cond_waiters++;
+    psx_unlock();
+    psx_futex(&psx_tracker.state_seq, FUTEX_WAIT, seq, NULL);
+    _psx_mu_lock(&psx_tracker.state_mu);
+    psx_tracker.cond_waiters--;
+}
+
+/*
+ * psx_cond_broadcast is called under lock after changing anything
+ * that psx_cond_wait() callers may be waiting for. A single
+ * FUTEX_WAKE releases all of them.
+ */
+__attribute__((visibility ("hidden"))) void psx_cond_broadcast(void)
+{
+    __atomic_add_fetch(&psx_tracker.state_seq, 1, __ATOMIC_RELEASE);
+    if (psx_tracker.cond_waiters) {
+	psx_futex(&psx_tracker.state_seq, FUTEX_WAKE, INT_MAX, NULL);
+    }
+}
+
+/*
+ * psx_ack is called under lock by the signal handler once a thread
+ * has performed the syscall. The initiator is woken when the last of
+ * the threads it signaled has acknowledged.
+ */
+__attribute__((visibility ("hidden"))) void psx_ack(psx_thread_ref_t *ref)
+{
+    if (psx_tracker.stats.enabled) {
+	unsigned long latency = psx_now_ns() - ref->sent_ns;
+	int bucket = 63 - __builtin_clzl(latency | 1);
+	psx_tracker.stats.ack_hist[bucket]++;
+	psx_tracker.stats.ack_count++;
+	if (latency > psx_tracker.stats.ack_max_ns) {
+	    psx_tracker.stats.ack_max_ns = latency;
+	}
+    }
+    int acks = __atomic_add_fetch(&psx_tracker.acks, 1, __ATOMIC_RELEASE);
+    if (acks == psx_tracker.ack_target) {
+	psx_futex(&psx_tracker.acks, FUTEX_WAKE, 1, NULL);
+    }
+}
+
+/*
+ * psx_await_release is called, without lock, by the signal handler
+ * once its thread has acknowledged the syscall. The thread sleeps
+ * until the initiator has finished signaling all of the threads.
+ * The last thread to be released wakes the initiator. Neither side
+ * needs the lock for this, so a single FUTEX_WAKE of
+ * psx_tracker.cmd.active releases every thread without contention.
+ */
+__attribute__((visibility ("hidden"))) void psx_await_release(void)
+{
+    while (__atomic_load_n(&psx_tracker.cmd.active, __ATOMIC_ACQUIRE)) {
+	psx_futex(&psx_tracker.cmd.active, FUTEX_WAIT, 1, NULL);
+    }
+    if (__atomic_sub_fetch(&psx_tracker.incomplete, 1, __ATOMIC_RELEASE) == 0) {
+	psx_futex(&psx_tracker.incomplete, FUTEX_WAKE, 1, NULL);
+    }
+}
+
+/*
+ * psx_await_acks sleeps until all of the signaled threads have
+ * acknowledged the syscall, or a short timeout expires. The timeout
+ * covers signaled threads that exit before acknowledging.
+ */
+static void psx_await_acks(void)
+{
+    struct timespec timeout = { .tv_sec = 0, .tv_nsec = 1000000 };
+    psx_lock();
+    int acks = psx_tracker.acks;
+    int done = acks >= psx_tracker.ack_target;
+    psx_unlock();
+    if (!done) {
+	psx_futex(&psx_tracker.acks, FUTEX_WAIT, acks, &timeout);
+    }
 }
 
 /*
@@ -197,10 +458,111 @@ static void _psx_cleanup(void) {
 	psx_cond_wait();
     }
     psx_tracker.state = _PSX_EXITING;
+    psx_cond_broadcast();
     free(psx_tracker.actions);
     free(psx_tracker.map);
     free(psx_tracker.pid_path);
     psx_unlock();
+
+    _psx_mu_lock(&psx_tracker.registry_mu);
+    free(psx_tracker.registry);
+    psx_tracker.registry = NULL;
+    psx_tracker.registry_count = 0;
+    psx_tracker.registry_size = 0;
+    _psx_mu_unlock(&psx_tracker.registry_mu);
+}
+
+/*
+ * _psx_registry_remove drops tid from the registry, if present.
+ */
+static void _psx_registry_remove(long tid)
+{
+    int i;
+    _psx_mu_lock(&psx_tracker.registry_mu);
+    for (i = 0; i < psx_tracker.registry_count; i++) {
+	if (psx_tracker.registry[i] == tid) {
+	    psx_tracker.registry[i] =
+		psx_tracker.registry[--psx_tracker.registry_count];
+	    break;
+	}
+    }
+    _psx_mu_unlock(&psx_tracker.registry_mu);
+}
+
+/*
+ * _psx_registry_exit is the pthread key destructor that runs when a
+ * registered thread exits.
+ */
+static void _psx_registry_exit(void *value)
+{
+    _psx_registry_remove(_psx_gettid());
+}
+
+/*
+ * psx_register_thread adds the calling thread to the registry of
+ * threads that psx_syscall() signals directly, without first having
+ * to discover them via /proc/<pid>/task. The thread is automatically
+ * removed from the registry when it exits via pthread_exit() or by
+ * returning from its start routine. Registering is optional: it only
+ * makes psx_syscall() faster in processes with many threads. The
+ * function returns 0 on success and -1 (with errno set) on failure.
+ */
+int psx_register_thread(void)
+{
+    long tid = _psx_gettid();
+
+    /* make sure psx_registry_key is initialized */
+    psx_lock();
+    psx_unlock();
+
+    if (pthread_getspecific(psx_registry_key) != NULL) {
+	return 0;
+    }
+
+    _psx_mu_lock(&psx_tracker.registry_mu);
+    if (psx_tracker.registry_count == psx_tracker.registry_size) {
+	int size = psx_tracker.registry_size ? 2*psx_tracker.registry_size : 64;
+	long *registry = calloc(size, sizeof(long));
+	if (registry == NULL) {
+	    _psx_mu_unlock(&psx_tracker.registry_mu);
+	    errno = ENOMEM;
+	    return -1;
+	}
+	if (psx_tracker.registry != NULL) {
+	    memcpy(registry, psx_tracker.registry,
+		   psx_tracker.registry_count*sizeof(long));
+	    free(psx_tracker.registry);
+	}
+	psx_tracker.registry = registry;
+	psx_tracker.registry_size = size;
+    }
+    psx_tracker.registry[psx_tracker.registry_count++] = tid;
+    _psx_mu_unlock(&psx_tracker.registry_mu);
+
+    int err = pthread_setspecific(psx_registry_key, (void *) 1);
+    if (err) {
+	_psx_registry_remove(tid);
+	errno = err;
+	return -1;
+    }
+    return 0;
+}
+
+/*
+ * psx_unregister_thread removes the calling thread from the registry.
+ * A thread need only call this if it intends to exit without running
+ * its pthread key destructors.
+ */
+void psx_unregister_thread(void)
+{
+    psx_lock();
+    psx_unlock();
+
+    if (pthread_getspecific(psx_registry_key) == NULL) {
+	return;
+    }
+    (void) pthread_setspecific(psx_registry_key, NULL);
+    _psx_registry_remove(_psx_gettid());
 }
 
 /*
@@ -215,6 +577,7 @@ static void psx_new_state(psx_tracker_state_t was, psx_tracker_state_t is)
 	psx_cond_wait();
     }
     psx_tracker.state = is;
+    psx_cond_broadcast();
     psx_unlock();
 }
 
@@ -285,59 +648,173 @@ struct psx_linux_dirent64 {
 };
 
 /*
- * __psx_syscall performs the syscall on the current thread and if no
- * error is detected it ensures that the syscall is also performed on
- * all (other) registered threads. The return code is the value for
- * the first invocation. It uses a trick to figure out how many
- * arguments the user has supplied. The other half of the trick is
- * provided by the macro psx_syscall() in the <sys/psx_syscall.h>
- * file. The trick is the 7th optional argument (8th over all) to
- * __psx_syscall is the count of arguments supplied to psx_syscall.
- *
- * User:
- *                       psx_syscall(nr, a, b);
- * Expanded by macro to:
- *                       __psx_syscall(nr, a, b, 6, 5, 4, 3, 2, 1, 0);
- * The eighth arg is now ------------------------------------^
+ * psx_visit_tid records tid in the thread reference map for this
+ * sweep. If tid is newly seen it is signaled to perform the pending
+ * syscall. The function returns NULL if the thread has exited before
+ * it could be signaled.
  */
-long int __psx_syscall(long int syscall_nr, ...) {
-    long int arg[7];
-    long i;
-
-    va_list aptr;
-    va_start(aptr, syscall_nr);
-    for (i = 0; i < 7; i++) {
-	arg[i] = va_arg(aptr, long int);
+static psx_thread_ref_t *psx_visit_tid(long tid, long sweep)
+{
+    psx_lock();
+    psx_thread_ref_t *x = psx_find_slot(tid);
+    if (x->gen == psx_tracker.map_gen && x->pending != _PSX_REF_GONE) {
+	psx_unlock();
+	return x;
     }
-    va_end(aptr);
-
-    int count = arg[6];
-    if (count < 0 || count > 6) {
-	errno = EINVAL;
-	return -1;
+    if (x->gen != psx_tracker.map_gen) {
+	if (4 * (psx_tracker.map_used + 1) > 3 * psx_tracker.map_entries) {
+	    psx_grow_map();
+	    x = psx_find_slot(tid);
+	}
+	psx_tracker.map_used++;
+	x->gen = psx_tracker.map_gen;
+	x->tid = tid;
     }
+    /*
+     * A new entry - this is where we will also (first) enable the PSX
+     * parts of our installed handler. This is, potentially racing
+     * with other users of the same signal, so we do this under lock.
+     */
+    x->pending = 1;
+    x->sweep = sweep;
+    if (psx_tracker.stats.enabled) {
+	x->sent_ns = psx_now_ns();
+    }
+    psx_tracker.cmd.active = 1;
+    psx_unlock();
+    /*
+     * There is a small chance that this signal may be racing with
+     * another user of this signal. Locking above should ensure both
+     * forks of the handler get invoked - perhaps out of order
+     * though... We use tgkill() so a recycled tid can never redirect
+     * this signal to some other process.
+     *
+     * Only this (the initiating) thread ever grows the map, so x
+     * remains valid here.
+     */
+    if (syscall(SYS_tgkill, psx_tracker.pid, tid, psx_tracker.psx_sig)) {
+	psx_lock();
+	x->pending = _PSX_REF_GONE;
+	psx_unlock();
+	return NULL;
+    }
+    psx_lock();
+    psx_tracker.ack_target++;
+    if (psx_tracker.stats.enabled) {
+	psx_tracker.stats.threads_signaled++;
+    }
+    psx_unlock();
+    return x;
+}
 
-    psx_new_state(_PSX_IDLE, _PSX_SETUP);
-    psx_confirm_sigaction();
+/*
+ * psx_signal_registered signals every registered thread and waits
+ * for each of them to perform the pending syscall. Registered threads
+ * that have meanwhile exited are skipped. The registry lock is held
+ * throughout, so no registered thread can be blocked waiting for the
+ * syscall while holding it. The function returns the number of
+ * threads signaled this way.
+ */
+static int psx_signal_registered(long self, long exclude, long sweep)
+{
+    int i, signaled = 0, some;
 
-    long int ret = __psx_immediate_syscall(syscall_nr, count, arg);
-    if (ret == -1) {
-	psx_new_state(_PSX_SETUP, _PSX_IDLE);
-	goto defer;
+    _psx_mu_lock(&psx_tracker.registry_mu);
+    for (i = 0; i < psx_tracker.registry_count; i++) {
+	long tid = psx_tracker.registry[i];
+	if (tid == self || tid == exclude) {
+	    continue;
+	}
+	psx_thread_ref_t *x = psx_visit_tid(tid, sweep);
+	if (x != NULL) {
+	    psx_lock();
+	    x->sweep = sweep;
+	    psx_unlock();
+	    signaled++;
+	}
     }
+    for (some = signaled; some; ) {
+	psx_await_acks();
+	some = 0;
+	for (i = 0; i < psx_tracker.registry_count; i++) {
+	    long tid = psx_tracker.registry[i];
+	    if (tid == self || tid == exclude) {
+		continue;
+	    }
+	    psx_lock();
+	    psx_thread_ref_t *x = psx_find_tid(tid);
+	    int pending = (x != NULL) && (x->pending == 1);
+	    psx_unlock();
+	    if (!pending) {
+		continue;
+	    }
+	    if (syscall(SYS_tgkill, psx_tracker.pid, tid, 0)) {
+		/* this thread exited without acknowledging */
+		psx_lock();
+		x->pending = _PSX_REF_GONE;
+		psx_tracker.ack_target--;
+		psx_unlock();
+		continue;
+	    }
+	    some++;
+	}
+    }
+    _psx_mu_unlock(&psx_tracker.registry_mu);
+
+    return signaled;
+}
+
+/*
+ * psx_async_s holds the state of a psx_syscall_async() broadcast.
+ */
+struct psx_async_s {
+    int fd;
+    int error;
+    int done;
+    int helped;
+    int count;
+    long caller;
+    long int retval;
+    pthread_t helper;
+    psx_thread_result_t *results;
+};
+
+/*
+ * psx_broadcast has all of the other threads of the process perform
+ * the command already performed by the thread that obtained the
+ * result, ret. When async is non-NULL, that thread is async->caller
+ * and is not the current one, and the per-thread results are saved
+ * in async. It is called in the _PSX_SETUP state and returns in the
+ * _PSX_IDLE state. errno is not preserved.
+ */
+static void psx_broadcast(long int ret, psx_async_t *async)
+{
+    long i;
+    unsigned long started = psx_tracker.stats.enabled ? psx_now_ns() : 0;
 
-    int restore_errno = errno;
     psx_new_state(_PSX_SETUP, _PSX_SYSCALL);
 
     /*
-     * cleaning up before we start helps a fork()ed child not inherit
-     * confusion from its parent.
+     * Starting a new generation of the map before we start helps a
+     * fork()ed child not inherit confusion from its parent. The map
+     * is sized for the larger of the last broadcast and the registry.
      */
-    memset(psx_tracker.map, 0,
-	   psx_tracker.map_entries*sizeof(psx_thread_ref_t));
+    psx_lock();
+    psx_reset_map(psx_tracker.map_used > psx_tracker.registry_count ?
+		  psx_tracker.map_used : psx_tracker.registry_count);
+    psx_tracker.acks = 0;
+    psx_tracker.ack_target = 0;
+    psx_unlock();
 
-    long self = _psx_gettid(), sweep = 1;
-    int some, incomplete, mismatch = 0, verified = 0;
+    /*
+     * Registered threads are signaled without consulting procfs. If
+     * there were any, a single clean sweep of /proc/<pid>/task then
+     * suffices to confirm that no unregistered threads remain.
+     */
+    long self = _psx_gettid(), sweep = 2;
+    long exclude = async ? async->caller : 0;
+    int some, incomplete, mismatch = 0;
+    int verified = psx_signal_registered(self, exclude, sweep) ? 1 : 0;
     do {
 	incomplete = 0;  /* count threads to return from signal handler */
 	some = 0;        /* count threads still pending */
@@ -370,66 +847,12 @@ long int __psx_syscall(long int syscall_nr, ...) {
 		char *dir = (buf + offset +
 			     offsetof(struct psx_linux_dirent64, d_name));
 		long tid = atoi(dir);
-		if (tid == 0 || tid == self) {
+		if (tid == 0 || tid == self || tid == exclude) {
 		    continue;
 		}
-		long mix = psx_mix(tid);
-		psx_thread_ref_t *x =
-		    &psx_tracker.map[mix & psx_tracker.map_mask];
-		if (x->tid != tid) {
-		    if (x->tid != 0) {
-			/* a collision */
-			long entries = psx_tracker.map_entries;
-			long oval, mask;
-			for (oval = psx_mix(x->tid); ; entries <<= 1) {
-			    mask = entries - 1;
-			    if (((oval ^ mix) & mask) != 0) {
-				/* no more collisions */
-				break;
-			    }
-			}
-			psx_thread_ref_t *old = psx_tracker.map;
-			long old_entries = psx_tracker.map_entries;
-			psx_lock();
-			psx_set_map(entries);
-			long ok_sweep = sweep - 1;
-			for (i = 0; i < old_entries; i++) {
-			    psx_thread_ref_t *y = &old[i];
-			    if (y->sweep < ok_sweep) {
-				/* no longer care about this entry */
-				continue;
-			    }
-			    psx_thread_ref_t *z =
-				&psx_tracker.map[psx_mix(y->tid) & mask];
-			    z->tid = y->tid;
-			    z->pending = y->pending;
-			    z->retval = y->retval;
-			    z->sweep = y->sweep;
-			}
-			psx_unlock();
-			free(old);
-			x = &psx_tracker.map[mix & mask];
-		    }
-		    /*
-		     * A new entry - this is where we will also
-		     * (first) enable the PSX parts of our installed
-		     * handler. This is, potentially racing with other
-		     * users of the same signal, so we do this under
-		     * lock.
-		     */
-		    psx_lock();
-		    x->pending = 1;
-		    x->tid = tid;
-		    psx_tracker.cmd.active = 1;
-		    psx_unlock();
-		    /*
-		     * There is a small chance that this signal may be
-		     * racing with another user of this signal.
-		     * Locking above should ensure both forks of the
-		     * handler get invoked - perhaps out of order
-		     * though...
-		     */
-		    syscall(SYS_tkill, tid, psx_tracker.psx_sig);
+		psx_thread_ref_t *x = psx_visit_tid(tid, sweep);
+		if (x == NULL) {
+		    continue;
 		}
 		psx_lock();
 		x->sweep = sweep;
@@ -445,19 +868,47 @@ long int __psx_syscall(long int syscall_nr, ...) {
 	close(fd);
 	if (some) {
 	    verified = 0;
-	    sched_yield();
+	    psx_await_acks();
 	} else {
 	    verified++;
 	}
     } while (verified < 2);
 
+    /*
+     * Release all of the threads blocked in psx_await_release() and
+     * wait for the last of them to leave.
+     */
+    int performed = incomplete;
     psx_lock();
-    psx_tracker.incomplete = incomplete;
-    psx_tracker.cmd.active = 0;
-    while (psx_tracker.incomplete != 0) {
-	psx_cond_wait();
-    }
+    __atomic_store_n(&psx_tracker.incomplete, incomplete, __ATOMIC_RELAXED);
+    __atomic_store_n(&psx_tracker.cmd.active, 0, __ATOMIC_RELEASE);
+    psx_futex(&psx_tracker.cmd.active, FUTEX_WAKE, INT_MAX, NULL);
     psx_unlock();
+    while ((incomplete = __atomic_load_n(&psx_tracker.incomplete,
+					 __ATOMIC_ACQUIRE)) != 0) {
+	psx_futex(&psx_tracker.incomplete, FUTEX_WAIT, incomplete, NULL);
+    }
+
+    /*
+     * Only now that no thread is parked in the signal handler, and so
+     * none can be holding a malloc lock, is it safe to allocate. The
+     * map is stable until the next broadcast, which cannot start
+     * before this one returns to the _PSX_IDLE state.
+     */
+    if (async != NULL) {
+	async->results = calloc(performed ? performed : 1,
+				sizeof(psx_thread_result_t));
+	if (async->results != NULL) {
+	    for (i = 0; i < psx_tracker.map_entries; i++) {
+		psx_thread_ref_t *ref = &psx_tracker.map[i];
+		if (ref->gen == psx_tracker.map_gen && ref->sweep == sweep &&
+		    async->count < performed) {
+		    async->results[async->count].tid = ref->tid;
+		    async->results[async->count++].retval = ref->retval;
+		}
+	    }
+	}
+    }
 
     if (mismatch) {
 	psx_lock();
@@ -466,7 +917,16 @@ long int __psx_syscall(long int syscall_nr, ...) {
 	    break;
 	default:
 	    fprintf(stderr, "psx_syscall result differs.\n");
-	    if (psx_tracker.cmd.six) {
+	    if (psx_tracker.cmd.batch != NULL) {
+		int j;
+		for (j = 0; j < psx_tracker.cmd.batch_count; j++) {
+		    const psx_call_t *c = &psx_tracker.cmd.batch[j];
+		    fprintf(stderr,
+			    "trap[%d]:%ld a123456=[%ld,%ld,%ld,%ld,%ld,%ld]\n",
+			    j, c->syscall_nr, c->arg[0], c->arg[1], c->arg[2],
+			    c->arg[3], c->arg[4], c->arg[5]);
+		}
+	    } else if (psx_tracker.cmd.six) {
 		fprintf(stderr, "trap:%ld a123456=[%ld,%ld,%ld,%ld,%ld,%ld]\n",
 			psx_tracker.cmd.syscall_nr,
 			psx_tracker.cmd.arg1,
@@ -485,7 +945,7 @@ long int __psx_syscall(long int syscall_nr, ...) {
 	    fprintf(stderr, "results:");
 	    for (i=0; i < psx_tracker.map_entries; i++) {
 		psx_thread_ref_t *ref = &psx_tracker.map[i];
-		if (ref->sweep != sweep) {
+		if (ref->gen != psx_tracker.map_gen || ref->sweep != sweep) {
 		    continue;
 		}
 		if (ret != ref->retval) {
@@ -500,13 +960,283 @@ long int __psx_syscall(long int syscall_nr, ...) {
 	}
 	psx_unlock();
     }
-    errno = restore_errno;
+    if (started) {
+	unsigned long sweeps = sweep - 2;
+	unsigned long elapsed = psx_now_ns() - started;
+	psx_lock();
+	psx_tracker.stats.broadcasts++;
+	psx_tracker.stats.sweeps += sweeps;
+	if (sweeps > psx_tracker.stats.max_sweeps) {
+	    psx_tracker.stats.max_sweeps = sweeps;
+	}
+	psx_tracker.stats.broadcast_total_ns += elapsed;
+	if (elapsed > psx_tracker.stats.broadcast_max_ns) {
+	    psx_tracker.stats.broadcast_max_ns = elapsed;
+	}
+	psx_unlock();
+    }
+
     psx_new_state(_PSX_SYSCALL, _PSX_IDLE);
+}
+
+/*
+ * __psx_syscall performs the syscall on the current thread and if no
+ * error is detected it ensures that the syscall is also performed on
+ * all (other) registered threads. The return code is the value for
+ * the first invocation. It uses a trick to figure out how many
+ * arguments the user has supplied. The other half of the trick is
+ * provided by the macro psx_syscall() in the <sys/psx_syscall.h>
+ * file. The trick is the 7th optional argument (8th over all) to
+ * __psx_syscall is the count of arguments supplied to psx_syscall.
+ *
+ * User:
+ *                       psx_syscall(nr, a, b);
+ * Expanded by macro to:
+ *                       __psx_syscall(nr, a, b, 6, 5, 4, 3, 2, 1, 0);
+ * The eighth arg is now ------------------------------------^
+ */
+long int __psx_syscall(long int syscall_nr, ...) {
+    long int arg[7];
+    long i;
+
+    va_list aptr;
+    va_start(aptr, syscall_nr);
+    for (i = 0; i < 7; i++) {
+	arg[i] = va_arg(aptr, long int);
+    }
+    va_end(aptr);
+
+    int count = arg[6];
+    if (count < 0 || count > 6) {
+	errno = EINVAL;
+	return -1;
+    }
+
+    psx_new_state(_PSX_IDLE, _PSX_SETUP);
+    psx_confirm_sigaction();
+
+    psx_tracker.cmd.batch = NULL;
+    long int ret = __psx_immediate_syscall(syscall_nr, count, arg);
+    if (ret == -1) {
+	psx_new_state(_PSX_SETUP, _PSX_IDLE);
+	goto defer;
+    }
+
+    int restore_errno = errno;
+    psx_broadcast(ret, NULL);
+    errno = restore_errno;
 
 defer:
     return ret;
 }
 
+/*
+ * psx_run_batch performs a sequence of system calls on the current
+ * thread, stopping at the first one that fails. It returns the
+ * number of calls that succeeded.
+ */
+__attribute__((visibility ("hidden"))) long int psx_run_batch(
+    const psx_call_t *calls, int n)
+{
+    int i;
+    for (i = 0; i < n; i++) {
+	const psx_call_t *c = &calls[i];
+	if (syscall(c->syscall_nr, c->arg[0], c->arg[1], c->arg[2],
+		    c->arg[3], c->arg[4], c->arg[5]) == -1) {
+	    break;
+	}
+    }
+    return i;
+}
+
+/*
+ * psx_syscall_batch performs a sequence of system calls with POSIX
+ * semantics. The calls are performed in order on the current thread
+ * until one fails. Those that succeeded are then performed, again in
+ * order, by all of the other threads in a single signal delivery per
+ * thread. The return value is the number of calls that succeeded. If
+ * this is less than n, errno holds the error of the failed call.
+ */
+int psx_syscall_batch(const psx_call_t *calls, int n)
+{
+    if (n < 0 || (n != 0 && calls == NULL)) {
+	errno = EINVAL;
+	return -1;
+    }
+    if (n == 0) {
+	return 0;
+    }
+
+    psx_new_state(_PSX_IDLE, _PSX_SETUP);
+    psx_confirm_sigaction();
+
+    int done = psx_run_batch(calls, n);
+    int restore_errno = errno;
+    if (done == 0) {
+	psx_new_state(_PSX_SETUP, _PSX_IDLE);
+    } else {
+	psx_tracker.cmd.batch = calls;
+	psx_tracker.cmd.batch_count = done;
+	psx_broadcast(done, NULL);
+    }
+    errno = restore_errno;
+
+    return done;
+}
+
+/*
+ * psx_load_syscall_batch is the batch counterpart to
+ * psx_load_syscalls(). It lets a library, like libcap, weakly
+ * discover psx_syscall_batch().
+ */
+void psx_load_syscall_batch(int (**batch_fn)(const psx_call_t *calls, int n))
+{
+    *batch_fn = psx_syscall_batch;
+}
+
+/*
+ * psx_async_complete marks an asynchronous broadcast as complete and
+ * makes its eventfd readable.
+ */
+static void psx_async_complete(psx_async_t *async)
+{
+    uint64_t one = 1;
+    __atomic_store_n(&async->done, 1, __ATOMIC_RELEASE);
+    while (write(async->fd, &one, sizeof(one)) == -1 && errno == EINTR);
+}
+
+/*
+ * psx_async_helper performs the broadcast part of a
+ * psx_syscall_async() call on behalf of the caller.
+ */
+static void *psx_async_helper(void *data)
+{
+    psx_async_t *async = data;
+    psx_broadcast(async->retval, async);
+    psx_async_complete(async);
+    return NULL;
+}
+
+/*
+ * psx_syscall_async performs the system call on the current thread
+ * and then returns without waiting for the other threads to perform
+ * it. That is done by a helper thread. While the broadcast is in
+ * progress other psx_syscall*() calls will block. The returned
+ * handle must be released with psx_async_free(). NULL is returned if
+ * call is NULL, or no handle can be allocated.
+ */
+psx_async_t *psx_syscall_async(const psx_call_t *call)
+{
+    if (call == NULL) {
+	errno = EINVAL;
+	return NULL;
+    }
+    psx_async_t *async = calloc(1, sizeof(psx_async_t));
+    if (async == NULL) {
+	return NULL;
+    }
+    async->fd = eventfd(0, EFD_CLOEXEC);
+    if (async->fd == -1) {
+	free(async);
+	return NULL;
+    }
+    async->caller = _psx_gettid();
+
+    psx_new_state(_PSX_IDLE, _PSX_SETUP);
+    psx_confirm_sigaction();
+
+    long int arg[6];
+    memcpy(arg, call->arg, sizeof(arg));
+    psx_tracker.cmd.batch = NULL;
+    async->retval = __psx_immediate_syscall(call->syscall_nr, 6, arg);
+    if (async->retval == -1) {
+	async->error = errno;
+	psx_new_state(_PSX_SETUP, _PSX_IDLE);
+	psx_async_complete(async);
+	return async;
+    }
+
+    int restore_errno = errno;
+    if (pthread_create(&async->helper, NULL, psx_async_helper, async) == 0) {
+	async->helped = 1;
+    } else {
+	/* no helper, so we do the work synchronously */
+	async->caller = 0;
+	psx_broadcast(async->retval, async);
+	psx_async_complete(async);
+    }
+    errno = restore_errno;
+
+    return async;
+}
+
+/*
+ * psx_async_fd returns a file descriptor that becomes readable (see
+ * poll(2)) when the broadcast is complete.
+ */
+int psx_async_fd(const psx_async_t *async)
+{
+    return async->fd;
+}
+
+/*
+ * psx_async_done returns 1 if the broadcast is complete, 0 otherwise.
+ */
+int psx_async_done(const psx_async_t *async)
+{
+    return __atomic_load_n(&async->done, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * psx_async_wait waits for the broadcast to complete and returns the
+ * result of the system call on the calling thread. If that failed, -1
+ * is returned and errno is set.
+ */
+long int psx_async_wait(psx_async_t *async)
+{
+    if (async->helped) {
+	pthread_join(async->helper, NULL);
+	async->helped = 0;
+    }
+    if (async->retval == -1) {
+	errno = async->error;
+    }
+    return async->retval;
+}
+
+/*
+ * psx_async_results waits for the broadcast to complete and then
+ * copies up to max per-thread results into results. The returned
+ * value is the number of other threads that performed the syscall.
+ */
+int psx_async_results(psx_async_t *async, psx_thread_result_t *results,
+		      int max)
+{
+    int i;
+    (void) psx_async_wait(async);
+    for (i = 0; i < async->count && i < max; i++) {
+	results[i] = async->results[i];
+    }
+    return async->count;
+}
+
+/*
+ * psx_async_free waits for the broadcast to complete and then
+ * releases all the resources of the handle.
+ */
+void psx_async_free(psx_async_t *async)
+{
+    if (async == NULL) {
+	return;
+    }
+    (void) psx_async_wait(async);
+    close(async->fd);
+    free(async->results);
+    memset(async, 0, sizeof(*async));
+    free(async);
+}
+
+
 /*
  * Change the PSX sensitivity level. If the threads appear to have
  * diverged in behavior, this can cause the library to notify the
@@ -523,6 +1253,98 @@ int psx_set_sensitivity(psx_sensitivity_t level) {
     return 0;
 }
 
+/*
+ * psx_enable_stats turns the collection of psx_stats_t values on
+ * (enable != 0) or off.
+ */
+void psx_enable_stats(int enable)
+{
+    psx_lock();
+    psx_tracker.stats.enabled = (enable != 0);
+    psx_unlock();
+}
+
+/*
+ * psx_ack_percentile returns an upper bound for the ack latency of
+ * the given percentile.
+ */
+static unsigned long psx_ack_percentile(int percent)
+{
+    unsigned long seen = 0;
+    unsigned long want = (psx_tracker.stats.ack_count * percent + 99) / 100;
+    int i;
+
+    if (want == 0) {
+	return 0;
+    }
+    for (i = 0; i < _PSX_ACK_BUCKETS - 1; i++) {
+	seen += psx_tracker.stats.ack_hist[i];
+	if (seen >= want) {
+	    unsigned long bound = (2UL << i) - 1;
+	    return bound < psx_tracker.stats.ack_max_ns ?
+		bound : psx_tracker.stats.ack_max_ns;
+	}
+    }
+    return psx_tracker.stats.ack_max_ns;
+}
+
+/*
+ * psx_get_stats copies the current psx statistics into *stats. It
+ * returns 0 on success and -1 if stats is NULL.
+ */
+int psx_get_stats(psx_stats_t *stats)
+{
+    if (stats == NULL) {
+	errno = EINVAL;
+	return -1;
+    }
+    psx_lock();
+    stats->broadcasts = psx_tracker.stats.broadcasts;
+    stats->sweeps = psx_tracker.stats.sweeps;
+    stats->max_sweeps = psx_tracker.stats.max_sweeps;
+    stats->threads_signaled = psx_tracker.stats.threads_signaled;
+    stats->map_collisions = psx_tracker.stats.map_collisions;
+    stats->map_rehashes = psx_tracker.stats.map_rehashes;
+    stats->broadcast_max_ns = psx_tracker.stats.broadcast_max_ns;
+    stats->broadcast_total_ns = psx_tracker.stats.broadcast_total_ns;
+    stats->ack_max_ns = psx_tracker.stats.ack_max_ns;
+    stats->ack_p50_ns = psx_ack_percentile(50);
+    stats->ack_p99_ns = psx_ack_percentile(99);
+    psx_unlock();
+    return 0;
+}
+
+/*
+ * psx_reset_stats zeros the psx statistics.
+ */
+void psx_reset_stats(void)
+{
+    psx_lock();
+    int enabled = psx_tracker.stats.enabled;
+    memset(&psx_tracker.stats, 0, sizeof(psx_tracker.stats));
+    psx_tracker.stats.enabled = enabled;
+    psx_unlock();
+}
+
+/*
+ * psx_dump_stats is called at exit when PSX_STATS is set.
+ */
+static void psx_dump_stats(void)
+{
+    psx_stats_t stats;
+    if (psx_get_stats(&stats)) {
+	return;
+    }
+    fprintf(stderr, "psx[%d]: broadcasts=%lu sweeps=%lu max_sweeps=%lu"
+	    " signaled=%lu collisions=%lu rehashes=%lu\n",
+	    getpid(), stats.broadcasts, stats.sweeps, stats.max_sweeps,
+	    stats.threads_signaled, stats.map_collisions, stats.map_rehashes);
+    fprintf(stderr, "psx[%d]: broadcast max=%luns total=%luns;"
+	    " ack max=%luns p50<=%luns p99<=%luns\n",
+	    getpid(), stats.broadcast_max_ns, stats.broadcast_total_ns,
+	    stats.ack_max_ns, stats.ack_p50_ns, stats.ack_p99_ns);
+}
+
 /*
  * The following is required for legacy linkage libcap-2.71 and
  * earlier backward compatibility. The Go use of psx no longer has any
@@ -543,15 +1365,47 @@ extern int __real_pthread_create(pthread_t *thread, const pthread_attr_t *attr,
 int __wrap_pthread_create(pthread_t *thread, const pthread_attr_t *attr,
 			  void *(*start_routine) (void *), void *arg);
 
+/*
+ * psx_starter_t carries the real start routine for a wrapped thread.
+ */
+typedef struct {
+    void *(*fn)(void *);
+    void *arg;
+} psx_starter_t;
+
+/*
+ * _psx_start_thread registers the newly started thread with psx
+ * before running its real start routine.
+ */
+static void *_psx_start_thread(void *data)
+{
+    psx_starter_t starter = *(psx_starter_t *) data;
+    free(data);
+    (void) psx_register_thread();
+    return starter.fn(starter.arg);
+}
+
 /*
  * __wrap_pthread_create is defined for legacy reasons, since whether
  * or not you use this wrapper to reach the __real_ functionality or
  * not isn't important to the psx mechanism any longer (since
- * libpsx-2.72).
+ * libpsx-2.72). However, threads created this way are automatically
+ * registered (see psx_register_thread()) which speeds up
+ * psx_syscall().
  */
 int __wrap_pthread_create(pthread_t *thread, const pthread_attr_t *attr,
                          void *(*start_routine) (void *), void *arg) {
-    return __real_pthread_create(thread, attr, start_routine, arg);
+    psx_starter_t *starter = calloc(1, sizeof(psx_starter_t));
+    if (starter == NULL) {
+	return __real_pthread_create(thread, attr, start_routine, arg);
+    }
+    starter->fn = start_routine;
+    starter->arg = arg;
+    int ret = __real_pthread_create(thread, attr, _psx_start_thread, starter);
+    if (ret) {
+	free(starter);
+    }
+    return ret;
 }
 
 #endif /* _LIBPSX_PTHREAD_LINKAGE def */
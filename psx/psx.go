@@ -3,11 +3,62 @@
 
 package psx // import "kernel.org/pub/linux/libs/security/libcap/psx"
 
-import "syscall"
+import (
+	"os"
+	"sync"
+	"syscall"
+	"time"
+)
 
 // Documentation for these functions are provided in the psx_cgo.go
 // file.
 
+var (
+	statsMu      sync.Mutex
+	statsEnabled = os.Getenv("PSX_STATS") != ""
+	stats        Stats
+)
+
+func EnableStats(enable bool) {
+	statsMu.Lock()
+	defer statsMu.Unlock()
+	statsEnabled = enable
+}
+
+func ResetStats() {
+	statsMu.Lock()
+	defer statsMu.Unlock()
+	stats = Stats{}
+}
+
+func GetStats() Stats {
+	statsMu.Lock()
+	defer statsMu.Unlock()
+	return stats
+}
+
+// timed returns a function to record the duration of a broadcast if
+// statistics are being collected.
+func timed() func() {
+	statsMu.Lock()
+	enabled := statsEnabled
+	statsMu.Unlock()
+	if !enabled {
+		return func() {}
+	}
+	start := time.Now()
+	return func() {
+		d := time.Since(start)
+		statsMu.Lock()
+		defer statsMu.Unlock()
+		stats.Broadcasts++
+		stats.BroadcastTotal += d
+		if d > stats.BroadcastMax {
+			stats.BroadcastMax = d
+		}
+	}
+}
+
 //go:uintptrescapes
 
 // Syscall3 performs a 3 argument syscall.  Syscall3 differs from
@@ -21,6 +72,7 @@ import "syscall"
 // If CGO_ENABLED=0 it redirects to the go1.16+
 // syscall.AllThreadsSyscall() function.
 func Syscall3(syscallnr, arg1, arg2, arg3 uintptr) (uintptr, uintptr, syscall.Errno) {
+	defer timed()()
 	return syscall.AllThreadsSyscall(syscallnr, arg1, arg2, arg3)
 }
 
@@ -31,5 +83,6 @@ func Syscall3(syscallnr, arg1, arg2, arg3 uintptr) (uintptr, uintptr, syscall.Er
 // arguments, its behavior is identical to that of Syscall3() - see
 // above for the full documentation.
 func Syscall6(syscallnr, arg1, arg2, arg3, arg4, arg5, arg6 uintptr) (uintptr, uintptr, syscall.Errno) {
+	defer timed()()
 	return syscall.AllThreadsSyscall6(syscallnr, arg1, arg2, arg3, arg4, arg5, arg6)
 }
@@ -211,7 +211,10 @@ static void psx_posix_syscall_actor(int signum, siginfo_t *info, void *ignore) {
     psx_unlock();
 
     long int retval;
-    if (!psx_tracker.cmd.six) {
+    if (psx_tracker.cmd.batch != NULL) {
+	retval = psx_run_batch(psx_tracker.cmd.batch,
+			       psx_tracker.cmd.batch_count);
+    } else if (!psx_tracker.cmd.six) {
 	retval = syscall(psx_tracker.cmd.syscall_nr,
 			 psx_tracker.cmd.arg1,
 			 psx_tracker.cmd.arg2,
@@ -232,10 +235,12 @@ static void psx_posix_syscall_actor(int signum, siginfo_t *info, void *ignore) {
      */
     long tid = _psx_gettid();
     psx_lock();
-    psx_thread_ref_t *ref =
-	&psx_tracker.map[psx_mix(tid) & psx_tracker.map_mask];
-    ref->retval = retval;
-    ref->pending = 0;
+    psx_thread_ref_t *ref = psx_find_tid(tid);
+    if (ref != NULL) {
+	ref->retval = retval;
+	ref->pending = 0;
+	psx_ack(ref);
+    }
     /*
      * Block this thread until all threads have been interrupted.
      * This prevents threads clone()ing after running the syscall and
@@ -245,11 +250,8 @@ static void psx_posix_syscall_actor(int signum, siginfo_t *info, void *ignore) {
      * has already happened. However, figuring that out for an
      * unblocked thread is hard, so we prevent it from happening.
      */
-    while (psx_tracker.cmd.active) {
-	psx_cond_wait();
-    }
-    psx_tracker.incomplete--;
     psx_unlock();
+    psx_await_release();
 }
 
 /*
@@ -7,6 +7,7 @@ import (
 	"runtime"
 	"sync"
 	"syscall"
+	"time"
 )
 
 // #include <errno.h>
@@ -41,6 +42,39 @@ func forceFatal() {
 	})
 }
 
+// EnableStats enables (or disables) the collection of psx statistics.
+func EnableStats(enable bool) {
+	v := C.int(0)
+	if enable {
+		v = 1
+	}
+	C.psx_enable_stats(v)
+}
+
+// ResetStats zeros the psx statistics.
+func ResetStats() {
+	C.psx_reset_stats()
+}
+
+// GetStats returns the psx statistics collected so far.
+func GetStats() Stats {
+	var s C.psx_stats_t
+	C.psx_get_stats(&s)
+	return Stats{
+		Broadcasts:      uint64(s.broadcasts),
+		Sweeps:          uint64(s.sweeps),
+		MaxSweeps:       uint64(s.max_sweeps),
+		ThreadsSignaled: uint64(s.threads_signaled),
+		MapCollisions:   uint64(s.map_collisions),
+		MapRehashes:     uint64(s.map_rehashes),
+		BroadcastMax:    time.Duration(s.broadcast_max_ns),
+		BroadcastTotal:  time.Duration(s.broadcast_total_ns),
+		AckMax:          time.Duration(s.ack_max_ns),
+		AckP50:          time.Duration(s.ack_p50_ns),
+		AckP99:          time.Duration(s.ack_p99_ns),
+	}
+}
+
 //go:uintptrescapes
 
 // Syscall3 performs a 3 argument syscall. Syscall3 differs from
@@ -77,6 +77,26 @@ long int psx_syscall6(long int syscall_nr,
 		      long int arg1, long int arg2, long int arg3,
 		      long int arg4, long int arg5, long int arg6);
 
+/*
+ * psx_call_t holds one system call of a psx_syscall_batch()
+ * sequence. Unused arguments should be zero.
+ */
+typedef struct {
+    long int syscall_nr;
+    long int arg[6];
+} psx_call_t;
+
+/*
+ * psx_syscall_batch performs a sequence of n system calls with POSIX
+ * semantics, using a single signal delivery per thread. The calls are
+ * performed in order and the sequence stops at the first call that
+ * fails (returns -1). The return value is the number of calls that
+ * succeeded, which is also the number performed by all of the other
+ * threads. If this is less than n, errno holds the error of the
+ * failing call. -1 is returned if the arguments are invalid.
+ */
+int psx_syscall_batch(const psx_call_t *calls, int n);
+
 /*
  * This function should be used by systems to obtain pointers to the
  * two syscall functions provided by the PSX library. A linkage trick
@@ -91,6 +111,65 @@ void psx_load_syscalls(long int (**syscall_fn)(long int,
 						long int, long int, long int,
 						long int, long int, long int));
 
+/*
+ * psx_load_syscall_batch is the psx_syscall_batch() equivalent of
+ * psx_load_syscalls().
+ */
+void psx_load_syscall_batch(int (**batch_fn)(const psx_call_t *calls, int n));
+
+/*
+ * psx_syscall_async is a non-blocking version of psx_syscall(). The
+ * system call is performed immediately on the calling thread, and a
+ * helper thread completes the broadcast to the other threads. The
+ * returned handle provides a pollable file descriptor that becomes
+ * readable when the broadcast is complete. The result of the system
+ * call on the calling thread can then be obtained with
+ * psx_async_wait() and the per-thread results of the other threads
+ * with psx_async_results(). Other psx calls block until the broadcast
+ * is complete. The handle must be released with psx_async_free().
+ */
+typedef struct psx_async_s psx_async_t;
+
+typedef struct {
+    long int tid;
+    long int retval;
+} psx_thread_result_t;
+
+psx_async_t *psx_syscall_async(const psx_call_t *call);
+int psx_async_fd(const psx_async_t *async);
+int psx_async_done(const psx_async_t *async);
+long int psx_async_wait(psx_async_t *async);
+int psx_async_results(psx_async_t *async, psx_thread_result_t *results,
+		      int max);
+void psx_async_free(psx_async_t *async);
+
+/*
+ * psx_stats_t holds the opt-in statistics of the psx mechanism.
+ * Collection is enabled with psx_enable_stats(1), or by setting the
+ * PSX_STATS environment variable, which also causes the statistics to
+ * be written to stderr when the program exits. The ack latencies
+ * measure the time from signaling a thread until it has performed
+ * the system call. The percentile values are upper bounds with a
+ * power of 2 resolution.
+ */
+typedef struct {
+    unsigned long broadcasts;          /* completed broadcasts */
+    unsigned long sweeps;              /* reads of /proc/<pid>/task */
+    unsigned long max_sweeps;          /* most sweeps in one broadcast */
+    unsigned long threads_signaled;    /* threads signaled */
+    unsigned long map_collisions;      /* extra thread map probes */
+    unsigned long map_rehashes;        /* thread map grows */
+    unsigned long broadcast_max_ns;    /* slowest broadcast */
+    unsigned long broadcast_total_ns;  /* time spent in all broadcasts */
+    unsigned long ack_max_ns;          /* slowest thread acknowledgement */
+    unsigned long ack_p50_ns;          /* median acknowledgement */
+    unsigned long ack_p99_ns;          /* 99th percentile acknowledgement */
+} psx_stats_t;
+
+void psx_enable_stats(int enable);
+int psx_get_stats(psx_stats_t *stats);
+void psx_reset_stats(void);
+
 /*
  * psx_sensitivity_t holds the level of paranoia for non-POSIX syscall
  * behavior. The default is PSX_IGNORE: which is best effort - no
@@ -112,6 +191,21 @@ typedef enum {
  */
 int psx_set_sensitivity(psx_sensitivity_t level);
 
+/*
+ * psx_register_thread optionally adds the calling thread to a
+ * registry of threads that psx_syscall() signals directly. Without
+ * it, every psx_syscall() must discover all threads by repeatedly
+ * reading /proc/<pid>/task, which is slow for processes with many
+ * threads. With all threads registered, /proc is only read once to
+ * confirm that no unregistered threads exist. Registered threads are
+ * deregistered automatically when they exit. Threads created via the
+ * legacy -Wl,--wrap=pthread_create linkage are registered
+ * automatically. psx_register_thread() returns 0 on success and -1 on
+ * failure. psx_unregister_thread() undoes a registration.
+ */
+int psx_register_thread(void);
+void psx_unregister_thread(void);
+
 #ifdef __cplusplus
 }
 #endif
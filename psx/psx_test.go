@@ -107,3 +107,19 @@ func TestShared(t *testing.T) {
 	}
 	wg.Wait()
 }
+
+func TestStats(t *testing.T) {
+	EnableStats(true)
+	defer EnableStats(false)
+	ResetStats()
+	if _, _, err := Syscall3(syscall.SYS_GETPID, 0, 0, 0); err != 0 {
+		t.Fatalf("failed to get PID via libpsx: %v", err)
+	}
+	s := GetStats()
+	if s.Broadcasts != 1 {
+		t.Errorf("got %d broadcasts, want 1: %+v", s.Broadcasts, s)
+	}
+	if s.BroadcastMax <= 0 || s.BroadcastTotal < s.BroadcastMax {
+		t.Errorf("bad broadcast timing: %+v", s)
+	}
+}
@@ -0,0 +1,32 @@
+//go:build linux
+// +build linux
+
+package psx // import "kernel.org/pub/linux/libs/security/libcap/psx"
+
+import "time"
+
+// Stats holds the opt-in statistics of the psx mechanism. They are
+// only collected after EnableStats(true) has been called, or if the
+// PSX_STATS environment variable was set when the program started.
+//
+// If CGO_ENABLED=1 these mirror the libpsx psx_stats_t values. The
+// ack latencies measure the time from signaling a thread until it
+// has performed the system call, and the percentile values are upper
+// bounds with a power of 2 resolution.
+//
+// If CGO_ENABLED=0 the Go runtime performs the broadcast internally,
+// so only the Broadcasts, BroadcastMax and BroadcastTotal values are
+// collected.
+type Stats struct {
+	Broadcasts      uint64
+	Sweeps          uint64
+	MaxSweeps       uint64
+	ThreadsSignaled uint64
+	MapCollisions   uint64
+	MapRehashes     uint64
+	BroadcastMax    time.Duration
+	BroadcastTotal  time.Duration
+	AckMax          time.Duration
+	AckP50          time.Duration
+	AckP99          time.Duration
+}
@@ -26,14 +26,13 @@ struct test_case_s {
     const char *iab;
     cap_mode_t mode;
     int launch_abort;
+    int compile;
     int result;
     int (*callback_fn)(void *detail);
 };
 
-#ifdef WITH_PTHREADS
 #include <pthread.h>
-#else /* WITH_PTHREADS */
-#endif /* WITH_PTHREADS */
+#include <sys/prctl.h>
 
 /*
  * clean_out drops all process capabilities.
@@ -48,6 +47,80 @@ static int clean_out(void *data) {
     return 0;
 }
 
+/*
+ * ambient_launch launches attr, a launcher of a program that checks
+ * for an ambient cap_net_raw. The launcher is configured to leave the
+ * ambient set empty, so the check should fail. It returns 0 if it does.
+ */
+static int ambient_launch(cap_launch_t attr)
+{
+    int result;
+    pid_t child;
+
+    if ((child = cap_launch(attr, NULL)) <= 0) {
+	perror("failed to launch");
+	return -1;
+    }
+    if (waitpid(child, &result, 0) != child || result != 256) {
+	fprintf(stderr, "ambient capability leaked into launched program\n");
+	return -1;
+    }
+    return 0;
+}
+
+struct ambient_s {
+    int compile;
+    int ret;
+};
+
+/*
+ * ambient_worker raises an ambient capability in a thread that is not
+ * the thread group leader, and launches from that thread with a
+ * CAP_MODE_PURE1E launcher. If a->compile is set, it instead uses an
+ * IAB launcher that keeps only the inheritable cap_net_raw, and
+ * compiles it before the ambient capability is raised, while the
+ * ambient set is still empty.
+ */
+static void *ambient_worker(void *data)
+{
+    struct ambient_s *a = data;
+    const char *args[] = { "../progs/tcapsh-static", "--has-a=cap_net_raw",
+			   NULL };
+    const cap_value_t raw = CAP_NET_RAW;
+    cap_t orig = cap_get_proc(), working = cap_dup(orig);
+    cap_launch_t attr = cap_new_launcher(args[0], args, NULL);
+    cap_iab_t iab = cap_iab_from_text("cap_net_raw");
+
+    a->ret = -1;
+    if (attr != NULL && !a->compile) {
+	cap_launcher_set_mode(attr, CAP_MODE_PURE1E);
+    } else if (attr != NULL && iab != NULL) {
+	cap_free(cap_launcher_set_iab(attr, iab));
+	iab = NULL;
+    }
+    if (attr == NULL) {
+	perror("failed to obtain launcher");
+    } else if (working == NULL
+	       || cap_set_flag(working, CAP_INHERITABLE, 1, &raw, CAP_SET)
+	       || cap_set_proc(working)) {
+	perror("unable to raise an inheritable capability");
+    } else if (a->compile && cap_launcher_compile(attr) < 0) {
+	perror("failed to compile launcher");
+    } else if (prctl(PR_CAP_AMBIENT, PR_CAP_AMBIENT_RAISE, CAP_NET_RAW,
+		     0, 0)) {
+	perror("unable to raise an ambient capability");
+    } else {
+	a->ret = ambient_launch(attr);
+    }
+    prctl(PR_CAP_AMBIENT, PR_CAP_AMBIENT_CLEAR_ALL, 0, 0, 0);
+    cap_set_proc(orig);
+    cap_free(iab);
+    cap_free(attr);
+    cap_free(working);
+    cap_free(orig);
+    return NULL;
+}
+
 int main(int argc, char **argv) {
     static struct test_case_s vs[] = {
 	{
@@ -115,6 +188,28 @@ int main(int argc, char **argv) {
 	    .result = 0,
 	    .chroot = ".",
 	},
+	{
+	    .args = { "../progs/tcapsh-static", "--is-uid=123" },
+	    .uid = 123,
+	    .compile = 1,
+	    .result = 0
+	},
+	{
+	    .args = { "../progs/tcapsh-static", "--has-a=cap_setuid",
+		      "--is-uid=123", "--is-gid=456" },
+	    .uid = 123,
+	    .gid = 456,
+	    .iab = "^cap_setuid",
+	    .compile = 1,
+	    .result = 0
+	},
+	{
+	    .args = { "/noop" },
+	    .chroot = ".",
+	    .mode = CAP_MODE_PURE1E_INIT,
+	    .compile = 1,
+	    .result = 0
+	},
 	{
 	    .pass_on = NO_MORE
 	},
@@ -182,6 +277,17 @@ int main(int argc, char **argv) {
 	    cap_launcher_set_mode(attr, v->mode);
 	}
 
+	if (v->compile) {
+	    int n = cap_launcher_compile(attr);
+	    if (n <= 0) {
+		fprintf(stderr, "[%d] failed to compile launcher: ", i);
+		perror("");
+		success = 0;
+		continue;
+	    }
+	    printf("[%d] compiled to %d system calls\n", i, n);
+	}
+
 	pid_t child = cap_launch(attr, NULL);
 
 	if (child <= 0) {
@@ -214,6 +320,22 @@ int main(int argc, char **argv) {
 	}
     }
 
+    for (i = 0; i < 2; i++) {
+	pthread_t worker;
+	struct ambient_s a = { .compile = i };
+	printf("[thread%s] ambient launch from a non-leader thread should work\n",
+	       i ? ",compiled" : "");
+	if (pthread_create(&worker, NULL, ambient_worker, &a)) {
+	    perror("unable to start worker thread");
+	    success = 0;
+	    continue;
+	}
+	pthread_join(worker, NULL);
+	if (a.ret) {
+	    success = 0;
+	}
+    }
+
     cap_t final = cap_get_proc();
     if (final == NULL) {
 	perror("unable to get final capabilities");
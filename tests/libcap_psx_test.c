@@ -41,6 +41,94 @@ static void *thread_fork_exit(void *data) {
     return NULL;
 }
 
+static pthread_barrier_t privileged_barrier;
+
+static void *probe_keepcaps(void *data) {
+    pthread_barrier_wait(&privileged_barrier);
+    *(long int *) data = prctl(PR_GET_KEEPCAPS, 0, 0, 0, 0);
+    return NULL;
+}
+
+/*
+ * psx_wired confirms that libcap broadcasts its system calls with
+ * libpsx. It does not in a dynamic build where libcap.so keeps its
+ * own weak psx_load_syscalls() and psx_load_syscall_batch().
+ */
+static int psx_wired(void) {
+    pthread_t peer;
+    long int start = prctl(PR_GET_KEEPCAPS, 0, 0, 0, 0), seen = start;
+
+    pthread_barrier_init(&privileged_barrier, NULL, 2);
+    pthread_create(&peer, NULL, probe_keepcaps, &seen);
+    if (cap_prctlw(PR_SET_KEEPCAPS, !start, 0, 0, 0, 0)) {
+	perror("FAILED: unable to set keepcaps");
+	exit(1);
+    }
+    pthread_barrier_wait(&privileged_barrier);
+    pthread_join(peer, NULL);
+    pthread_barrier_destroy(&privileged_barrier);
+    if (cap_prctlw(PR_SET_KEEPCAPS, start, 0, 0, 0, 0)) {
+	perror("FAILED: unable to restore keepcaps");
+	exit(1);
+    }
+    return seen != start;
+}
+
+static void *check_privileged(void *data) {
+    pthread_barrier_wait(&privileged_barrier);
+    if (cap_get_bound(CAP_SYS_BOOT) != 0) {
+	printf("FAILED: thread bounding set not changed\n");
+	exit(1);
+    }
+    if (cap_get_secbits() != *(unsigned *) data) {
+	printf("FAILED: thread secbits=0x%x, want 0x%x\n",
+	       cap_get_secbits(), *(unsigned *) data);
+	exit(1);
+    }
+    return NULL;
+}
+
+/*
+ * When privileged, confirm that IAB and mode changes, which libpsx
+ * applies with a single broadcast, reach all threads.
+ */
+static void test_privileged(void) {
+    cap_flag_value_t setpcap = CAP_CLEAR;
+    cap_t orig = cap_get_proc();
+    if (orig == NULL ||
+	cap_get_flag(orig, CAP_SETPCAP, CAP_PERMITTED, &setpcap) ||
+	setpcap != CAP_SET || cap_get_bound(CAP_SYS_BOOT) != 1) {
+	printf(" (skipping privileged test)");
+	cap_free(orig);
+	return;
+    }
+    cap_free(orig);
+    if (!psx_wired()) {
+	printf(" (skipping privileged test: libcap not using libpsx)");
+	return;
+    }
+
+    pthread_t peer;
+    unsigned secbits = 0;
+    pthread_barrier_init(&privileged_barrier, NULL, 2);
+    pthread_create(&peer, NULL, check_privileged, &secbits);
+
+    cap_iab_t iab = cap_iab_from_text("!cap_sys_boot");
+    if (iab == NULL || cap_iab_set_proc(iab)) {
+	perror("FAILED: unable to set iab");
+	exit(1);
+    }
+    cap_free(iab);
+    if (cap_set_mode(CAP_MODE_PURE1E)) {
+	perror("FAILED: unable to set mode");
+	exit(1);
+    }
+    secbits = cap_get_secbits();
+
+    pthread_barrier_wait(&privileged_barrier);
+    pthread_join(peer, NULL);
+}
+
 int main(int argc, char **argv) {
     int i;
     printf("hello libcap and libpsx ");
@@ -69,6 +157,7 @@ int main(int argc, char **argv) {
 	}
 	usleep(1000);
     }
+    test_privileged();
     printf(" PASSED\n");
     exit(0);
 }
@@ -2,6 +2,8 @@
 #define _DEFAULT_SOURCE
 #endif
 
+#include <errno.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -45,6 +47,12 @@ int started = 0;
 static void *say_hello(void *args) {
     int count = 0;
 
+    /* Exercise a mix of registered and unregistered threads. */
+    if (args != NULL && psx_register_thread()) {
+	perror("failed to register thread");
+	exit(1);
+    }
+
     pthread_mutex_lock(&mu);
     started++;
     int this_step = step+1;
@@ -83,6 +91,11 @@ int main(int argc, char **argv) {
 	exit(0);
     }
 
+    if (psx_register_thread()) {
+	perror("failed to register main thread");
+	exit(1);
+    }
+
     for (i = 0; i<10; i++) {
 	printf("iteration [%d]: %d\n", getpid(), i);
 
@@ -92,7 +105,59 @@ int main(int argc, char **argv) {
 	step = i;
 	pthread_mutex_unlock(&mu);
 
-	psx_syscall(SYS_prctl, PR_SET_KEEPCAPS, global_kept);
+	if (i & 1) {
+	    /* The final call is invalid and ends the sequence. */
+	    psx_call_t calls[3] = {
+		{ .syscall_nr = SYS_prctl,
+		  .arg = { PR_SET_KEEPCAPS, !global_kept } },
+		{ .syscall_nr = SYS_prctl,
+		  .arg = { PR_SET_KEEPCAPS, global_kept } },
+		{ .syscall_nr = SYS_prctl, .arg = { -1 } },
+	    };
+	    errno = 0;
+	    int done = psx_syscall_batch(calls, 3);
+	    if (done != 2 || errno != EINVAL) {
+		printf("--> FAILURE batch returned %d (errno=%d)\n", done, errno);
+		exit(1);
+	    }
+	} else if (i % 4 == 2) {
+	    psx_call_t call = {
+		.syscall_nr = SYS_prctl,
+		.arg = { PR_SET_KEEPCAPS, global_kept },
+	    };
+	    errno = 0;
+	    if (psx_syscall_async(NULL) != NULL || errno != EINVAL) {
+		printf("--> FAILURE async accepted a NULL call\n");
+		exit(1);
+	    }
+	    psx_async_t *async = psx_syscall_async(&call);
+	    if (async == NULL) {
+		perror("--> FAILURE async");
+		exit(1);
+	    }
+	    struct pollfd pfd = { .fd = psx_async_fd(async), .events = POLLIN };
+	    if (poll(&pfd, 1, -1) != 1 || !psx_async_done(async) ||
+		psx_async_wait(async) != 0) {
+		printf("--> FAILURE async did not complete\n");
+		exit(1);
+	    }
+	    psx_thread_result_t results[3];
+	    int j, n = psx_async_results(async, results, 3);
+	    if (n != launched) {
+		printf("--> FAILURE async results=%d, want %d\n", n, launched);
+		exit(1);
+	    }
+	    for (j = 0; j < n; j++) {
+		if (results[j].retval != 0) {
+		    printf("--> FAILURE async tid=%ld retval=%ld\n",
+			   results[j].tid, results[j].retval);
+		    exit(1);
+		}
+	    }
+	    psx_async_free(async);
+	} else {
+	    psx_syscall(SYS_prctl, PR_SET_KEEPCAPS, global_kept);
+	}
 
 	pthread_mutex_lock(&mu);
 	step++;
@@ -120,7 +185,7 @@ int main(int argc, char **argv) {
 		}
 	    }
 	    launched++;
-	    pthread_create(&tid[i], NULL, say_hello, NULL);
+	    pthread_create(&tid[i], NULL, say_hello, (i == 1) ? &mu : NULL);
 	    /* Confirm that the thread is started. */
 	    pthread_mutex_lock(&mu);
 	    while (started < launched) {